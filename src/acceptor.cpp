@@ -17,27 +17,199 @@
  */
 
 #include "acceptor.hpp"
+#include "rate_limiter.hpp"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/filter.h>
 
 namespace smms
 {
 
+namespace {
+
+void run_plain_session(stream_socket&& peer, config const& cfg, buffer_type buffer)
+{
+   std::allocate_shared<plain_session>(
+      allocator_type {connection_pool()},
+      std::move(peer),
+      cfg,
+      std::move(buffer))->run();
+}
+
+void run_tls_session(
+   stream_socket&& peer,
+   ssl::context& ctx,
+   config const& cfg,
+   buffer_type buffer)
+{
+   if (ktls_enabled(ctx)) {
+      std::allocate_shared<ktls_session>(
+         allocator_type {connection_pool()},
+         std::move(peer),
+         ctx,
+         cfg,
+         std::move(buffer))->run();
+      return;
+   }
+
+   std::allocate_shared<ssl_session>(
+      allocator_type {connection_pool()},
+      std::move(peer),
+      ctx,
+      cfg,
+      std::move(buffer))->run();
+}
+
+stream_socket adopt(tcp::socket&& peer)
+{
+   // Handshake messages and responses are written in few large
+   // writes, Nagle only delays them.
+   beast::error_code ec;
+   peer.set_option(tcp::no_delay {true}, ec);
+   return std::move(peer);
+}
+
+stream_socket adopt(net::local::stream_protocol::socket&& peer)
+{
+   return std::move(peer);
+}
+
+bool listen_options(tcp::acceptor& acc, tcp::endpoint const& endpoint)
+{
+   int one = 1;
+   auto const ret =
+      setsockopt( acc.native_handle()
+                , SOL_SOCKET
+                , SO_REUSEPORT
+                , &one, sizeof(one));
+
+   if (ret == -1) {
+      log::write( log::level::err
+                , "Unable to set socket option SO_REUSEPORT: {0}"
+                , strerror(errno));
+   }
+
+   // Accepts IPv4 too when bound to ::.
+   if (endpoint.address().is_v6()) {
+      beast::error_code ec;
+      acc.set_option(ip::v6_only {false}, ec);
+   }
+
+   return true;
+}
+
+// A socket left by a previous run is removed, anything else at the
+// path is most likely a mistake in the configuration.
+bool
+listen_options(
+   net::local::stream_protocol::acceptor&,
+   net::local::stream_protocol::endpoint const& endpoint)
+{
+   auto const path = endpoint.path();
+
+   struct stat st;
+   if (::lstat(path.c_str(), &st) == -1)
+      return true;
+
+   if (!S_ISSOCK(st.st_mode)) {
+      log::write( log::level::err
+                , "acceptor::run: {0} exists and is not a socket."
+                , path);
+      return false;
+   }
+
+   ::unlink(path.c_str());
+   return true;
+}
+
+void steer_options(tcp::acceptor& acc, int cpu, std::size_t group_size)
+{
+   auto const fd = acc.native_handle();
+   if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu) == -1) {
+      log::write( log::level::err
+                , "Unable to set socket option SO_INCOMING_CPU: {0}"
+                , strerror(errno));
+   }
+
+   if (group_size == 0)
+      return;
+
+   // A = cpu % group_size, the index of the listener in the group.
+   sock_filter code[] =
+   { {BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<std::uint32_t>(SKF_AD_OFF + SKF_AD_CPU)}
+   , {BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<std::uint32_t>(group_size)}
+   , {BPF_RET | BPF_A, 0, 0, 0}
+   };
+
+   sock_fprog prog {static_cast<unsigned short>(std::size(code)), code};
+   if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == -1) {
+      log::write( log::level::err
+                , "Unable to attach the reuseport program: {0}"
+                , strerror(errno));
+   }
+}
+
+void
+steer_options(
+   net::local::stream_protocol::acceptor&,
+   int,
+   std::size_t)
+{
+}
+
+// Rejected connections are closed before any session state is made,
+// that is all an abusive client costs.
+bool admit(config const& cfg, tcp::endpoint const& peer)
+{
+   return !cfg.limiter || cfg.limiter->admit_connection(peer.address());
+}
+
+// Connections on Unix domain sockets come from the same host.
+bool admit(config const&, net::local::stream_protocol::endpoint const&)
+{
+   return true;
+}
+
+auto to_string(tcp::endpoint const& endpoint)
+{
+   return fmt::format("{}", endpoint);
+}
+
+auto to_string(net::local::stream_protocol::endpoint const& endpoint)
+{
+   return endpoint.path();
+}
+
+}
+
+std::optional<protocol> to_protocol(std::string_view s) noexcept
+{
+   if (s == "plain") return protocol::plain;
+   if (s == "tls") return protocol::tls;
+   if (s == "auto") return protocol::automatic;
+   return {};
+}
+
 class detect_session : public std::enable_shared_from_this<detect_session> {
 private:
-   beast::tcp_stream stream_;
+   plain_stream stream_;
    ssl::context& ctx_;
-   beast::flat_buffer buffer_;
+   buffer_type buffer_;
    config const& cfg_;
 
 public:
-   detect_session(tcp::socket&& socket, ssl::context& ctx, config const& w)
+   detect_session(stream_socket&& socket, ssl::context& ctx, config const& w)
    : stream_(std::move(socket))
    , ctx_(ctx)
+   , buffer_ {allocator_type {connection_pool()}}
    , cfg_ {w}
    { }
 
    void run()
    {
-      beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+      auto const timeout = std::chrono::seconds(cfg_.handshake_timeout);
+      beast::get_lowest_layer(stream_).expires_after(timeout);
 
       async_detect_ssl(
          stream_,
@@ -53,38 +225,36 @@ public:
       }
 
       if (result) {
-          std::make_shared<ssl_session>(
-              stream_.release_socket(),
-              ctx_,
-              cfg_,
-              std::move(buffer_))->run();
-          return;
+         run_tls_session(stream_.release_socket(), ctx_, cfg_, std::move(buffer_));
+         return;
       }
 
-      std::make_shared<plain_session>(
-         stream_.release_socket(),
-	 cfg_,
-         std::move(buffer_))->run();
+      run_plain_session(stream_.release_socket(), cfg_, std::move(buffer_));
    }
 };
 
-acceptor::acceptor(net::io_context& ioc, ssl::context& ctx)
+template <class Protocol>
+basic_acceptor<Protocol>::
+basic_acceptor(net::io_context& ioc, ssl::context& ctx, protocol p)
 : ctx_(ctx)
 , acceptor_ {ioc}
+, protocol_ {p}
 { }
 
-void acceptor::do_accept(config const& w)
+template <class Protocol>
+void basic_acceptor<Protocol>::do_accept(config const& w)
 {
-   auto f = [this, &w](auto const& ec, auto socket)
+   auto f = [this, &w](boost::system::error_code const& ec, socket_type socket)
       { on_accept(w, ec, std::move(socket)); };
 
-   acceptor_.async_accept(f);
+   acceptor_.async_accept(peer_, f);
 }
 
-void acceptor::
+template <class Protocol>
+void basic_acceptor<Protocol>::
 on_accept(config const& w,
           boost::system::error_code ec,
-          net::ip::tcp::socket peer)
+          socket_type socket)
 {
    if (ec) {
       if (ec == net::error::operation_aborted) {
@@ -93,36 +263,40 @@ on_accept(config const& w,
       }
 
       log::write(log::level::info, "listener::on_accept: {0}", ec.message());
+   } else if (!admit(w, peer_)) {
+      log::write(log::level::debug, "listener::on_accept: Rate limited {0}", to_string(peer_));
    } else {
-      std::make_shared<detect_session>(
-	  std::move(peer),
-	  ctx_,
-	  w)->run();
+      auto peer = adopt(std::move(socket));
+      switch (protocol_) {
+	 case protocol::plain:
+	    run_plain_session(
+	       std::move(peer), w, buffer_type {allocator_type {connection_pool()}});
+	    break;
+	 case protocol::tls:
+	    run_tls_session(
+	       std::move(peer), ctx_, w, buffer_type {allocator_type {connection_pool()}});
+	    break;
+	 default:
+	    std::allocate_shared<detect_session>(
+	       allocator_type {connection_pool()},
+	       std::move(peer),
+	       ctx_,
+	       w)->run();
+      }
    }
 
    do_accept(w);
 }
 
-void acceptor::
+template <class Protocol>
+void basic_acceptor<Protocol>::
 run(config const& w,
-    unsigned short port,
+    endpoint_type const& endpoint,
     int max_listen_connections)
 {
-   tcp::endpoint endpoint {tcp::v4(), port};
    acceptor_.open(endpoint.protocol());
-
-   int one = 1;
-   auto const ret =
-      setsockopt( acceptor_.native_handle()
-                , SOL_SOCKET
-                , SO_REUSEPORT
-                , &one, sizeof(one));
-
-   if (ret == -1) {
-      log::write( log::level::err
-                , "Unable to set socket option SO_REUSEPORT: {0}"
-                , strerror(errno));
-   }
+   if (!listen_options(acceptor_, endpoint))
+      return;
 
    acceptor_.bind(endpoint);
 
@@ -134,17 +308,22 @@ run(config const& w,
    } else {
       log::write(log::level::info,
                  "acceptor:run: Listening on {}",
-                 acceptor_.local_endpoint());
+                 to_string(acceptor_.local_endpoint()));
 
       log::write(log::level::info,
-                 "acceptor:run: TCP backlog set to {}",
+                 "acceptor:run: Backlog set to {}",
                  max_listen_connections);
 
+      // The program is attached once the group exists.
+      if (incoming_cpu_ >= 0)
+         steer_options(acceptor_, incoming_cpu_, group_size_);
+
       do_accept(w);
    }
 }
 
-void acceptor::shutdown()
+template <class Protocol>
+void basic_acceptor<Protocol>::shutdown()
 {
    if (acceptor_.is_open()) {
       boost::system::error_code ec;
@@ -157,4 +336,7 @@ void acceptor::shutdown()
    }
 }
 
+template class basic_acceptor<tcp>;
+template class basic_acceptor<net::local::stream_protocol>;
+
 }
@@ -25,27 +25,85 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <optional>
+#include <string_view>
+
 namespace smms
 {
 
-class acceptor {
+// The protocol spoken on a listening port. Connections on auto ports
+// go through SSL detection first, which costs an extra read, timer and
+// allocation per connection.
+enum class protocol {plain, tls, automatic};
+
+// Parses "plain", "tls" or "auto".
+std::optional<protocol> to_protocol(std::string_view s) noexcept;
+
+/* Accepts connections on a TCP port, IPv4 or IPv6, or on a Unix
+ * domain socket and runs the sessions for the protocol.
+ */
+template <class Protocol>
+class basic_acceptor {
+public:
+   using endpoint_type = typename Protocol::endpoint;
+   using socket_type = typename Protocol::socket;
+
 private:
    ssl::context& ctx_;
-   net::ip::tcp::acceptor acceptor_;
+   typename Protocol::acceptor acceptor_;
+   protocol protocol_;
+
+   // Filled by async_accept, saves asking for the peer address when
+   // checking the rate limits.
+   endpoint_type peer_;
+
+   // See steer.
+   int incoming_cpu_ = -1;
+   std::size_t group_size_ = 0;
 
    void do_accept(config const& w);
    void on_accept(config const& w,
                   boost::system::error_code ec,
-                  net::ip::tcp::socket peer);
+                  socket_type peer);
 
 public:
-   acceptor(net::io_context& ioc, ssl::context& ctx);
+   basic_acceptor(net::io_context& ioc, ssl::context& ctx, protocol p);
+
+   // A stale socket file at the path of a Unix domain socket is
+   // removed before binding, the listener fails if the path is
+   // another kind of file.
    void run(config const& w,
-            unsigned short port,
+            endpoint_type const& endpoint,
             int max_listen_connections);
 
+   /* Steers the connections received on cpu to this listener, with
+    * SO_INCOMING_CPU. On the first listener of a port a non-zero
+    * group_size also attaches a reuseport BPF program that picks
+    * the listener with index cpu % group_size, the listeners of a
+    * port being indexed in the order they are run. Only for TCP and
+    * before run.
+    */
+   void steer(int cpu, std::size_t group_size) noexcept
+   {
+      incoming_cpu_ = cpu;
+      group_size_ = group_size;
+   }
+
+   endpoint_type local_endpoint() const
+      { return acceptor_.local_endpoint(); }
+
    void shutdown();
 };
 
-}
+using acceptor = basic_acceptor<tcp>;
+
+// For reverse proxies on the same host, connections skip the TCP
+// stack.
+using local_acceptor = basic_acceptor<net::local::stream_protocol>;
 
+extern template class basic_acceptor<tcp>;
+extern template class basic_acceptor<net::local::stream_protocol>;
+
+}
@@ -0,0 +1,553 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include <time.h>
+#include <stdlib.h>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <openssl/ssl.h>
+
+#include "utils.hpp"
+#include "logger.hpp"
+#include "session.hpp"
+#include "acceptor.hpp"
+
+using namespace smms;
+
+// Counts the allocations made by the thread that enables it. All
+// forms of new and delete are replaced, see the same in test.cpp.
+namespace counter {
+thread_local bool enabled = false;
+thread_local std::size_t allocations = 0;
+
+void* allocate(std::size_t n, std::align_val_t a) noexcept
+{
+   if (enabled)
+      ++allocations;
+
+   auto const align = static_cast<std::size_t>(a);
+   n = n ? n : 1;
+   if (align <= alignof(std::max_align_t))
+      return std::malloc(n);
+
+   return std::aligned_alloc(align, (n + align - 1) & ~(align - 1));
+}
+
+void* allocate(std::size_t n) noexcept
+{
+   return allocate(n, std::align_val_t {alignof(std::max_align_t)});
+}
+
+[[gnu::noinline]] void release(void* p) noexcept
+{
+   std::free(p);
+}
+}
+
+void* operator new(std::size_t n)
+{
+   if (auto p = counter::allocate(n))
+      return p;
+
+   throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t n, std::align_val_t a)
+{
+   if (auto p = counter::allocate(n, a))
+      return p;
+
+   throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t n) { return operator new(n); }
+void* operator new[](std::size_t n, std::align_val_t a) { return operator new(n, a); }
+
+void* operator new(std::size_t n, std::nothrow_t const&) noexcept
+   { return counter::allocate(n); }
+void* operator new[](std::size_t n, std::nothrow_t const&) noexcept
+   { return counter::allocate(n); }
+void* operator new(std::size_t n, std::align_val_t a, std::nothrow_t const&) noexcept
+   { return counter::allocate(n, a); }
+void* operator new[](std::size_t n, std::align_val_t a, std::nothrow_t const&) noexcept
+   { return counter::allocate(n, a); }
+
+void operator delete(void* p) noexcept { counter::release(p); }
+void operator delete(void* p, std::size_t) noexcept { counter::release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counter::release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { counter::release(p); }
+void operator delete(void* p, std::nothrow_t const&) noexcept { counter::release(p); }
+void operator delete(void* p, std::align_val_t, std::nothrow_t const&) noexcept { counter::release(p); }
+void operator delete[](void* p) noexcept { counter::release(p); }
+void operator delete[](void* p, std::size_t) noexcept { counter::release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counter::release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { counter::release(p); }
+void operator delete[](void* p, std::nothrow_t const&) noexcept { counter::release(p); }
+void operator delete[](void* p, std::align_val_t, std::nothrow_t const&) noexcept { counter::release(p); }
+
+namespace legacy {
+
+// The allocating query parser used before query_view, kept as a
+// reference for the benchmarks below.
+std::vector<std::string>
+parse_query(std::string const& in)
+{
+   static char seps[2] = {'=', '&'};
+
+   std::vector<std::string> ret;
+
+   auto const size = std::ssize(in);
+   auto a = 0;
+   auto b = 1;
+   auto last = 0;
+   for (auto i = 0; i < size; ++i) {
+      if (in[i] == seps[b])
+	 return {};
+
+      if (in[i] == seps[a]) {
+	 std::swap(a, b);
+	 ret.push_back(in.substr(last, i - last));
+	 last = i + 1;
+      }
+   }
+
+   if (last < std::ssize(in))
+      ret.push_back(in.substr(last));
+
+   if ((std::size(ret) & 1) != 0)
+      return {};
+
+   return ret;
+}
+
+std::string
+get_field_value(
+   std::vector<std::string> const& queries,
+   std::string const& field)
+{
+   auto match =
+      std::find(
+	 std::cbegin(queries),
+	 std::cend(queries),
+	 field);
+
+   auto const end = std::cend(queries);
+   if (match != end && match != std::prev(end))
+      return *++match;
+
+   return {};
+}
+
+} // legacy
+
+std::vector<std::string> const queries
+{ ""
+, "f1"
+, "f1="
+, "f1=v1"
+, "f1=v1&"
+, "f1=v1&f2"
+, "f1=v1&f2="
+, "f1=v1&f2=v2"
+, "f1=v1&f2=v2&"
+, "="
+, "&"
+, "f&v"
+, "=&v"
+, "a&b=v"
+, "width=200&height=300"
+, "hmac=e70959a5210d8e60685005197e54b556351b5f4a85cef3cedc4ce9ef5f1d0e89"
+};
+
+// Checks that both parsers agree on every input.
+bool check_equivalence()
+{
+   for (auto const& q : queries) {
+      std::vector<std::string> r;
+      for (auto const& e : query_view {q}) {
+	 r.push_back({e.key.data(), std::size(e.key)});
+	 r.push_back({e.value.data(), std::size(e.value)});
+      }
+
+      if (r != legacy::parse_query(q)) {
+	 std::cout << "Error: parsers disagree on '" << q << "'" << std::endl;
+	 return false;
+      }
+   }
+
+   return true;
+}
+
+template <class F>
+void run(char const* name, int iterations, F f)
+{
+   std::size_t sink = 0;
+   auto const begin = std::chrono::steady_clock::now();
+   for (auto i = 0; i < iterations; ++i)
+      sink += f();
+   auto const end = std::chrono::steady_clock::now();
+
+   std::chrono::duration<double, std::nano> const d = end - begin;
+   std::cout << name << ": " << d.count() / iterations << " ns/op"
+             << " (" << sink << ")" << std::endl;
+}
+
+/* Performs n TLS handshakes against a running server and prints the
+ * rate. With resume the session of the previous connection is offered
+ * to the server. A GET is sent on each connection so that TLS 1.3
+ * tickets, which arrive after the handshake, are received.
+ */
+int
+handshake_bench(
+   std::string const& host,
+   std::string const& port,
+   int n,
+   bool resume)
+{
+   net::io_context ioc;
+   ssl::context ctx {ssl::context::tls_client};
+   ctx.set_verify_mode(ssl::verify_none);
+
+   tcp::resolver resolver {ioc};
+   auto const endpoints = resolver.resolve(host, port);
+
+   SSL_SESSION* session = nullptr;
+   auto resumed = 0;
+
+   auto const begin = std::chrono::steady_clock::now();
+   for (auto i = 0; i < n; ++i) {
+      ssl::stream<tcp::socket> stream {ioc, ctx};
+      net::connect(stream.next_layer(), endpoints);
+      stream.next_layer().set_option(tcp::no_delay {true});
+      SSL_set_tlsext_host_name(stream.native_handle(), host.data());
+
+      if (resume && session)
+	 SSL_set_session(stream.native_handle(), session);
+
+      stream.handshake(ssl::stream_base::client);
+      resumed += SSL_session_reused(stream.native_handle());
+
+      http::request<http::empty_body> req {http::verb::get, "/", 11};
+      req.set(http::field::host, host);
+      http::write(stream, req);
+
+      beast::error_code ec;
+      beast::flat_buffer buffer;
+      http::response<http::string_body> res;
+      http::read(stream, buffer, res, ec);
+
+      if (resume) {
+	 if (session)
+	    SSL_SESSION_free(session);
+	 session = SSL_get1_session(stream.native_handle());
+      }
+
+      stream.shutdown(ec);
+   }
+   auto const end = std::chrono::steady_clock::now();
+
+   if (session)
+      SSL_SESSION_free(session);
+
+   std::chrono::duration<double> const d = end - begin;
+   std::cout << "handshakes" << (resume ? " (resume)" : "") << ": "
+             << n / d.count() << " per second, "
+             << resumed << " of " << n << " resumed" << std::endl;
+
+   return 0;
+}
+
+double thread_cpu_seconds()
+{
+   timespec ts;
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Serves n GET requests of a small file over loopback, one connection
+ * each, and prints the CPU time and the number of allocations the
+ * server thread spends per request. The first requests warm the pools
+ * up and are not counted.
+ */
+int session_bench(int n)
+{
+   char dir[] = "/tmp/smms-bench-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: mkdtemp" << std::endl;
+      return 1;
+   }
+
+   std::string const file = std::string {dir} + "/file.txt";
+   std::ofstream {file} << std::string(4096, 'a');
+
+   log::upto(log::level::notice);
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.host_names = {"localhost"};
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   net::io_context ioc {1};
+   tcp::acceptor acc {ioc, {net::ip::make_address("127.0.0.1"), 0}};
+   auto const endpoint = acc.local_endpoint();
+
+   auto const warmup = 100;
+   auto accepted = 0;
+   double cpu_begin = 0;
+
+   std::function<void()> do_accept = [&]() {
+      acc.async_accept([&](auto ec, tcp::socket peer) {
+	 if (ec)
+	    return;
+
+	 if (++accepted == warmup) {
+	    counter::allocations = 0;
+	    cpu_begin = thread_cpu_seconds();
+	 }
+
+	 peer.set_option(tcp::no_delay {true}, ec);
+	 buffer_type buffer {allocator_type {connection_pool()}};
+	 std::allocate_shared<plain_session>(
+	    allocator_type {connection_pool()},
+	    std::move(peer),
+	    cfg,
+	    std::move(buffer))->run();
+
+	 do_accept();
+      });
+   };
+
+   double cpu = 0;
+   std::size_t allocations = 0;
+   std::thread server {[&]() {
+      counter::enabled = true;
+      do_accept();
+      ioc.run();
+      cpu = thread_cpu_seconds() - cpu_begin;
+      allocations = counter::allocations;
+      counter::enabled = false;
+   }};
+
+   std::string const req =
+      "GET /file.txt HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "\r\n";
+
+   net::io_context client_ioc;
+   std::size_t received = 0;
+   for (auto i = 0; i < warmup + n; ++i) {
+      tcp::socket socket {client_ioc};
+      socket.connect(endpoint);
+      socket.set_option(tcp::no_delay {true});
+      net::write(socket, net::buffer(req));
+
+      beast::error_code ec;
+      std::string res;
+      net::read(socket, net::dynamic_buffer(res), ec);
+      if (i >= warmup)
+	 received += std::size(res);
+   }
+
+   net::post(ioc, [&]() { acc.close(); });
+   server.join();
+
+   std::remove(file.data());
+   std::remove(dir);
+
+   std::cout << "session<Derived>: "
+             << 1e6 * cpu / n << " us CPU/request, "
+             << static_cast<double>(allocations) / n << " allocations/request"
+             << " (" << received / n << " bytes)" << std::endl;
+
+   return 0;
+}
+
+// Fetches the file n times, one connection per request, and returns
+// the elapsed seconds.
+template <class Protocol>
+double
+fetch(
+   typename Protocol::endpoint const& endpoint,
+   std::string const& req,
+   int n,
+   std::size_t& received)
+{
+   net::io_context ioc;
+   auto const begin = std::chrono::steady_clock::now();
+   for (auto i = 0; i < n; ++i) {
+      typename Protocol::socket socket {ioc};
+      socket.connect(endpoint);
+      if constexpr (std::is_same_v<Protocol, tcp>)
+	 socket.set_option(tcp::no_delay {true});
+
+      net::write(socket, net::buffer(req));
+
+      beast::error_code ec;
+      std::string res;
+      net::read(socket, net::dynamic_buffer(res), ec);
+      received += std::size(res);
+   }
+
+   std::chrono::duration<double> const d =
+      std::chrono::steady_clock::now() - begin;
+
+   return d.count();
+}
+
+/* Compares the listeners a local reverse proxy can use, loopback TCP
+ * and a Unix domain socket, serving n GETs of a small thumbnail each.
+ * Server and client run in separate threads.
+ */
+int listener_bench(int n)
+{
+   char dir[] = "/tmp/smms-bench-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: mkdtemp" << std::endl;
+      return 1;
+   }
+
+   // The size of a typical 200x200 JPEG thumbnail.
+   std::string const file = std::string {dir} + "/thumb.jpg";
+   std::ofstream {file} << std::string(8 * 1024, 'a');
+   std::string const path = std::string {dir} + "/smms.sock";
+
+   log::upto(log::level::notice);
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.host_names = {"localhost"};
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   net::io_context ioc {1};
+   ssl::context ctx {ssl::context::tls_server};
+
+   acceptor tcp_acc {ioc, ctx, protocol::plain};
+   tcp_acc.run(cfg, {net::ip::make_address("127.0.0.1"), 0}, 511);
+
+   local_acceptor local_acc {ioc, ctx, protocol::plain};
+   local_acc.run(cfg, {path}, 511);
+
+   std::thread server {[&]() { ioc.run(); }};
+
+   std::string const req =
+      "GET /thumb.jpg HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "\r\n";
+
+   auto const warmup = 100;
+   std::size_t received = 0;
+   fetch<tcp>(tcp_acc.local_endpoint(), req, warmup, received);
+   fetch<net::local::stream_protocol>({path}, req, warmup, received);
+
+   std::size_t tcp_received = 0;
+   auto const tcp_time =
+      fetch<tcp>(tcp_acc.local_endpoint(), req, n, tcp_received);
+
+   std::size_t local_received = 0;
+   auto const local_time =
+      fetch<net::local::stream_protocol>({path}, req, n, local_received);
+
+   net::post(ioc, [&]() {
+      tcp_acc.shutdown();
+      local_acc.shutdown();
+   });
+   server.join();
+
+   std::remove(path.data());
+   std::remove(file.data());
+   std::remove(dir);
+
+   auto print = [n](char const* name, double t, std::size_t bytes) {
+      std::cout << name << ": "
+                << n / t << " requests/s, "
+                << bytes / t / (1024 * 1024) << " MiB/s" << std::endl;
+   };
+
+   print("loopback tcp", tcp_time, tcp_received);
+   print("unix socket", local_time, local_received);
+   return 0;
+}
+
+int main(int argc, char* argv[])
+{
+   // bench listeners n
+   if (argc >= 3 && std::string {argv[1]} == "listeners")
+      return listener_bench(std::stoi(argv[2]));
+
+   // bench sessions n
+   if (argc >= 3 && std::string {argv[1]} == "sessions")
+      return session_bench(std::stoi(argv[2]));
+
+   // bench handshake host port n [resume]
+   if (argc >= 5 && std::string {argv[1]} == "handshake") {
+      auto const resume = argc > 5 && std::string {argv[5]} == "resume";
+      return handshake_bench(argv[2], argv[3], std::stoi(argv[4]), resume);
+   }
+
+   if (!check_equivalence())
+      return 1;
+
+   auto const n = 1000000;
+
+   std::string const get_query = "width=200&height=300";
+   std::string const post_query =
+      "hmac=e70959a5210d8e60685005197e54b556351b5f4a85cef3cedc4ce9ef5f1d0e89";
+
+   run("legacy get query", n, [&]() {
+      auto const q = legacy::parse_query(get_query);
+      return std::size(legacy::get_field_value(q, "width")) +
+             std::size(legacy::get_field_value(q, "height"));
+   });
+
+   run("query_view get query", n, [&]() {
+      query_view const q {get_query};
+      std::string wb, hb;
+      return std::size(percent_decode(get_field_value(q, "width"), wb)) +
+             std::size(percent_decode(get_field_value(q, "height"), hb));
+   });
+
+   run("legacy post query", n, [&]() {
+      auto const q = legacy::parse_query(post_query);
+      return std::size(legacy::get_field_value(q, "hmac"));
+   });
+
+   run("query_view post query", n, [&]() {
+      query_view const q {post_query};
+      std::string b;
+      return std::size(percent_decode(get_field_value(q, "hmac"), b));
+   });
+}
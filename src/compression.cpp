@@ -0,0 +1,341 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "compression.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#include <zlib.h>
+#include <zstd.h>
+#include <brotli/encode.h>
+
+#include "logger.hpp"
+#include "utils.hpp"
+
+namespace smms
+{
+
+namespace {
+
+// Levels that cost little time per request.
+int dynamic_level(content_coding c) noexcept
+{
+   switch (c) {
+      case content_coding::gzip: return 6;
+      case content_coding::br: return 4;
+      case content_coding::zstd: return 3;
+      default: return 0;
+   }
+}
+
+bool compress_gzip(string_view in, std::string& out, int level)
+{
+   z_stream zs {};
+
+   // 16 adds the gzip header and trailer.
+   if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+
+   out.resize(deflateBound(&zs, std::size(in)));
+   zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+   zs.avail_in = std::size(in);
+   zs.next_out = reinterpret_cast<Bytef*>(out.data());
+   zs.avail_out = std::size(out);
+
+   auto const r = deflate(&zs, Z_FINISH);
+   out.resize(zs.total_out);
+   deflateEnd(&zs);
+   return r == Z_STREAM_END;
+}
+
+bool compress_br(string_view in, std::string& out, int level)
+{
+   auto n = BrotliEncoderMaxCompressedSize(std::size(in));
+   if (n == 0)
+      return false;
+
+   out.resize(n);
+   auto const ok = BrotliEncoderCompress(
+      level,
+      BROTLI_DEFAULT_WINDOW,
+      BROTLI_DEFAULT_MODE,
+      std::size(in),
+      reinterpret_cast<std::uint8_t const*>(in.data()),
+      &n,
+      reinterpret_cast<std::uint8_t*>(out.data()));
+
+   out.resize(ok ? n : 0);
+   return ok;
+}
+
+bool compress_zstd(string_view in, std::string& out, int level)
+{
+   out.resize(ZSTD_compressBound(std::size(in)));
+   auto const n =
+      ZSTD_compress(out.data(), std::size(out), in.data(), std::size(in), level);
+
+   if (ZSTD_isError(n)) {
+      out.clear();
+      return false;
+   }
+
+   out.resize(n);
+   return true;
+}
+
+}
+
+string_view coding_name(content_coding c) noexcept
+{
+   switch (c) {
+      case content_coding::gzip: return "gzip";
+      case content_coding::br: return "br";
+      case content_coding::zstd: return "zstd";
+      default: return "identity";
+   }
+}
+
+string_view coding_suffix(content_coding c) noexcept
+{
+   switch (c) {
+      case content_coding::gzip: return ".gz";
+      case content_coding::br: return ".br";
+      case content_coding::zstd: return ".zst";
+      default: return "";
+   }
+}
+
+coding_preference::coding_preference(string_view field) noexcept
+{
+   // Unset codings are -1, the wildcard gives them its weight.
+   constexpr auto count = content_coding_count;
+   std::array<int, count> weights;
+   weights.fill(-1);
+   auto wildcard = -1;
+
+   while (!std::empty(field)) {
+      auto const comma = field.find(',');
+      auto element = field.substr(0, comma);
+      field.remove_prefix(comma == string_view::npos ? std::size(field) : comma + 1);
+
+      auto const semicolon = element.find(';');
+      auto const token = trim_whitespace(element.substr(0, semicolon));
+      auto q = 1000;
+      if (semicolon != string_view::npos) {
+	 auto const param = trim_whitespace(element.substr(semicolon + 1));
+	 if (std::size(param) < 2 || (param[0] != 'q' && param[0] != 'Q') || param[1] != '=')
+	    continue;
+
+	 q = parse_qvalue(param.substr(2));
+	 if (q == -1)
+	    continue;
+      }
+
+      if (token == "*") {
+	 wildcard = q;
+	 continue;
+      }
+
+      for (std::size_t i = 0; i < count; ++i) {
+	 auto const c = static_cast<content_coding>(i);
+	 if (beast::iequals(token, coding_name(c)))
+	    weights[i] = q;
+      }
+
+      if (beast::iequals(token, "x-gzip"))
+	 weights[static_cast<std::size_t>(content_coding::gzip)] = q;
+   }
+
+   // Unlisted, identity ranks below the codings the client accepts,
+   // e.g. for gzip;q=0.8.
+   auto& identity = weights[static_cast<std::size_t>(content_coding::identity)];
+   if (identity == -1)
+      identity = 0;
+
+   for (auto& w : weights) {
+      if (w == -1)
+	 w = std::max(wildcard, 0);
+   }
+
+   // By how well they compress on ties, identity last.
+   using c = content_coding;
+   std::array<c, count> order {c::br, c::zstd, c::gzip, c::identity};
+   auto const weight = [&](c x) { return weights[static_cast<std::size_t>(x)]; };
+
+   // A stable insertion sort, std::stable_sort allocates a buffer.
+   for (std::size_t i = 1; i < count; ++i) {
+      for (auto j = i; j > 0 && weight(order[j]) > weight(order[j - 1]); --j)
+	 std::swap(order[j], order[j - 1]);
+   }
+
+   for (auto coding : order) {
+      if (coding == content_coding::identity)
+	 break;
+
+      if (weights[static_cast<std::size_t>(coding)] > 0)
+	 codings_[size_++] = coding;
+   }
+}
+
+int static_level(content_coding c) noexcept
+{
+   switch (c) {
+      case content_coding::gzip: return 9;
+      case content_coding::br: return 11;
+      case content_coding::zstd: return 19;
+      default: return 0;
+   }
+}
+
+bool compress(content_coding c, string_view in, std::string& out, int level)
+{
+   switch (c) {
+      case content_coding::gzip: return compress_gzip(in, out, level);
+      case content_coding::br: return compress_br(in, out, level);
+      case content_coding::zstd: return compress_zstd(in, out, level);
+      default: return false;
+   }
+}
+
+compression_cache::compression_cache(std::size_t capacity, std::size_t threads)
+: capacity_ {capacity}
+, pool_ {threads}
+{ }
+
+compression_cache::~compression_cache()
+{
+   pool_.join();
+}
+
+std::size_t
+compression_cache::key_hash::operator()(key_view const& k) const noexcept
+{
+   std::uint64_t const xs[] = {
+      static_cast<std::uint64_t>(k.v.mtime),
+      k.v.size,
+      static_cast<std::uint64_t>(k.c)};
+
+   std::uint64_t h = std::hash<std::string_view> {}(k.path);
+   for (auto x : xs)
+      h = (h ^ x) * 0x100000001b3;
+
+   return h;
+}
+
+bool
+compression_cache::key_equal::operator()(
+   key_view const& a,
+   key_view const& b) const noexcept
+{
+   return a.path == b.path
+       && a.v.mtime == b.v.mtime
+       && a.v.size == b.v.size
+       && a.c == b.c;
+}
+
+void compression_cache::make(key k)
+{
+   auto const v = k.v;
+   auto const c = k.c;
+   variant data;
+
+   std::size_t size = 0;
+   auto const fd = open_file(k.path.c_str(), size);
+   struct stat st;
+
+   // The file may have changed since it was asked for, it is then
+   // asked for with its new version.
+   auto const same =
+      fd &&
+      ::fstat(fd.get(), &st) == 0 &&
+      st.st_mtime == v.mtime &&
+      static_cast<std::uint64_t>(st.st_size) == v.size;
+
+   std::pmr::string in;
+   if (same && read_file(fd.get(), size, in)) {
+      try {
+	 std::string out;
+	 if (compress(c, in, out, dynamic_level(c)) && std::size(out) < std::size(in))
+	    data = std::make_shared<std::string const>(std::move(out));
+      } catch (std::exception const& e) {
+	 log::write(log::level::err, "compression_cache: {0}", e.what());
+      }
+   }
+
+   std::lock_guard lock {mutex_};
+   pending_.erase(k);
+   if (same)
+      insert(std::move(k), std::move(data));
+}
+
+void compression_cache::insert(key k, variant data)
+{
+   auto const n = std::size(k.path) + (data ? std::size(*data) : 0);
+   if (n > capacity_)
+      return;
+
+   entries_.push_front({std::move(k), std::move(data)});
+   index_[entries_.front().k.view()] = std::begin(entries_);
+   size_ += n;
+
+   while (size_ > capacity_) {
+      auto const& e = entries_.back();
+      size_ -= std::size(e.k.path) + (e.data ? std::size(*e.data) : 0);
+      index_.erase(e.k.view());
+      entries_.pop_back();
+   }
+}
+
+compression_cache::variant
+compression_cache::find(string_view path, version v, content_coding c)
+{
+   // Larger files would push most of the others out.
+   if (v.size > capacity_ / 4)
+      return nullptr;
+
+   key_view const kv {{path.data(), std::size(path)}, v, c};
+
+   std::lock_guard lock {mutex_};
+   auto const match = index_.find(kv);
+   if (match != std::end(index_)) {
+      entries_.splice(std::begin(entries_), entries_, match->second);
+      return match->second->data;
+   }
+
+   // Only the first request for a variant makes the owning key.
+   if (pending_.find(kv) != std::end(pending_))
+      return nullptr;
+
+   key k {std::string {kv.path}, v, c};
+   pending_.insert(k);
+   net::post(pool_, [this, k = std::move(k)]() mutable
+      { make(std::move(k)); });
+
+   return nullptr;
+}
+
+std::size_t compression_cache::size()
+{
+   std::lock_guard lock {mutex_};
+   return size_;
+}
+
+}
@@ -0,0 +1,168 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <list>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "net.hpp"
+#include "types.hpp"
+
+namespace smms
+{
+
+// Content codings of responses, see RFC 9110, 8.4.1.
+enum class content_coding : std::uint8_t {identity, gzip, br, zstd};
+
+constexpr std::size_t content_coding_count = 4;
+
+// The name in Accept-Encoding and Content-Encoding, e.g. br.
+string_view coding_name(content_coding c) noexcept;
+
+// The suffix of compressed siblings, e.g. .br, empty for identity.
+string_view coding_suffix(content_coding c) noexcept;
+
+/* The codings the client prefers to identity, best first, from its
+ * Accept-Encoding field, see RFC 9110, 12.5.3. The q-values are taken
+ * into account, codings with equal ones are ordered by how well they
+ * compress. Identity ranks last unless it is listed. Only identity is
+ * accepted without the field.
+ */
+class coding_preference {
+private:
+   std::array<content_coding, content_coding_count> codings_ {};
+   std::size_t size_ = 0;
+
+public:
+   coding_preference() = default;
+   explicit coding_preference(string_view accept_encoding) noexcept;
+
+   auto begin() const noexcept { return std::cbegin(codings_); }
+   auto end() const noexcept { return std::cbegin(codings_) + size_; }
+   auto empty() const noexcept { return size_ == 0; }
+};
+
+// Compresses in at the level, in the range of the library of the
+// coding. Returns false on failure.
+bool compress(content_coding c, string_view in, std::string& out, int level);
+
+// The highest levels worth their time for content compressed once and
+// served many times, e.g. siblings written after an upload.
+int static_level(content_coding c) noexcept;
+
+/* Compressed variants of files made on the fly. A variant is made on
+ * a thread of the cache the first time it is asked for, that request
+ * is served uncompressed and the later ones get the variant.
+ *
+ * The variants are kept up to a total size, the least recently used
+ * are dropped first. They are identified by the path, the mtime and
+ * the size of the file and the coding, so a file that changes gets new
+ * variants and the old ones age out.
+ */
+class compression_cache {
+public:
+   using variant = std::shared_ptr<std::string const>;
+
+   struct version {
+      std::int64_t mtime;
+      std::uint64_t size;
+   };
+
+private:
+   // Of a variant, so that looking it up allocates nothing.
+   struct key_view {
+      std::string_view path;
+      version v;
+      content_coding c;
+   };
+
+   struct key {
+      std::string path;
+      version v;
+      content_coding c;
+
+      key_view view() const noexcept { return {path, v, c}; }
+   };
+
+   struct key_hash {
+      using is_transparent = void;
+      std::size_t operator()(key_view const& k) const noexcept;
+      std::size_t operator()(key const& k) const noexcept
+         { return (*this)(k.view()); }
+   };
+
+   struct key_equal {
+      using is_transparent = void;
+      bool operator()(key_view const& a, key_view const& b) const noexcept;
+      bool operator()(key const& a, key_view const& b) const noexcept
+         { return (*this)(a.view(), b); }
+      bool operator()(key_view const& a, key const& b) const noexcept
+         { return (*this)(a, b.view()); }
+      bool operator()(key const& a, key const& b) const noexcept
+         { return (*this)(a.view(), b.view()); }
+   };
+
+   // Files that don't compress are remembered with a null variant.
+   struct entry {
+      key k;
+      variant data;
+   };
+
+   std::size_t const capacity_;
+   std::size_t size_ = 0;
+
+   std::mutex mutex_;
+
+   // Most recently used first, the index refers to their keys.
+   std::list<entry> entries_;
+   std::unordered_map<key_view, std::list<entry>::iterator, key_hash, key_equal> index_;
+   std::unordered_set<key, key_hash, key_equal> pending_;
+
+   net::thread_pool pool_;
+
+   void make(key k);
+   void insert(key k, variant data);
+
+public:
+   // Keeps up to capacity bytes, made on threads threads.
+   compression_cache(std::size_t capacity, std::size_t threads);
+
+   // Waits for the variants being made.
+   ~compression_cache();
+
+   compression_cache(compression_cache const&) = delete;
+   compression_cache& operator=(compression_cache const&) = delete;
+
+   // The variant of the file if it was made, otherwise it is made
+   // and null is returned. Also null for files that don't compress
+   // or are too large for the cache.
+   variant find(string_view path, version v, content_coding c);
+
+   // Bytes held.
+   std::size_t size();
+};
+
+}
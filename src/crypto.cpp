@@ -20,6 +20,7 @@
 
 #include <array>
 #include <string>
+#include <memory>
 #include <algorithm>
 #include <stdexcept>
 
@@ -37,7 +38,7 @@ void init_libsodium()
 namespace hmacsha256 {
 
 auth_type
-make_auth(std::string const& in, key_type const& key)
+make_auth(std::string_view in, key_type const& key)
 {
    auth_type ret;
 
@@ -50,7 +51,7 @@ make_auth(std::string const& in, key_type const& key)
    return ret;
 }
 
-int verify(auth_type const& auth, std::string const& in, key_type const& key)
+int verify(auth_type const& auth, std::string_view in, key_type const& key)
 {
    return
    crypto_auth_hmacsha256_verify(
@@ -77,4 +78,51 @@ std::string make_random_hex_key()
 }
 
 } // hmacsha256
+
+namespace blake2b {
+
+crypto_generichash_state* hasher::state() noexcept
+{
+   void* p = buffer_;
+   auto size = sizeof buffer_;
+   return static_cast<crypto_generichash_state*>(
+      std::align(64, sizeof(crypto_generichash_state), p, size));
+}
+
+hasher::hasher() noexcept
+{
+   crypto_generichash_init(state(), nullptr, 0, std::tuple_size_v<digest_type>);
+}
+
+void hasher::update(std::string_view in) noexcept
+{
+   crypto_generichash_update(
+      state(),
+      reinterpret_cast<unsigned char const*>(in.data()),
+      std::size(in));
+}
+
+digest_type hasher::digest() noexcept
+{
+   digest_type ret;
+   crypto_generichash_final(state(), ret.data(), std::size(ret));
+   return ret;
+}
+
+digest_type hash(std::string_view in) noexcept
+{
+   hasher h;
+   h.update(in);
+   return h.digest();
+}
+
+std::string to_hex(digest_type const& digest)
+{
+   std::string ret(2 * std::size(digest) + 1, 0);
+   sodium_bin2hex(ret.data(), std::size(ret), digest.data(), std::size(digest));
+   ret.pop_back();
+   return ret;
+}
+
+} // blake2b
 } // smms
@@ -20,6 +20,7 @@
 
 #include <array>
 #include <string>
+#include <string_view>
 
 #include <sodium.h>
 
@@ -38,13 +39,13 @@ using auth_type =
 
 auth_type
 make_auth(
-   std::string const& in,
+   std::string_view in,
    key_type const& key);
 
 int
 verify(
    auth_type const& auth,
-   std::string const& in,
+   std::string_view in,
    key_type const& key);
 
 key_type make_random_key();
@@ -52,4 +53,33 @@ std::string make_random_hex_key();
 
 } // hmacsha256
 
+namespace blake2b {
+
+using digest_type = std::array<unsigned char, 32>;
+
+// Hashes input given piecewise, e.g. a body while it is received.
+class hasher {
+private:
+   // The state must be aligned to 64 bytes, more than allocators
+   // guarantee, so it is placed in the buffer.
+   unsigned char buffer_[sizeof(crypto_generichash_state) + 64];
+
+   crypto_generichash_state* state() noexcept;
+
+public:
+   hasher() noexcept;
+
+   hasher(hasher const&) = delete;
+   hasher& operator=(hasher const&) = delete;
+
+   void update(std::string_view in) noexcept;
+   digest_type digest() noexcept;
+};
+
+digest_type hash(std::string_view in) noexcept;
+
+std::string to_hex(digest_type const& digest);
+
+} // blake2b
+
 } // smms
@@ -0,0 +1,415 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hpack.hpp"
+
+#include <array>
+#include <iterator>
+
+namespace smms::hpack
+{
+
+namespace {
+
+struct static_entry {
+   string_view name;
+   string_view value;
+};
+
+// RFC 7541, Appendix A.
+constexpr std::array<static_entry, 61> static_table
+{{ {":authority", ""}
+ , {":method", "GET"}
+ , {":method", "POST"}
+ , {":path", "/"}
+ , {":path", "/index.html"}
+ , {":scheme", "http"}
+ , {":scheme", "https"}
+ , {":status", "200"}
+ , {":status", "204"}
+ , {":status", "206"}
+ , {":status", "304"}
+ , {":status", "400"}
+ , {":status", "404"}
+ , {":status", "500"}
+ , {"accept-charset", ""}
+ , {"accept-encoding", "gzip, deflate"}
+ , {"accept-language", ""}
+ , {"accept-ranges", ""}
+ , {"accept", ""}
+ , {"access-control-allow-origin", ""}
+ , {"age", ""}
+ , {"allow", ""}
+ , {"authorization", ""}
+ , {"cache-control", ""}
+ , {"content-disposition", ""}
+ , {"content-encoding", ""}
+ , {"content-language", ""}
+ , {"content-length", ""}
+ , {"content-location", ""}
+ , {"content-range", ""}
+ , {"content-type", ""}
+ , {"cookie", ""}
+ , {"date", ""}
+ , {"etag", ""}
+ , {"expect", ""}
+ , {"expires", ""}
+ , {"from", ""}
+ , {"host", ""}
+ , {"if-match", ""}
+ , {"if-modified-since", ""}
+ , {"if-none-match", ""}
+ , {"if-range", ""}
+ , {"if-unmodified-since", ""}
+ , {"last-modified", ""}
+ , {"link", ""}
+ , {"location", ""}
+ , {"max-forwards", ""}
+ , {"proxy-authenticate", ""}
+ , {"proxy-authorization", ""}
+ , {"range", ""}
+ , {"referer", ""}
+ , {"refresh", ""}
+ , {"retry-after", ""}
+ , {"server", ""}
+ , {"set-cookie", ""}
+ , {"strict-transport-security", ""}
+ , {"transfer-encoding", ""}
+ , {"user-agent", ""}
+ , {"vary", ""}
+ , {"via", ""}
+ , {"www-authenticate", ""}
+}};
+
+// Code lengths of the Huffman code in RFC 7541, Appendix B, symbol
+// 256 is EOS. The code is canonical, so the codes follow from the
+// lengths.
+constexpr std::array<std::uint8_t, 257> huffman_lengths
+{ 13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28
+, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28
+, 6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6
+, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10
+, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
+, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6
+, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5
+, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28
+, 20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23
+, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24
+, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23
+, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23
+, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25
+, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27
+, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23
+, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+, 30
+};
+
+constexpr int max_code_length = 30;
+
+// Canonical decoding tables: codes of length n are first_code[n],
+// first_code[n] + 1, ... and belong to symbols[first_index[n]], ...
+struct huffman_table {
+   std::array<std::uint32_t, max_code_length + 1> first_code {};
+   std::array<std::uint16_t, max_code_length + 1> first_index {};
+   std::array<std::uint16_t, max_code_length + 1> count {};
+   std::array<std::uint16_t, 257> symbols {};
+};
+
+constexpr huffman_table make_huffman_table()
+{
+   huffman_table t;
+   for (auto len : huffman_lengths)
+      ++t.count[len];
+
+   std::uint32_t code = 0;
+   std::uint16_t index = 0;
+   for (auto n = 1; n <= max_code_length; ++n) {
+      code = (code + t.count[n - 1]) << 1;
+      t.first_code[n] = code;
+      t.first_index[n] = index;
+      index += t.count[n];
+   }
+
+   std::array<std::uint16_t, max_code_length + 1> next {};
+   for (std::uint16_t s = 0; s < 257; ++s) {
+      auto const len = huffman_lengths[s];
+      t.symbols[t.first_index[len] + next[len]++] = s;
+   }
+
+   return t;
+}
+
+constexpr auto huffman = make_huffman_table();
+
+static_assert(huffman.first_code[5] == 0);
+static_assert(huffman.symbols[0] == '0');
+static_assert(huffman.first_code[30] + huffman.count[30] == (1u << 30));
+
+// Prefix coded integer, RFC 7541, 5.1.
+bool read_integer(string_view& in, int prefix, std::uint64_t& value) noexcept
+{
+   if (std::empty(in))
+      return false;
+
+   auto const mask = (1u << prefix) - 1;
+   value = static_cast<unsigned char>(in[0]) & mask;
+   in.remove_prefix(1);
+   if (value < mask)
+      return true;
+
+   for (auto shift = 0; !std::empty(in); shift += 7) {
+      if (shift > 28)
+	 return false;
+
+      auto const b = static_cast<unsigned char>(in[0]);
+      in.remove_prefix(1);
+      value += static_cast<std::uint64_t>(b & 0x7f) << shift;
+      if ((b & 0x80) == 0)
+	 return true;
+   }
+
+   return false;
+}
+
+void write_integer(
+   std::pmr::string& out,
+   unsigned char first,
+   int prefix,
+   std::uint64_t value)
+{
+   auto const mask = (1u << prefix) - 1;
+   if (value < mask) {
+      out += static_cast<char>(first | value);
+      return;
+   }
+
+   out += static_cast<char>(first | mask);
+   value -= mask;
+   while (value >= 0x80) {
+      out += static_cast<char>((value & 0x7f) | 0x80);
+      value >>= 7;
+   }
+
+   out += static_cast<char>(value);
+}
+
+// Raw string literal, Huffman encoding is not worth it for the few
+// fields the server sends.
+void write_string(std::pmr::string& out, string_view s)
+{
+   write_integer(out, 0x00, 7, std::size(s));
+   out.append(s.data(), std::size(s));
+}
+
+}
+
+bool huffman_decode(string_view in, std::string& out)
+{
+   std::uint32_t code = 0;
+   auto len = 0;
+   for (auto c : in) {
+      auto const byte = static_cast<unsigned char>(c);
+      for (auto bit = 7; bit >= 0; --bit) {
+	 code = (code << 1) | ((byte >> bit) & 1);
+	 if (++len > max_code_length)
+	    return false;
+
+	 auto const offset = code - huffman.first_code[len];
+	 if (code < huffman.first_code[len] || offset >= huffman.count[len])
+	    continue;
+
+	 auto const symbol = huffman.symbols[huffman.first_index[len] + offset];
+	 if (symbol == 256)
+	    return false;
+
+	 out += static_cast<char>(symbol);
+	 code = 0;
+	 len = 0;
+      }
+   }
+
+   // At most 7 bits of padding, the most significant bits of EOS.
+   return len < 8 && code == (1u << len) - 1;
+}
+
+void decoder::evict(std::size_t max) noexcept
+{
+   while (size_ > max) {
+      auto const& e = table_.back();
+      size_ -= std::size(e.name) + std::size(e.value) + 32;
+      table_.pop_back();
+   }
+}
+
+bool
+decoder::lookup(
+   std::uint64_t i,
+   string_view& name,
+   string_view& value) const noexcept
+{
+   if (i == 0)
+      return false;
+
+   if (i <= std::size(static_table)) {
+      name = static_table[i - 1].name;
+      value = static_table[i - 1].value;
+      return true;
+   }
+
+   i -= std::size(static_table) + 1;
+   if (i >= std::size(table_))
+      return false;
+
+   name = table_[i].name;
+   value = table_[i].value;
+   return true;
+}
+
+bool
+decoder::read_string(
+   string_view& in,
+   std::string& buffer,
+   string_view& out)
+{
+   if (std::empty(in))
+      return false;
+
+   auto const huffman_coded = (in[0] & 0x80) != 0;
+
+   std::uint64_t n = 0;
+   if (!read_integer(in, 7, n) || n > std::size(in))
+      return false;
+
+   auto const raw = in.substr(0, n);
+   in.remove_prefix(n);
+
+   if (!huffman_coded) {
+      out = raw;
+      return true;
+   }
+
+   buffer.clear();
+   if (!huffman_decode(raw, buffer))
+      return false;
+
+   out = buffer;
+   return true;
+}
+
+bool decoder::next(string_view& in, string_view& name, string_view& value)
+{
+   auto const first = static_cast<unsigned char>(in[0]);
+
+   // Indexed field.
+   if (first & 0x80) {
+      std::uint64_t i = 0;
+      return read_integer(in, 7, i) && lookup(i, name, value);
+   }
+
+   // Dynamic table size update.
+   if ((first & 0xe0) == 0x20) {
+      std::uint64_t n = 0;
+      if (!read_integer(in, 5, n) || n > limit_)
+	 return false;
+
+      max_size_ = n;
+      evict(max_size_);
+      name = {};
+      return true;
+   }
+
+   // Literals, with incremental indexing or without/never indexed.
+   auto const indexing = (first & 0xc0) == 0x40;
+   std::uint64_t i = 0;
+   if (!read_integer(in, indexing ? 6 : 4, i))
+      return false;
+
+   if (i == 0) {
+      if (!read_string(in, name_buffer_, name))
+	 return false;
+   } else {
+      string_view unused;
+      if (!lookup(i, name, unused))
+	 return false;
+   }
+
+   if (!read_string(in, value_buffer_, value))
+      return false;
+
+   if (!indexing)
+      return true;
+
+   // The name may refer to an entry that is about to be evicted.
+   entry e {std::string {name}, std::string {value}};
+   auto const size = std::size(e.name) + std::size(e.value) + 32;
+   if (size > max_size_) {
+      evict(0);
+      name_buffer_ = std::move(e.name);
+      value_buffer_ = std::move(e.value);
+      name = name_buffer_;
+      value = value_buffer_;
+      return true;
+   }
+
+   evict(max_size_ - size);
+   table_.push_front(std::move(e));
+   size_ += size;
+   name = table_.front().name;
+   value = table_.front().value;
+   return true;
+}
+
+void encode_status(std::pmr::string& out, unsigned status)
+{
+   for (std::size_t i = 7; i < 14; ++i) {
+      auto const& v = static_table[i].value;
+      auto const code =
+	 (v[0] - '0') * 100u + (v[1] - '0') * 10u + (v[2] - '0');
+
+      if (code == status) {
+	 write_integer(out, 0x80, 7, i + 1);
+	 return;
+      }
+   }
+
+   char buffer[3] =
+   { static_cast<char>('0' + status / 100 % 10)
+   , static_cast<char>('0' + status / 10 % 10)
+   , static_cast<char>('0' + status % 10)};
+
+   // Literal without indexing, name :status at index 8.
+   write_integer(out, 0x00, 4, 8);
+   write_string(out, {buffer, sizeof buffer});
+}
+
+void encode_field(std::pmr::string& out, string_view name, string_view value)
+{
+   for (std::size_t i = 14; i < std::size(static_table); ++i) {
+      if (static_table[i].name == name) {
+	 write_integer(out, 0x00, 4, i + 1);
+	 write_string(out, value);
+	 return;
+      }
+   }
+
+   out += '\0';
+   write_string(out, name);
+   write_string(out, value);
+}
+
+}
@@ -0,0 +1,98 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <cstdint>
+#include <string_view>
+#include <memory_resource>
+
+namespace smms::hpack
+{
+
+using string_view = std::string_view;
+
+// Decodes a Huffman encoded string literal and appends it to out.
+// Returns false if the input is not a valid encoding.
+bool huffman_decode(string_view in, std::string& out);
+
+/* Header block decoder, RFC 7541. The dynamic table is bounded by the
+ * size passed to the constructor, i.e. the SETTINGS_HEADER_TABLE_SIZE
+ * the server advertises.
+ */
+class decoder {
+private:
+   struct entry {
+      std::string name;
+      std::string value;
+   };
+
+   // Newest first, indices start at 62.
+   std::deque<entry> table_;
+   std::size_t size_ = 0;
+   std::size_t max_size_;
+   std::size_t limit_;
+
+   std::string name_buffer_;
+   std::string value_buffer_;
+
+   void evict(std::size_t max) noexcept;
+   bool lookup(std::uint64_t i, string_view& name, string_view& value) const noexcept;
+   bool read_string(string_view& in, std::string& buffer, string_view& out);
+
+   // Decodes one representation. Table size updates produce an empty
+   // name. The views are valid until the next call.
+   bool next(string_view& in, string_view& name, string_view& value);
+
+public:
+   explicit decoder(std::size_t limit = 4096) noexcept
+   : max_size_ {limit}
+   , limit_ {limit}
+   { }
+
+   // Calls f(name, value) for every field of a complete header block.
+   // Returns false on a compression error, which is fatal for the
+   // connection.
+   template <class F>
+   bool decode(string_view block, F f)
+   {
+      string_view name, value;
+      while (!std::empty(block)) {
+	 if (!next(block, name, value))
+	    return false;
+
+	 if (!std::empty(name))
+	    f(name, value);
+      }
+
+      return true;
+   }
+
+   auto table_size() const noexcept { return size_; }
+};
+
+// Appends :status, indexed when it is in the static table.
+void encode_status(std::pmr::string& out, unsigned status);
+
+// Appends a literal field without indexing, names must be lower
+// case. Names of the static table are referenced by index.
+void encode_field(std::pmr::string& out, string_view name, string_view value);
+
+}
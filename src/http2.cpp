@@ -0,0 +1,896 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "http2.hpp"
+
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+
+#include "logger.hpp"
+#include "rate_limiter.hpp"
+
+namespace smms::http2
+{
+
+namespace {
+
+namespace frame {
+   constexpr std::uint8_t data = 0x0;
+   constexpr std::uint8_t headers = 0x1;
+   constexpr std::uint8_t priority = 0x2;
+   constexpr std::uint8_t rst_stream = 0x3;
+   constexpr std::uint8_t settings = 0x4;
+   constexpr std::uint8_t push_promise = 0x5;
+   constexpr std::uint8_t ping = 0x6;
+   constexpr std::uint8_t goaway = 0x7;
+   constexpr std::uint8_t window_update = 0x8;
+   constexpr std::uint8_t continuation = 0x9;
+}
+
+namespace flag {
+   constexpr std::uint8_t ack = 0x1;
+   constexpr std::uint8_t end_stream = 0x1;
+   constexpr std::uint8_t end_headers = 0x4;
+   constexpr std::uint8_t padded = 0x8;
+   constexpr std::uint8_t priority = 0x20;
+}
+
+namespace error {
+   constexpr std::uint32_t no_error = 0x0;
+   constexpr std::uint32_t protocol_error = 0x1;
+   constexpr std::uint32_t internal_error = 0x2;
+   constexpr std::uint32_t flow_control_error = 0x3;
+   constexpr std::uint32_t stream_closed = 0x5;
+   constexpr std::uint32_t frame_size_error = 0x6;
+   constexpr std::uint32_t refused_stream = 0x7;
+   constexpr std::uint32_t compression_error = 0x9;
+   constexpr std::uint32_t enhance_your_calm = 0xb;
+}
+
+namespace setting {
+   constexpr std::uint16_t max_concurrent_streams = 0x3;
+   constexpr std::uint16_t initial_window_size = 0x4;
+   constexpr std::uint16_t max_frame_size = 0x5;
+   constexpr std::uint16_t max_header_list_size = 0x6;
+}
+
+constexpr std::size_t frame_header_size = 9;
+
+// What we advertise. We don't raise SETTINGS_MAX_FRAME_SIZE.
+constexpr std::size_t max_frame_size = 16384;
+constexpr std::uint32_t max_streams = 100;
+constexpr std::uint32_t window_size = 1 << 20;
+
+constexpr std::int64_t max_window = 0x7fffffff;
+
+// Bounds the header block of a request across CONTINUATION frames.
+constexpr std::size_t max_header_block = 64 * 1024;
+
+// Bounds the decoded header list, RFC 7540, 6.5.2. Indexed fields
+// expand a small block into a large list.
+constexpr std::size_t max_header_list = 64 * 1024;
+
+// DATA frames are not produced beyond this much pending output, more
+// follow as it gets written.
+constexpr std::size_t output_limit = 256 * 1024;
+
+std::uint32_t read32(string_view s) noexcept
+{
+   auto const* p = reinterpret_cast<unsigned char const*>(s.data());
+   return std::uint32_t {p[0]} << 24
+        | std::uint32_t {p[1]} << 16
+        | std::uint32_t {p[2]} << 8
+        | std::uint32_t {p[3]};
+}
+
+void write16(std::pmr::string& out, std::uint16_t v)
+{
+   out += static_cast<char>(v >> 8);
+   out += static_cast<char>(v);
+}
+
+void write32(std::pmr::string& out, std::uint32_t v)
+{
+   out += static_cast<char>(v >> 24);
+   out += static_cast<char>(v >> 16);
+   out += static_cast<char>(v >> 8);
+   out += static_cast<char>(v);
+}
+
+// Removes the padding of DATA and HEADERS frames.
+bool remove_padding(std::uint8_t flags, string_view& payload) noexcept
+{
+   if (!(flags & flag::padded))
+      return true;
+
+   if (std::empty(payload))
+      return false;
+
+   std::size_t const n = static_cast<unsigned char>(payload[0]);
+   if (n >= std::size(payload))
+      return false;
+
+   payload = payload.substr(1, std::size(payload) - 1 - n);
+   return true;
+}
+
+// Fields that are specific to HTTP/1.1 connections.
+bool is_connection_field(string_view name) noexcept
+{
+   return name == "connection"
+       || name == "keep-alive"
+       || name == "transfer-encoding"
+       || name == "upgrade";
+}
+
+}
+
+preface_match match_preface(string_view in) noexcept
+{
+   auto const n = std::min(std::size(in), std::size(preface));
+   if (in.substr(0, n) != preface.substr(0, n))
+      return preface_match::no;
+
+   return n == std::size(preface)
+      ? preface_match::complete
+      : preface_match::partial;
+}
+
+bool is_h2_selected(SSL const* ssl) noexcept
+{
+   unsigned char const* p = nullptr;
+   unsigned n = 0;
+   SSL_get0_alpn_selected(ssl, &p, &n);
+   return n == 2 && std::memcmp(p, "h2", 2) == 0;
+}
+
+struct connection::stream {
+   std::uint32_t const id;
+   arena<4096> storage;
+   request_type req;
+   response res;
+
+   // The response serialized as in HTTP/1.1 except for the body and
+   // the file, the body part starts at body_offset.
+   std::pmr::string head;
+   std::size_t body_offset = 0;
+
+   std::int64_t send_window;
+   std::size_t sent = 0;
+   std::size_t total = 0;
+   std::uint64_t received = 0;
+
+   // Accounts for the request body in body_budget().
+   budget_lease lease;
+
+   // Hashes the body as it arrives, see config::dedup.
+   body_hasher hasher;
+
+   bool request_done = false;
+   bool responding = false;
+
+   // The response is being made on an I/O queue, the stream must stay
+   // until it is done. Reset streams are then just waiting for that.
+   bool waiting = false;
+   bool reset = false;
+
+   stream(std::uint32_t i, std::int64_t window)
+   : id {i}
+   , req
+     { std::piecewise_construct
+     , std::make_tuple(storage.get_allocator())
+     , std::make_tuple(storage.get_allocator())}
+   , res {storage.get_allocator()}
+   , head {storage.get_allocator()}
+   , send_window {window}
+   { }
+
+   // Copies n bytes of the body at offset to out.
+   bool copy_body(std::size_t offset, std::size_t n, char* out) const noexcept
+   {
+      string_view const parts[] =
+      { string_view {head}.substr(body_offset)
+      , string_view {res.body().data(), std::size(res.body())}};
+
+      for (auto part : parts) {
+	 if (offset >= std::size(part)) {
+	    offset -= std::size(part);
+	    continue;
+	 }
+
+	 auto const k = std::min(n, std::size(part) - offset);
+	 std::memcpy(out, part.data() + offset, k);
+	 out += k;
+	 n -= k;
+	 offset = 0;
+	 if (n == 0)
+	    return true;
+      }
+
+      return res.read_file(offset, out, n);
+   }
+};
+
+connection::connection(
+   config const& cfg,
+   bool is_ssl,
+   std::optional<ip::address> peer)
+: cfg_ {cfg}
+, is_ssl_ {is_ssl}
+, peer_ {peer}
+, streams_ {connection_pool()}
+, header_block_ {connection_pool()}
+, out_ {connection_pool()}
+, writing_ {connection_pool()}
+, jobs_ {connection_pool()}
+{
+   write_frame_header(4 * 6, frame::settings, 0, 0);
+   write16(out_, setting::max_concurrent_streams);
+   write32(out_, max_streams);
+   write16(out_, setting::initial_window_size);
+   write32(out_, window_size);
+   write16(out_, setting::max_frame_size);
+   write32(out_, max_frame_size);
+   write16(out_, setting::max_header_list_size);
+   write32(out_, max_header_list);
+
+   write_window_update(0, window_size - 65535);
+}
+
+connection::~connection()
+{
+   std::pmr::polymorphic_allocator<stream> alloc {connection_pool()};
+   for (auto* s : streams_)
+      alloc.delete_object(s);
+}
+
+connection::stream* connection::find(std::uint32_t id) const noexcept
+{
+   auto const match = [id](auto const* s) { return s->id == id && !s->reset; };
+   auto const it = std::find_if(std::cbegin(streams_), std::cend(streams_), match);
+   return it == std::cend(streams_) ? nullptr : *it;
+}
+
+void connection::remove(std::uint32_t id) noexcept
+{
+   auto const match = [id](auto const* s) { return s->id == id; };
+   auto const it = std::find_if(std::begin(streams_), std::end(streams_), match);
+   if (it == std::end(streams_))
+      return;
+
+   if ((*it)->waiting) {
+      (*it)->reset = true;
+      return;
+   }
+
+   std::pmr::polymorphic_allocator<stream> alloc {connection_pool()};
+   alloc.delete_object(*it);
+   streams_.erase(it);
+}
+
+void
+connection::write_frame_header(
+   std::size_t length,
+   std::uint8_t type,
+   std::uint8_t flags,
+   std::uint32_t id)
+{
+   out_ += static_cast<char>(length >> 16);
+   out_ += static_cast<char>(length >> 8);
+   out_ += static_cast<char>(length);
+   out_ += static_cast<char>(type);
+   out_ += static_cast<char>(flags);
+   write32(out_, id);
+}
+
+void connection::write_window_update(std::uint32_t id, std::uint32_t increment)
+{
+   write_frame_header(4, frame::window_update, 0, id);
+   write32(out_, increment);
+}
+
+void connection::write_rst_stream(std::uint32_t id, std::uint32_t code)
+{
+   write_frame_header(4, frame::rst_stream, 0, id);
+   write32(out_, code);
+}
+
+void connection::connection_error(std::uint32_t code)
+{
+   if (goaway_sent_)
+      return;
+
+   log::write(log::level::debug, "http2: connection error {0}.", code);
+
+   write_frame_header(8, frame::goaway, 0, 0);
+   write32(out_, last_stream_id_);
+   write32(out_, code);
+   goaway_sent_ = true;
+}
+
+void connection::stream_error(std::uint32_t id, std::uint32_t code)
+{
+   log::write(log::level::debug, "http2: stream {0} error {1}.", id, code);
+
+   write_rst_stream(id, code);
+   remove(id);
+}
+
+std::size_t connection::on_input(string_view in)
+{
+   std::size_t consumed = 0;
+
+   if (preface_pos_ < std::size(preface)) {
+      auto const n = std::min(std::size(in), std::size(preface) - preface_pos_);
+      if (in.substr(0, n) != preface.substr(preface_pos_, n)) {
+	 connection_error(error::protocol_error);
+	 return std::size(in);
+      }
+
+      preface_pos_ += n;
+      consumed = n;
+   }
+
+   while (!goaway_sent_) {
+      auto const rest = in.substr(consumed);
+      if (std::size(rest) < frame_header_size)
+	 break;
+
+      auto const* p = reinterpret_cast<unsigned char const*>(rest.data());
+      std::size_t const length = p[0] << 16 | p[1] << 8 | p[2];
+      if (length > max_frame_size) {
+	 connection_error(error::frame_size_error);
+	 break;
+      }
+
+      if (std::size(rest) < frame_header_size + length)
+	 break;
+
+      auto const id = read32(rest.substr(5)) & 0x7fffffff;
+      on_frame(p[3], p[4], id, rest.substr(frame_header_size, length));
+      consumed += frame_header_size + length;
+   }
+
+   if (goaway_sent_)
+      return std::size(in);
+
+   pump();
+   return consumed;
+}
+
+void
+connection::on_frame(
+   std::uint8_t type,
+   std::uint8_t flags,
+   std::uint32_t id,
+   string_view payload)
+{
+   if (!settings_received_ && type != frame::settings)
+      return connection_error(error::protocol_error);
+
+   // Nothing may come in between the frames of a header block.
+   if (continuation_id_ != 0 && type != frame::continuation)
+      return connection_error(error::protocol_error);
+
+   switch (type) {
+      case frame::data:
+	 return on_data(flags, id, payload);
+      case frame::headers:
+	 return on_headers(flags, id, payload);
+      case frame::continuation:
+	 return on_continuation(flags, id, payload);
+      case frame::settings:
+	 return on_settings(flags, id, payload);
+      case frame::window_update:
+	 return on_window_update(id, payload);
+      case frame::priority:
+      {
+	 if (id == 0)
+	    return connection_error(error::protocol_error);
+	 if (std::size(payload) != 5)
+	    return stream_error(id, error::frame_size_error);
+	 return;
+      }
+      case frame::rst_stream:
+      {
+	 if (id == 0 || id > last_stream_id_)
+	    return connection_error(error::protocol_error);
+	 if (std::size(payload) != 4)
+	    return connection_error(error::frame_size_error);
+	 return remove(id);
+      }
+      case frame::ping:
+      {
+	 if (id != 0)
+	    return connection_error(error::protocol_error);
+	 if (std::size(payload) != 8)
+	    return connection_error(error::frame_size_error);
+	 if (flags & flag::ack)
+	    return;
+
+	 write_frame_header(8, frame::ping, flag::ack, 0);
+	 out_.append(payload.data(), std::size(payload));
+	 return;
+      }
+      case frame::goaway:
+      {
+	 if (id != 0)
+	    return connection_error(error::protocol_error);
+	 goaway_received_ = true;
+	 return;
+      }
+      case frame::push_promise:
+	 return connection_error(error::protocol_error);
+      default:
+	 return; // Unknown frame types are ignored.
+   }
+}
+
+void connection::on_data(std::uint8_t flags, std::uint32_t id, string_view payload)
+{
+   if (id == 0)
+      return connection_error(error::protocol_error);
+
+   // The whole payload counts for flow control, it is given back
+   // right away, body_limit bounds what a stream may send.
+   auto const length = std::size(payload);
+   if (length != 0)
+      write_window_update(0, static_cast<std::uint32_t>(length));
+
+   auto* s = find(id);
+   if (!s) {
+      if (id > last_stream_id_)
+	 return connection_error(error::protocol_error);
+      return; // A stream we closed early, see finish.
+   }
+
+   if (s->request_done)
+      return stream_error(id, error::stream_closed);
+
+   if (!remove_padding(flags, payload))
+      return connection_error(error::protocol_error);
+
+   auto const end_stream = (flags & flag::end_stream) != 0;
+   if (!s->responding) {
+      s->received += std::size(payload);
+      if (s->received > cfg_.body_limit) {
+	 start_response(*s, response {cfg_.responses.invalid_body_size});
+	 return;
+      }
+
+      if (!s->lease.resize(s->received)) {
+	 start_response(*s, response {cfg_.responses.service_unavailable});
+	 return;
+      }
+
+      s->req.body().append(payload.data(), std::size(payload));
+      s->hasher.update(s->req);
+      if (!end_stream && length != 0)
+	 write_window_update(id, static_cast<std::uint32_t>(length));
+   }
+
+   if (end_stream) {
+      s->request_done = true;
+      if (!s->responding)
+	 respond(*s);
+   }
+}
+
+void connection::on_headers(std::uint8_t flags, std::uint32_t id, string_view payload)
+{
+   if (id == 0 || id % 2 == 0)
+      return connection_error(error::protocol_error);
+
+   if (!remove_padding(flags, payload))
+      return connection_error(error::protocol_error);
+
+   if (flags & flag::priority) {
+      if (std::size(payload) < 5)
+	 return connection_error(error::protocol_error);
+      payload.remove_prefix(5);
+   }
+
+   header_block_.assign(payload.data(), std::size(payload));
+
+   auto const end_stream = (flags & flag::end_stream) != 0;
+   if (flags & flag::end_headers) {
+      on_header_block(id, end_stream);
+      return;
+   }
+
+   continuation_id_ = id;
+   continuation_end_stream_ = end_stream;
+}
+
+void
+connection::on_continuation(
+   std::uint8_t flags,
+   std::uint32_t id,
+   string_view payload)
+{
+   if (continuation_id_ == 0 || id != continuation_id_)
+      return connection_error(error::protocol_error);
+
+   if (std::size(header_block_) + std::size(payload) > max_header_block)
+      return connection_error(error::enhance_your_calm);
+
+   header_block_.append(payload.data(), std::size(payload));
+   if (!(flags & flag::end_headers))
+      return;
+
+   continuation_id_ = 0;
+   on_header_block(id, continuation_end_stream_);
+}
+
+void connection::on_header_block(std::uint32_t id, bool end_stream)
+{
+   auto* s = find(id);
+   auto const trailers = s != nullptr;
+
+   if (!trailers) {
+      if (id <= last_stream_id_)
+	 return connection_error(error::stream_closed);
+
+      last_stream_id_ = id;
+      if (std::size(streams_) < max_streams) {
+	 std::pmr::polymorphic_allocator<stream> alloc {connection_pool()};
+	 s = alloc.new_object<stream>(id, peer_initial_window_);
+	 streams_.push_back(s);
+      }
+   }
+
+   // The block is decoded even if the stream was refused, the table
+   // of the decoder must stay in sync with the encoder of the peer.
+   // Fields beyond the list size are dropped, the stream is reset
+   // after decoding.
+   auto* const req = trailers || !s ? nullptr : &s->req;
+   std::size_t list_size = 0;
+   auto f = [req, &list_size](hpack::string_view name, hpack::string_view v)
+   {
+      list_size += std::size(name) + std::size(v) + 32;
+      if (!req || list_size > max_header_list)
+	 return;
+
+      string_view const value {v.data(), std::size(v)};
+      if (name == ":method") {
+	 req->method_string(value);
+      } else if (name == ":path") {
+	 req->target(value);
+      } else if (name == ":authority") {
+	 req->set(http::field::host, value);
+      } else if (name == "host") {
+	 if (req->find(http::field::host) == std::end(*req))
+	    req->set(http::field::host, value);
+      } else if (name[0] != ':') {
+	 req->insert({name.data(), std::size(name)}, value);
+      }
+   };
+
+   if (!decoder_.decode(header_block_, f))
+      return connection_error(error::compression_error);
+
+   if (!s) {
+      write_rst_stream(id, error::refused_stream);
+      return;
+   }
+
+   if (list_size > max_header_list)
+      return stream_error(id, error::enhance_your_calm);
+
+   if (trailers) {
+      if (!end_stream || s->request_done)
+	 return stream_error(id, error::protocol_error);
+   } else {
+      if (std::empty(req->method_string()) || std::empty(req->target()))
+	 return stream_error(id, error::protocol_error);
+      req->version(20);
+
+      if (cfg_.limiter && peer_ && !cfg_.limiter->admit_request(*peer_)) {
+	 s->request_done = end_stream;
+	 start_response(*s, response {cfg_.responses.too_many_requests});
+	 return;
+      }
+
+      s->hasher.start(*req, cfg_);
+   }
+
+   if (!end_stream)
+      return;
+
+   s->request_done = true;
+   if (!s->responding)
+      respond(*s);
+}
+
+void connection::on_settings(std::uint8_t flags, std::uint32_t id, string_view payload)
+{
+   if (id != 0)
+      return connection_error(error::protocol_error);
+
+   if (flags & flag::ack) {
+      if (!std::empty(payload))
+	 return connection_error(error::frame_size_error);
+      return;
+   }
+
+   if (std::size(payload) % 6 != 0)
+      return connection_error(error::frame_size_error);
+
+   for (; !std::empty(payload); payload.remove_prefix(6)) {
+      auto const* p = reinterpret_cast<unsigned char const*>(payload.data());
+      auto const key = p[0] << 8 | p[1];
+      std::int64_t const value = read32(payload.substr(2));
+
+      if (key == setting::initial_window_size) {
+	 if (value > max_window)
+	    return connection_error(error::flow_control_error);
+
+	 auto const delta = value - peer_initial_window_;
+	 for (auto* s : streams_) {
+	    s->send_window += delta;
+	    if (s->send_window > max_window)
+	       return connection_error(error::flow_control_error);
+	 }
+
+	 peer_initial_window_ = value;
+      } else if (key == setting::max_frame_size) {
+	 if (value < 16384 || value > 16777215)
+	    return connection_error(error::protocol_error);
+
+	 peer_max_frame_size_ = value;
+      }
+   }
+
+   settings_received_ = true;
+   write_frame_header(0, frame::settings, flag::ack, 0);
+}
+
+void connection::on_window_update(std::uint32_t id, string_view payload)
+{
+   if (std::size(payload) != 4)
+      return connection_error(error::frame_size_error);
+
+   std::int64_t const increment = read32(payload) & 0x7fffffff;
+
+   if (id == 0) {
+      if (increment == 0)
+	 return connection_error(error::protocol_error);
+
+      send_window_ += increment;
+      if (send_window_ > max_window)
+	 return connection_error(error::flow_control_error);
+      return;
+   }
+
+   auto* s = find(id);
+   if (!s) {
+      if (id > last_stream_id_)
+	 return connection_error(error::protocol_error);
+      return;
+   }
+
+   if (increment == 0)
+      return stream_error(id, error::protocol_error);
+
+   s->send_window += increment;
+   if (s->send_window > max_window)
+      return stream_error(id, error::flow_control_error);
+}
+
+void connection::respond(stream& s)
+{
+   auto const* id = s.hasher.finish(s.req);
+   if (auto* queue = io_queue(s.req, cfg_)) {
+      s.waiting = true;
+      jobs_.push_back({s.id, &s.req, id, queue});
+      return;
+   }
+
+   start_response(s, make_response(s.req, cfg_, is_ssl_, id));
+}
+
+void connection::start_response(stream& s, response res)
+{
+   s.res = std::move(res);
+   s.responding = true;
+
+   auto const buffers = s.res.buffers();
+   for (std::size_t i = 0; i < 4; ++i) {
+      auto const* p = static_cast<char const*>(buffers[i].data());
+      s.head.append(p, buffers[i].size());
+   }
+
+   string_view head {s.head};
+   auto const end = head.find("\r\n\r\n");
+   if (end == string_view::npos || std::size(head) < 12) {
+      stream_error(s.id, error::internal_error);
+      return;
+   }
+
+   s.body_offset = end + 4;
+   s.total =
+      std::size(head) - s.body_offset
+      + std::size(s.res.body())
+      + s.res.file_size();
+
+   // The status line is "HTTP/1.1 200 Reason".
+   unsigned status = 0;
+   for (auto c : head.substr(9, 3))
+      status = 10 * status + (c - '0');
+
+   std::pmr::string block {s.storage.get_allocator()};
+   hpack::encode_status(block, status);
+
+   std::pmr::string name {s.storage.get_allocator()};
+   auto fields = head.substr(0, end + 2);
+   fields.remove_prefix(fields.find("\r\n") + 2);
+   while (!std::empty(fields)) {
+      auto const eol = fields.find("\r\n");
+      auto const line = fields.substr(0, eol);
+      fields.remove_prefix(eol + 2);
+
+      auto const colon = line.find(':');
+      if (colon == string_view::npos)
+	 continue;
+
+      name.assign(line.data(), colon);
+      std::transform(std::begin(name), std::end(name), std::begin(name),
+	 [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+      if (is_connection_field(name))
+	 continue;
+
+      auto value = line.substr(colon + 1);
+      while (!std::empty(value) && value.front() == ' ')
+	 value.remove_prefix(1);
+
+      hpack::encode_field(block, name, {value.data(), std::size(value)});
+   }
+
+   // The block goes into a HEADERS frame and as many CONTINUATION
+   // frames as the peer's frame size requires.
+   string_view rest {block};
+   auto type = frame::headers;
+   std::uint8_t flags = s.total == 0 ? flag::end_stream : 0;
+   do {
+      auto const n = std::min(std::size(rest), peer_max_frame_size_);
+      if (n == std::size(rest))
+	 flags |= flag::end_headers;
+
+      write_frame_header(n, type, flags, s.id);
+      out_.append(rest.data(), n);
+      rest.remove_prefix(n);
+      type = frame::continuation;
+      flags = 0;
+   } while (!std::empty(rest));
+
+   if (s.total == 0)
+      finish(s);
+}
+
+void connection::finish(stream& s)
+{
+   // A response sent before the request was complete, e.g. because
+   // the body is too large, RFC 7540, 8.1.
+   if (!s.request_done)
+      write_rst_stream(s.id, error::no_error);
+
+   remove(s.id);
+}
+
+bool connection::write_data(stream& s)
+{
+   // The windows go negative when the peer lowers the initial window
+   // size after data was sent, RFC 7540, 6.9.2.
+   auto const window = std::min<std::int64_t>(
+      { static_cast<std::int64_t>(s.total - s.sent)
+      , static_cast<std::int64_t>(peer_max_frame_size_)
+      , send_window_
+      , s.send_window});
+
+   if (window <= 0 && s.sent != s.total)
+      return false;
+
+   auto const n = static_cast<std::size_t>(std::max<std::int64_t>(window, 0));
+
+   auto const last = s.sent + n == s.total;
+   write_frame_header(n, frame::data, last ? flag::end_stream : 0, s.id);
+
+   auto const size = std::size(out_);
+   out_.resize(size + n);
+   if (!s.copy_body(s.sent, n, out_.data() + size)) {
+      out_.resize(size - frame_header_size);
+      log::write(log::level::debug, "http2: Can't read file.");
+
+      // The response can't be completed.
+      write_rst_stream(s.id, error::internal_error);
+      s.request_done = true;
+      finish(s);
+      return true;
+   }
+
+   s.sent += n;
+   s.send_window -= n;
+   send_window_ -= n;
+
+   if (last)
+      finish(s);
+
+   return true;
+}
+
+void connection::pump()
+{
+   // Streams take turns, one frame each.
+   auto progress = true;
+   while (progress && !goaway_sent_ && std::size(out_) < output_limit) {
+      progress = false;
+      for (std::size_t i = 0; i < std::size(streams_);) {
+	 auto& s = *streams_[i];
+	 auto const count = std::size(streams_);
+	 if (s.responding && write_data(s))
+	    progress = true;
+
+	 // write_data removes finished streams.
+	 if (std::size(streams_) == count)
+	    ++i;
+      }
+   }
+}
+
+net::const_buffer connection::output()
+{
+   std::swap(out_, writing_);
+   return net::buffer(writing_.data(), std::size(writing_));
+}
+
+void connection::on_written()
+{
+   writing_.clear();
+   pump();
+}
+
+std::pmr::vector<connection::job> connection::take_jobs()
+{
+   std::pmr::vector<job> ret {connection_pool()};
+   std::swap(ret, jobs_);
+   return ret;
+}
+
+void connection::on_response(std::uint32_t id, response res)
+{
+   auto const match = [id](auto const* s) { return s->id == id; };
+   auto const it = std::find_if(std::begin(streams_), std::end(streams_), match);
+   if (it == std::end(streams_))
+      return;
+
+   auto& s = **it;
+   s.waiting = false;
+   if (s.reset || goaway_sent_) {
+      // The response is allocated from the stream.
+      s.res = std::move(res);
+      remove(id);
+      return;
+   }
+
+   start_response(s, std::move(res));
+   pump();
+}
+
+}
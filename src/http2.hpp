@@ -0,0 +1,178 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <memory_resource>
+
+#include <openssl/ssl.h>
+
+#include "net.hpp"
+#include "hpack.hpp"
+#include "session_impl.hpp"
+
+namespace smms::http2
+{
+
+// The client connection preface, RFC 7540, 3.5.
+inline constexpr string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum class preface_match {no, partial, complete};
+
+// Whether the bytes read on a plain connection are the preface of a
+// client with prior knowledge of HTTP/2. HTTP/1.1 can't parse it, the
+// sessions have to check before. Partial means that in is a proper
+// prefix of the preface, more bytes are needed to decide.
+preface_match match_preface(string_view in) noexcept;
+
+// Whether ALPN selected h2 during the handshake.
+bool is_h2_selected(SSL const* ssl) noexcept;
+
+/* The protocol logic of an HTTP/2 connection without any I/O, the
+ * session feeds it the bytes it reads and writes what it outputs.
+ *
+ * Every stream owns an arena for its request and response. Requests
+ * are handled by make_response once their last frame arrives, the
+ * response is serialized as in HTTP/1.1 and its header fields
+ * translated. Bodies, including files, are sent in DATA frames as the
+ * flow control windows allow, streams taking turns frame by frame.
+ *
+ * Requests for a root with an I/O queue become jobs instead, the
+ * session makes their responses on the queue and passes them to
+ * on_response. Their streams are kept until then, even if reset.
+ */
+class connection {
+private:
+   struct stream;
+
+   config const& cfg_;
+   bool const is_ssl_;
+
+   // The client, new streams take a request from its rate limits.
+   std::optional<ip::address> peer_;
+
+   // Bytes of the client preface received so far.
+   std::size_t preface_pos_ = 0;
+   bool settings_received_ = false;
+   bool goaway_sent_ = false;
+   bool goaway_received_ = false;
+
+   hpack::decoder decoder_;
+
+   std::uint32_t last_stream_id_ = 0;
+   std::pmr::vector<stream*> streams_;
+
+   // Header block of a HEADERS frame followed by CONTINUATION.
+   std::pmr::string header_block_;
+   std::uint32_t continuation_id_ = 0;
+   bool continuation_end_stream_ = false;
+
+   std::int64_t send_window_ = 65535;
+   std::int64_t peer_initial_window_ = 65535;
+   std::size_t peer_max_frame_size_ = 16384;
+
+   std::pmr::string out_;
+   std::pmr::string writing_;
+
+   stream* find(std::uint32_t id) const noexcept;
+   void remove(std::uint32_t id) noexcept;
+
+   void write_frame_header(
+      std::size_t length,
+      std::uint8_t type,
+      std::uint8_t flags,
+      std::uint32_t id);
+
+   void write_window_update(std::uint32_t id, std::uint32_t increment);
+   void write_rst_stream(std::uint32_t id, std::uint32_t code);
+
+   void connection_error(std::uint32_t code);
+   void stream_error(std::uint32_t id, std::uint32_t code);
+
+   void on_frame(
+      std::uint8_t type,
+      std::uint8_t flags,
+      std::uint32_t id,
+      string_view payload);
+
+   void on_data(std::uint8_t flags, std::uint32_t id, string_view payload);
+   void on_headers(std::uint8_t flags, std::uint32_t id, string_view payload);
+   void on_continuation(std::uint8_t flags, std::uint32_t id, string_view payload);
+   void on_header_block(std::uint32_t id, bool end_stream);
+   void on_settings(std::uint8_t flags, std::uint32_t id, string_view payload);
+   void on_window_update(std::uint32_t id, string_view payload);
+
+   void start_response(stream& s, response res);
+   void finish(stream& s);
+   bool write_data(stream& s);
+   void pump();
+
+public:
+   struct job {
+      std::uint32_t id;
+      request_type const* req;
+      content_id const* content;
+      net::thread_pool* queue;
+   };
+
+private:
+   std::pmr::vector<job> jobs_;
+
+   void respond(stream& s);
+
+public:
+   connection(
+      config const& cfg,
+      bool is_ssl,
+      std::optional<ip::address> peer = {});
+   ~connection();
+
+   connection(connection const&) = delete;
+   connection& operator=(connection const&) = delete;
+
+   // Processes the complete frames at the beginning of in and returns
+   // the number of bytes consumed.
+   std::size_t on_input(string_view in);
+
+   auto has_output() const noexcept { return !std::empty(out_); }
+
+   // The frames to write next. The buffer stays valid until
+   // on_written is called, which must happen before the next call.
+   net::const_buffer output();
+   void on_written();
+
+   // The requests whose responses are to be made on their queue since
+   // the last call.
+   std::pmr::vector<job> take_jobs();
+
+   // The response of a job.
+   void on_response(std::uint32_t id, response res);
+
+   // Whether the connection must be closed once the output is
+   // written, i.e. after a connection error or when the peer went
+   // away and no stream is left.
+   auto closed() const noexcept
+      { return goaway_sent_ || (goaway_received_ && std::empty(streams_)); }
+
+   auto active_streams() const noexcept { return std::size(streams_); }
+};
+
+}
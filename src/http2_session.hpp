@@ -0,0 +1,258 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+#include "net.hpp"
+#include "http2.hpp"
+#include "logger.hpp"
+#include "memory.hpp"
+#include "rate_limiter.hpp"
+#include "session_impl.hpp"
+
+namespace smms
+{
+
+/* Runs an http2::connection on a stream taken over from an HTTP/1.1
+ * session, either after ALPN selected h2 or after the session read
+ * the preface on an h2c port.
+ *
+ * Reads and writes alternate, output is written before reading again.
+ * The connection keeps the output bounded, so a large download never
+ * delays reading WINDOW_UPDATE frames for long. Only responses made on
+ * an I/O queue may start a write while a read is pending.
+ */
+template <class Stream>
+class http2_session
+   : public std::enable_shared_from_this<http2_session<Stream>>
+{
+private:
+   static constexpr auto is_ssl = !std::is_same_v<Stream, plain_stream>;
+
+   // Holds a frame of the maximum size we advertise.
+   static constexpr std::size_t read_size = 32 * 1024;
+
+   Stream stream_;
+   buffer_type buffer_;
+   std::optional<ip::address> peer_;
+   http2::connection conn_;
+   config const& cfg_;
+
+   bool reading_ = false;
+   bool writing_ = false;
+   bool failed_ = false;
+
+   void charge(std::size_t n)
+   {
+      if (peer_)
+	 cfg_.limiter->charge(*peer_, n);
+   }
+
+   // Only asked for when there are limits to apply.
+   static std::optional<ip::address> client(Stream& stream, config const& cfg)
+   {
+      if (!cfg.limiter)
+	 return {};
+
+      return peer_address(beast::get_lowest_layer(stream).socket());
+   }
+
+   void expires_after(int seconds)
+   {
+      auto const d = std::chrono::seconds(seconds);
+      beast::get_lowest_layer(stream_).expires_after(d);
+   }
+
+   // Errors in the protocol logic, e.g. a failed allocation, end the
+   // connection instead of the event loop.
+   template <class F>
+   void guarded(F&& f)
+   {
+      try {
+	 f();
+      } catch (std::exception const& e) {
+	 log::write(log::level::info, "http2_session: {0}", e.what());
+	 failed_ = true;
+	 beast::error_code ec;
+	 beast::get_lowest_layer(stream_).socket().close(ec);
+      }
+   }
+
+   void on_input()
+   {
+      auto const data = buffer_.data();
+      string_view const in {static_cast<char const*>(data.data()), data.size()};
+      buffer_.consume(conn_.on_input(in));
+   }
+
+   // Makes the responses of the jobs of the connection on their
+   // queues.
+   void dispatch()
+   {
+      auto const ex = stream_.get_executor();
+      for (auto const& job : conn_.take_jobs()) {
+	 auto self = this->shared_from_this();
+	 auto f = [self, id = job.id](response res)
+	    { self->on_response(id, std::move(res)); };
+
+	 async_make_response(*job.queue, *job.req, cfg_, is_ssl, job.content, net::bind_executor(ex, f));
+      }
+   }
+
+   void on_response(std::uint32_t id, response res)
+   {
+      if (failed_)
+	 return;
+
+      guarded([&]() {
+	 conn_.on_response(id, std::move(res));
+	 do_io();
+      });
+   }
+
+   void do_io()
+   {
+      dispatch();
+
+      if (failed_ || writing_)
+	 return;
+
+      if (conn_.has_output())
+	 return do_write();
+
+      if (reading_)
+	 return;
+
+      if (conn_.closed())
+	 return do_eof();
+
+      do_read();
+   }
+
+   void do_read()
+   {
+      reading_ = true;
+      expires_after(cfg_.http_session_timeout);
+
+      auto self = this->shared_from_this();
+      auto f = [self](auto ec, auto n)
+	 { self->on_read(ec, n); };
+
+      stream_.async_read_some(buffer_.prepare(read_size), f);
+   }
+
+   void on_read(beast::error_code ec, std::size_t n)
+   {
+      reading_ = false;
+      if (ec) {
+	 log::write(log::level::debug, "http2_session: {0}", ec.message());
+	 failed_ = true;
+	 return;
+      }
+
+      buffer_.commit(n);
+      charge(n);
+      guarded([&]() {
+	 on_input();
+	 do_io();
+      });
+   }
+
+   void do_write()
+   {
+      writing_ = true;
+      auto self = this->shared_from_this();
+      auto f = [self](auto ec, auto n)
+	 { self->on_write(ec, n); };
+
+      auto const timeout = std::chrono::seconds(cfg_.write_timeout);
+      net::async_write(stream_, conn_.output(), restart_timeout(stream_, timeout), f);
+   }
+
+   void on_write(beast::error_code ec, std::size_t n)
+   {
+      writing_ = false;
+      if (ec) {
+	 log::write(log::level::debug, "http2_session: {0}", ec.message());
+	 failed_ = true;
+	 return;
+      }
+
+      charge(n);
+
+      guarded([&]() {
+	 conn_.on_written();
+	 do_io();
+      });
+   }
+
+   void do_eof()
+   {
+      if constexpr (is_ssl) {
+	 expires_after(cfg_.shutdown_timeout);
+	 stream_.async_shutdown([self = this->shared_from_this()](auto ec, auto...) {
+	    if (ec) {
+	       log::write(log::level::debug,
+	                  "http2_session (shutdown): {0}",
+	                  ec.message());
+	    }
+	 });
+      } else {
+	 beast::error_code ec;
+	 stream_.socket().shutdown(stream_socket::shutdown_send, ec);
+      }
+   }
+
+public:
+   // The buffer holds what was read from the stream but not
+   // consumed, e.g. the preface.
+   http2_session(Stream&& stream, config const& cfg, buffer_type buffer)
+   : stream_ {std::move(stream)}
+   , buffer_ {std::move(buffer)}
+   , peer_ {client(stream_, cfg)}
+   , conn_ {cfg, is_ssl, peer_}
+   , cfg_ {cfg}
+   { }
+
+   void run()
+   {
+      log::write(log::level::debug, "http2_session: starting.");
+
+      guarded([&]() {
+	 on_input();
+	 do_io();
+      });
+   }
+};
+
+template <class Stream>
+void run_http2_session(Stream&& stream, config const& cfg, buffer_type buffer)
+{
+   std::allocate_shared<http2_session<Stream>>(
+      allocator_type {connection_pool()},
+      std::move(stream),
+      cfg,
+      std::move(buffer))->run();
+}
+
+}
@@ -0,0 +1,510 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "image.hpp"
+
+#include <array>
+#include <cmath>
+#include <sstream>
+#include <charconv>
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/gil.hpp>
+#include <boost/gil/extension/io/jpeg.hpp>
+#include <boost/gil/extension/numeric/sampler.hpp>
+#include <boost/gil/extension/numeric/resample.hpp>
+#include <boost/beast/core/string.hpp>
+#include <boost/interprocess/streams/bufferstream.hpp>
+
+#include <png.h>
+#include <webp/encode.h>
+
+#include "utils.hpp"
+
+namespace smms
+{
+
+namespace {
+
+bool parse_int(string_view s, int& out) noexcept
+{
+   auto const r = std::from_chars(s.data(), s.data() + std::size(s), out);
+   return r.ec == std::errc {} && r.ptr == s.data() + std::size(s) && out > 0;
+}
+
+// Parses WxH.
+std::optional<image_size> parse_size(string_view s) noexcept
+{
+   auto const x = s.find('x');
+   if (x == string_view::npos)
+      return {};
+
+   image_size ret;
+   if (!parse_int(s.substr(0, x), ret.width) || !parse_int(s.substr(x + 1), ret.height))
+      return {};
+
+   return ret;
+}
+
+// The part of the image that is brought to the size of the output.
+template <class View>
+View source_region(View const& v, transform const& t)
+{
+   image_size const source
+      {static_cast<int>(v.width()), static_cast<int>(v.height())};
+
+   image_size region = source;
+   if (t.mode == resize_mode::fill) {
+      auto const s = std::max(
+	 static_cast<double>(t.size.width) / source.width,
+	 static_cast<double>(t.size.height) / source.height);
+
+      region.width = std::clamp(static_cast<int>(std::lround(t.size.width / s)), 1, source.width);
+      region.height = std::clamp(static_cast<int>(std::lround(t.size.height / s)), 1, source.height);
+   } else if (t.mode == resize_mode::crop) {
+      region = output_size(source, t);
+   }
+
+   auto const x = (source.width - region.width) / 2;
+   auto const y = (source.height - region.height) / 2;
+   return boost::gil::subimage_view(v, x, y, region.width, region.height);
+}
+
+// JPEG through GIL.
+class jpeg_decoder {
+private:
+   boost::interprocess::ibufferstream is_;
+
+public:
+   explicit jpeg_decoder(string_view in)
+   : is_ {in.data(), std::size(in)}
+   { }
+
+   image_size size()
+   {
+      namespace bg = boost::gil;
+      auto const info = bg::read_image_info(is_, bg::jpeg_tag{})._info;
+      is_.clear();
+      is_.seekg(0);
+      return {static_cast<int>(info._width), static_cast<int>(info._height)};
+   }
+
+   template <class View>
+   void read(View const& v)
+      { boost::gil::read_and_convert_view(is_, v, boost::gil::jpeg_tag{}); }
+};
+
+// PNG through the simplified API of libpng, the PNG extension of GIL
+// doesn't build as C++20.
+class png_decoder {
+private:
+   png_image image_ {};
+
+public:
+   explicit png_decoder(string_view in)
+   {
+      image_.version = PNG_IMAGE_VERSION;
+      if (!png_image_begin_read_from_memory(&image_, in.data(), std::size(in)))
+	 throw std::runtime_error {image_.message};
+   }
+
+   ~png_decoder() { png_image_free(&image_); }
+
+   png_decoder(png_decoder const&) = delete;
+   png_decoder& operator=(png_decoder const&) = delete;
+
+   image_size size() const noexcept
+      { return {static_cast<int>(image_.width), static_cast<int>(image_.height)}; }
+
+   // Into an RGBA view of the size.
+   template <class View>
+   void read(View const& v)
+   {
+      image_.format = PNG_FORMAT_RGBA;
+      auto* data = boost::gil::interleaved_view_get_raw_data(v);
+      if (!png_image_finish_read(&image_, nullptr, data, v.pixels().row_size(), nullptr))
+	 throw std::runtime_error {image_.message};
+   }
+};
+
+// The view is of an image, i.e. its rows are contiguous.
+template <class View>
+void encode_png(View const& v, std::pmr::string& out)
+{
+   namespace bg = boost::gil;
+
+   png_image image {};
+   image.version = PNG_IMAGE_VERSION;
+   image.width = v.width();
+   image.height = v.height();
+   image.format =
+      bg::num_channels<View>::value == 4 ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+
+   auto const* data = bg::interleaved_view_get_raw_data(v);
+   auto const stride = v.pixels().row_size();
+
+   png_alloc_size_t size = 0;
+   if (!png_image_write_get_memory_size(image, size, 0, data, stride, nullptr))
+      throw std::runtime_error {image.message};
+
+   out.resize(size);
+   if (!png_image_write_to_memory(&image, out.data(), &size, 0, data, stride, nullptr))
+      throw std::runtime_error {image.message};
+
+   out.resize(size);
+}
+
+// The length of the JPEG stream that starts the data, up to its EOI
+// marker. The JPEG writer of GIL flushes its whole buffer when done,
+// i.e. the output may have up to 1 KiB of garbage after the stream.
+std::size_t jpeg_length(string_view data) noexcept
+{
+   auto const byte = [&](std::size_t i)
+      { return static_cast<unsigned char>(data[i]); };
+
+   // Segments with a length up to the start of scan.
+   std::size_t i = 2;
+   while (i + 4 <= std::size(data) && byte(i) == 0xFF) {
+      auto const marker = byte(i + 1);
+      auto const length = std::size_t {byte(i + 2)} << 8 | byte(i + 3);
+      i += 2 + length;
+      if (marker == 0xDA)
+	 break;
+   }
+
+   // Entropy coded data escapes 0xFF, the next 0xFFD9 is the EOI.
+   for (; i + 1 < std::size(data); ++i) {
+      if (byte(i) == 0xFF && byte(i + 1) == 0xD9)
+	 return i + 2;
+   }
+
+   return std::size(data);
+}
+
+// As encode_png.
+template <class View>
+void encode_webp(View const& v, int quality, std::pmr::string& out)
+{
+   namespace bg = boost::gil;
+
+   auto const* data =
+      reinterpret_cast<std::uint8_t const*>(bg::interleaved_view_get_raw_data(v));
+
+   auto const width = static_cast<int>(v.width());
+   auto const height = static_cast<int>(v.height());
+   auto const stride = static_cast<int>(v.pixels().row_size());
+
+   std::uint8_t* encoded = nullptr;
+   auto const size = bg::num_channels<View>::value == 4
+      ? WebPEncodeRGBA(data, width, height, stride, quality, &encoded)
+      : WebPEncodeRGB(data, width, height, stride, quality, &encoded);
+
+   if (size == 0)
+      throw std::runtime_error {"encode_webp: Can't encode."};
+
+   out.assign(reinterpret_cast<char const*>(encoded), size);
+   WebPFree(encoded);
+}
+
+template <class View>
+void encode(View const& v, transform const& t, std::pmr::string& out)
+{
+   namespace bg = boost::gil;
+
+   if (t.format == image_format::png) {
+      encode_png(v, out);
+      return;
+   }
+
+   if (t.format == image_format::webp) {
+      encode_webp(v, t.quality, out);
+      return;
+   }
+
+   bg::image_write_info<bg::jpeg_tag> info;
+   info._quality = t.quality;
+
+   // The alpha of PNG sources is dropped.
+   std::ostringstream oss;
+   if constexpr (bg::num_channels<View>::value == 4)
+      bg::write_view(oss, bg::color_converted_view<bg::rgb8_pixel_t>(v), info);
+   else
+      bg::write_view(oss, v, info);
+
+   auto const encoded = oss.view();
+   out.assign(encoded.data(), jpeg_length({encoded.data(), std::size(encoded)}));
+}
+
+template <class Image, class Decoder>
+transform_status
+transform_as(
+   Decoder& decoder,
+   std::span<transform const> ts,
+   std::uint64_t max_source_pixels,
+   budget_lease& lease,
+   std::span<std::pmr::string> out)
+{
+   namespace bg = boost::gil;
+
+   auto const source = decoder.size();
+   auto const source_pixels =
+      static_cast<std::uint64_t>(source.width) * source.height;
+
+   if (source_pixels > max_source_pixels)
+      return transform_status::too_large;
+
+   // The decoded and the largest resized image are held together with
+   // an encoded output and its copy in out.
+   std::uint64_t resized_pixels = 0;
+   for (auto const& t : ts) {
+      auto const size = output_size(source, t);
+      resized_pixels = std::max(
+	 resized_pixels,
+	 static_cast<std::uint64_t>(size.width) * size.height);
+   }
+
+   auto const channels = bg::num_channels<Image>::value;
+   auto const pixels = source_pixels + 2 * resized_pixels;
+   if (!lease.resize(lease.size() + channels * pixels))
+      return transform_status::no_memory;
+
+   Image img(source.width, source.height);
+   decoder.read(bg::view(img));
+
+   Image resized;
+   std::size_t kept = 0;
+   for (std::size_t i = 0; i < std::size(ts); ++i) {
+      auto const& t = ts[i];
+      auto const size = output_size(source, t);
+      auto const same = i != 0
+	 && t.mode == ts[i - 1].mode
+	 && t.size.width == ts[i - 1].size.width
+	 && t.size.height == ts[i - 1].size.height;
+
+      if (!same) {
+	 auto const region = source_region(bg::const_view(img), t);
+	 resized.recreate(size.width, size.height);
+	 if (region.width() == size.width && region.height() == size.height) {
+	    bg::copy_pixels(region, bg::view(resized));
+	 } else {
+	    bg::resize_view(region, bg::view(resized), bg::bilinear_sampler{});
+	 }
+      }
+
+      encode(bg::const_view(resized), t, out[i]);
+      kept += std::size(out[i]);
+   }
+
+   lease.resize(kept);
+   return transform_status::ok;
+}
+
+}
+
+std::optional<thumbnail_rule> parse_thumbnail_rule(string_view s)
+{
+   auto const colon = s.rfind(':');
+   if (colon == string_view::npos || !s.starts_with('/'))
+      return {};
+
+   thumbnail_rule ret;
+   ret.prefix.assign(s.data(), colon);
+
+   auto sizes = s.substr(colon + 1);
+   while (!std::empty(sizes)) {
+      auto const comma = std::min(sizes.find(','), std::size(sizes));
+      auto const size = parse_size(sizes.substr(0, comma));
+      if (!size)
+	 return {};
+
+      ret.sizes.push_back(*size);
+      sizes.remove_prefix(std::min(comma + 1, std::size(sizes)));
+   }
+
+   if (std::empty(ret.sizes))
+      return {};
+
+   return ret;
+}
+
+thumbnail_rule const*
+find_thumbnail_rule(
+   std::vector<thumbnail_rule> const& rules,
+   string_view target) noexcept
+{
+   thumbnail_rule const* ret = nullptr;
+   for (auto const& r : rules) {
+      if (!target.starts_with(string_view {r.prefix}))
+	 continue;
+
+      if (!ret || std::size(r.prefix) > std::size(ret->prefix))
+	 ret = &r;
+   }
+
+   return ret;
+}
+
+std::pmr::string
+thumbnail_name(
+   string_view name,
+   image_size size,
+   allocator_type const& alloc)
+{
+   auto dot = name.rfind('.');
+   auto const slash = name.rfind('/');
+   if (dot == string_view::npos || (slash != string_view::npos && dot < slash))
+      dot = std::size(name);
+
+   std::array<char, 32> buffer;
+   auto r = std::to_chars(buffer.data(), buffer.data() + std::size(buffer), size.width);
+   *r.ptr++ = 'x';
+   r = std::to_chars(r.ptr, buffer.data() + std::size(buffer), size.height);
+
+   std::pmr::string ret {name.data(), dot, alloc};
+   ret += '.';
+   ret.append(buffer.data(), r.ptr);
+   ret.append(name.data() + dot, std::size(name) - dot);
+   return ret;
+}
+
+string_view image_extension(image_format f) noexcept
+{
+   switch (f) {
+      case image_format::jpeg: return ".jpg";
+      case image_format::png: return ".png";
+      case image_format::gif: return ".gif";
+      case image_format::webp: return ".webp";
+      default: return "";
+   }
+}
+
+bool accepts_webp(string_view accept) noexcept
+{
+   while (!std::empty(accept)) {
+      auto const comma = accept.find(',');
+      auto element = accept.substr(0, comma);
+      accept.remove_prefix(comma == string_view::npos ? std::size(accept) : comma + 1);
+
+      auto const semicolon = element.find(';');
+      auto const range = trim_whitespace(element.substr(0, semicolon));
+      if (!boost::beast::iequals(range, "image/webp"))
+	 continue;
+
+      // The q parameter among the others of the range.
+      auto q = 1000;
+      element.remove_prefix(semicolon == string_view::npos ? std::size(element) : semicolon + 1);
+      while (!std::empty(element)) {
+	 auto const next = element.find(';');
+	 auto const param = trim_whitespace(element.substr(0, next));
+	 element.remove_prefix(next == string_view::npos ? std::size(element) : next + 1);
+	 if (std::size(param) >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+	    q = parse_qvalue(param.substr(2));
+      }
+
+      return q > 0;
+   }
+
+   return false;
+}
+
+std::optional<resize_mode> parse_resize_mode(string_view s) noexcept
+{
+   if (s == "scale")
+      return resize_mode::scale;
+   if (s == "fit")
+      return resize_mode::fit;
+   if (s == "fill")
+      return resize_mode::fill;
+   if (s == "crop")
+      return resize_mode::crop;
+
+   return {};
+}
+
+image_size output_size(image_size source, transform const& t) noexcept
+{
+   if (source.width <= 0 || source.height <= 0)
+      return t.size;
+
+   switch (t.mode) {
+      case resize_mode::fit:
+      {
+	 auto const s = std::min(
+	    static_cast<double>(t.size.width) / source.width,
+	    static_cast<double>(t.size.height) / source.height);
+
+	 return
+	    { std::max(1, static_cast<int>(std::lround(source.width * s)))
+	    , std::max(1, static_cast<int>(std::lround(source.height * s)))};
+      }
+      case resize_mode::crop:
+	 return
+	    { std::min(t.size.width, source.width)
+	    , std::min(t.size.height, source.height)};
+      default:
+	 return t.size;
+   }
+}
+
+transform_status
+transform_image(
+   string_view in,
+   image_format in_format,
+   transform const& t,
+   std::uint64_t max_source_pixels,
+   budget_lease& lease,
+   std::pmr::string& out)
+{
+   return transform_image(
+      in,
+      in_format,
+      std::span {&t, 1},
+      max_source_pixels,
+      lease,
+      std::span {&out, 1});
+}
+
+transform_status
+transform_image(
+   string_view in,
+   image_format in_format,
+   std::span<transform const> t,
+   std::uint64_t max_source_pixels,
+   budget_lease& lease,
+   std::span<std::pmr::string> out)
+{
+   namespace bg = boost::gil;
+
+   switch (in_format) {
+      case image_format::jpeg:
+      {
+	 jpeg_decoder d {in};
+	 return transform_as<bg::rgb8_image_t>(d, t, max_source_pixels, lease, out);
+      }
+      case image_format::png:
+      {
+	 png_decoder d {in};
+	 return transform_as<bg::rgba8_image_t>(d, t, max_source_pixels, lease, out);
+      }
+      default:
+	 throw std::runtime_error {"transform_image: Unsupported format."};
+   }
+}
+
+}
@@ -0,0 +1,134 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <span>
+#include <string>
+#include <vector>
+#include <optional>
+#include <memory_resource>
+
+#include "types.hpp"
+#include "memory.hpp"
+#include "metadata.hpp"
+
+namespace smms
+{
+
+struct image_size {
+   int width = 0;
+   int height = 0;
+};
+
+// Sizes of the thumbnails made of the JPEG uploads to targets that
+// start with the prefix, e.g. /photos/.
+struct thumbnail_rule {
+   std::string prefix;
+   std::vector<image_size> sizes;
+};
+
+// Parses "prefix:WxH,WxH,...", the prefix starts with a slash and the
+// sizes are positive.
+std::optional<thumbnail_rule> parse_thumbnail_rule(string_view s);
+
+// The rule with the longest prefix of the target, null if none.
+thumbnail_rule const*
+find_thumbnail_rule(
+   std::vector<thumbnail_rule> const& rules,
+   string_view target) noexcept;
+
+// The name of the thumbnail of the image in the size, the size is put
+// before the extension so that the type stays the same, e.g.
+// /a/img.100x50.jpg for /a/img.jpg.
+std::pmr::string
+thumbnail_name(
+   string_view name,
+   image_size size,
+   allocator_type const& alloc);
+
+// How the image is brought to the size of a transform.
+enum class resize_mode
+{ scale // Stretched to the size.
+, fit   // Scaled to fit in the size, keeping the aspect ratio.
+, fill  // Scaled to cover the size and cropped to it around the center.
+, crop  // The part of the size around the center, not scaled.
+};
+
+std::optional<resize_mode> parse_resize_mode(string_view s) noexcept;
+
+struct transform {
+   image_size size;
+   resize_mode mode = resize_mode::scale;
+
+   // Of JPEG and WebP output, 1 to 100. PNG is lossless.
+   int quality = 85;
+
+   // jpeg, png or webp.
+   image_format format = image_format::jpeg;
+};
+
+// Bounds of the transforms clients may ask for.
+struct transform_limits {
+   int max_width = 1000;
+   int max_height = 1000;
+
+   // Of the source image, so that a small file that decodes to a huge
+   // image can't take the memory.
+   std::uint64_t max_source_pixels = 50000000;
+};
+
+// The extension of files of the format, e.g. .jpg, see transform.
+string_view image_extension(image_format f) noexcept;
+
+// Whether the Accept field of a request names image/webp with a
+// nonzero q-value. Wildcards don't count, clients that send only */*
+// may not decode it.
+bool accepts_webp(string_view accept) noexcept;
+
+// The size of the output of the transform of an image of the size.
+image_size output_size(image_size source, transform const& t) noexcept;
+
+enum class transform_status {ok, no_memory, too_large};
+
+// Decodes the JPEG or PNG image in, transforms it and encodes it into
+// out in the format of the transform. The memory needed is taken from
+// the lease, no_memory is returned if it can't grow, too_large if the
+// source has more than max_source_pixels. Throws on malformed images.
+transform_status
+transform_image(
+   string_view in,
+   image_format in_format,
+   transform const& t,
+   std::uint64_t max_source_pixels,
+   budget_lease& lease,
+   std::pmr::string& out);
+
+// As above for several transforms of the image into out[i], which is
+// decoded once. A transform of the size and mode of the one before it
+// only encodes the image that one resized, e.g. in another format.
+transform_status
+transform_image(
+   string_view in,
+   image_format in_format,
+   std::span<transform const> t,
+   std::uint64_t max_source_pixels,
+   budget_lease& lease,
+   std::span<std::pmr::string> out);
+
+}
@@ -0,0 +1,305 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <utility>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <boost/asio/compose.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "net.hpp"
+#include "memory.hpp"
+
+namespace smms
+{
+
+/* A server side TLS stream where OpenSSL reads and writes the socket
+ * itself instead of going through memory BIOs like ssl::stream. This
+ * is what allows OpenSSL to hand the encryption of outgoing records
+ * over to the kernel after the handshake, ktls_send() then tells
+ * whether files can be written with sendfile(2) on socket(). Without
+ * kernel support the stream works like ssl::stream.
+ *
+ * The bytes read while detecting the protocol are passed to the
+ * constructor and served from a memory BIO until they are consumed.
+ *
+ * Operations time out like those of beast::basic_stream, see
+ * expires_after. The timer state is shared so that an expiring timer
+ * never touches a destroyed stream.
+ */
+class ktls_stream {
+public:
+   using executor_type = stream_socket::executor_type;
+
+private:
+   struct state {
+      stream_socket socket;
+      net::steady_timer timer;
+      bool timed_out = false;
+
+      explicit state(stream_socket&& s)
+      : socket {std::move(s)}
+      , timer {socket.get_executor()}
+      { }
+   };
+
+   std::shared_ptr<state> state_;
+   SSL* ssl_ = nullptr;
+   bool prefix_ = false;
+
+   // Switches the read BIO to the socket once the bytes read during
+   // detection are consumed. Returns true if it did.
+   bool drop_prefix() noexcept
+   {
+      auto* const rbio = SSL_get_rbio(ssl_);
+      if (!prefix_ || BIO_ctrl_pending(rbio) != 0)
+	 return false;
+
+      auto* const wbio = SSL_get_wbio(ssl_);
+      BIO_up_ref(wbio);
+      SSL_set0_rbio(ssl_, wbio);
+      prefix_ = false;
+      return true;
+   }
+
+   beast::error_code last_error(int r) const noexcept
+   {
+      switch (SSL_get_error(ssl_, r)) {
+	 case SSL_ERROR_ZERO_RETURN:
+	    return net::error::eof;
+	 case SSL_ERROR_SYSCALL:
+	    if (errno != 0)
+	       return {errno, boost::system::system_category()};
+	    return ssl::error::stream_truncated;
+	 default:
+	    return { static_cast<int>(ERR_get_error())
+	           , net::error::get_ssl_category()};
+      }
+   }
+
+   /* Repeats the SSL call f until it succeeds or fails for a reason
+    * other than the socket not being ready. Results available
+    * without waiting are posted so that handlers never run inside
+    * the initiating function.
+    */
+   template <class F>
+   struct io_op {
+      ktls_stream* stream;
+      F f;
+      std::size_t n = 0;
+      beast::error_code result {};
+      bool posted = false;
+      bool waited = false;
+
+      template <class Self>
+      void operator()(Self& self, beast::error_code ec = {})
+      {
+	 if (posted)
+	    return self.complete(result, n);
+
+	 if (ec) {
+	    if (ec == net::error::operation_aborted && stream->state_->timed_out)
+	       ec = beast::error::timeout;
+	    return self.complete(ec, 0);
+	 }
+
+	 auto& socket = stream->state_->socket;
+	 for (;;) {
+	    ERR_clear_error();
+	    errno = 0;
+	    auto const r = f(stream->ssl_, n);
+	    if (r > 0)
+	       break;
+
+	    auto const err = SSL_get_error(stream->ssl_, r);
+	    if (err == SSL_ERROR_WANT_READ) {
+	       if (stream->drop_prefix())
+		  continue;
+	       waited = true;
+	       return socket.async_wait(stream_socket::wait_read, std::move(self));
+	    }
+
+	    if (err == SSL_ERROR_WANT_WRITE) {
+	       waited = true;
+	       return socket.async_wait(stream_socket::wait_write, std::move(self));
+	    }
+
+	    result = stream->last_error(r);
+	    n = 0;
+	    break;
+	 }
+
+	 if (waited)
+	    return self.complete(result, n);
+
+	 posted = true;
+	 net::post(socket.get_executor(), std::move(self));
+      }
+   };
+
+   template <class F, class Handler>
+   auto async_io(F f, Handler&& handler)
+   {
+      return net::async_compose<Handler, void(beast::error_code, std::size_t)>(
+	 io_op<F>{this, std::move(f)}, handler, state_->socket);
+   }
+
+   template <class Buffers>
+   static auto front(Buffers const& buffers) noexcept
+   {
+      auto it = net::buffer_sequence_begin(buffers);
+      auto const end = net::buffer_sequence_end(buffers);
+      for (; it != end; ++it) {
+	 if (it->size() != 0)
+	    break;
+      }
+
+      using buffer_type = std::decay_t<decltype(*it)>;
+      return it == end ? buffer_type {} : buffer_type {*it};
+   }
+
+public:
+   ktls_stream(stream_socket&& socket, ssl::context& ctx, net::const_buffer prefix)
+   : state_ {std::allocate_shared<state>(
+        allocator_type {connection_pool()}, std::move(socket))}
+   , ssl_ {SSL_new(ctx.native_handle())}
+   {
+      beast::error_code ec;
+      state_->socket.non_blocking(true, ec);
+
+      SSL_set_fd(ssl_, state_->socket.native_handle());
+      SSL_set_mode(ssl_,
+         SSL_MODE_ENABLE_PARTIAL_WRITE |
+         SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+      SSL_set_accept_state(ssl_);
+
+      if (prefix.size() != 0) {
+	 auto* const mem = BIO_new(BIO_s_mem());
+	 BIO_write(mem, prefix.data(), static_cast<int>(prefix.size()));
+	 BIO_set_mem_eof_return(mem, -1);
+	 SSL_set0_rbio(ssl_, mem);
+	 prefix_ = true;
+      }
+   }
+
+   // Moving is only allowed without pending operations, they refer to
+   // the stream, e.g. to hand the connection over to another session.
+   ktls_stream(ktls_stream&& other) noexcept
+   : state_ {std::move(other.state_)}
+   , ssl_ {std::exchange(other.ssl_, nullptr)}
+   , prefix_ {std::exchange(other.prefix_, false)}
+   { }
+
+   ktls_stream(ktls_stream const&) = delete;
+   ktls_stream& operator=(ktls_stream const&) = delete;
+
+   ~ktls_stream()
+   {
+      SSL_free(ssl_);
+   }
+
+   executor_type get_executor() noexcept
+      { return state_->socket.get_executor(); }
+
+   stream_socket& socket() noexcept
+      { return state_->socket; }
+
+   SSL* native_handle() noexcept
+      { return ssl_; }
+
+   // Whether the kernel encrypts outgoing records, valid after the
+   // handshake.
+   bool ktls_send() const noexcept
+   {
+#ifdef SSL_OP_ENABLE_KTLS
+      return BIO_get_ktls_send(SSL_get_wbio(ssl_)) == 1;
+#else
+      return false;
+#endif
+   }
+
+   // Cancels the pending operations when the duration elapses. They
+   // complete with beast::error::timeout.
+   void expires_after(std::chrono::steady_clock::duration d)
+   {
+      state_->timed_out = false;
+      state_->timer.expires_after(d);
+
+      std::weak_ptr<state> const w = state_;
+      state_->timer.async_wait([w](auto ec) {
+	 if (ec)
+	    return;
+
+	 if (auto s = w.lock()) {
+	    s->timed_out = true;
+	    s->socket.cancel(ec);
+	 }
+      });
+   }
+
+   template <class Handler>
+   auto async_handshake(Handler&& handler)
+   {
+      auto f = [](SSL* ssl, std::size_t&) { return SSL_do_handshake(ssl); };
+      return async_io(f, std::forward<Handler>(handler));
+   }
+
+   template <class Handler>
+   auto async_shutdown(Handler&& handler)
+   {
+      // The second call waits for the close_notify of the peer.
+      auto f = [](SSL* ssl, std::size_t&) {
+	 auto const r = SSL_shutdown(ssl);
+	 return r == 0 ? SSL_shutdown(ssl) : r;
+      };
+
+      return async_io(f, std::forward<Handler>(handler));
+   }
+
+   template <class MutableBuffers, class Handler>
+   auto async_read_some(MutableBuffers const& buffers, Handler&& handler)
+   {
+      auto f = [b = front(buffers)](SSL* ssl, std::size_t& n) {
+	 if (b.size() == 0)
+	    return 1;
+	 return SSL_read_ex(ssl, b.data(), b.size(), &n);
+      };
+
+      return async_io(f, std::forward<Handler>(handler));
+   }
+
+   template <class ConstBuffers, class Handler>
+   auto async_write_some(ConstBuffers const& buffers, Handler&& handler)
+   {
+      auto f = [b = front(buffers)](SSL* ssl, std::size_t& n) {
+	 if (b.size() == 0)
+	    return 1;
+	 return SSL_write_ex(ssl, b.data(), b.size(), &n);
+      };
+
+      return async_io(f, std::forward<Handler>(handler));
+   }
+};
+
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "memory.hpp"
+
+namespace smms
+{
+
+namespace {
+
+bool synchronized_pools = false;
+
+}
+
+std::pmr::memory_resource* connection_pool()
+{
+   // Blocks larger than that, e.g. big uploads, go directly to the
+   // global heap.
+   std::pmr::pool_options const opts {0, 1 << 16};
+
+   if (synchronized_pools) {
+      thread_local std::pmr::synchronized_pool_resource pool {opts};
+      return &pool;
+   }
+
+   thread_local std::pmr::unsynchronized_pool_resource pool {opts};
+   return &pool;
+}
+
+void synchronize_connection_pools() noexcept
+{
+   synchronized_pools = true;
+}
+
+bool memory_budget::acquire(std::size_t n) noexcept
+{
+   auto used = used_.load();
+   for (;;) {
+      auto const limit = limit_.load();
+      if (limit != 0 && (used > limit || n > limit - used))
+	 return false;
+
+      if (used_.compare_exchange_weak(used, used + n))
+	 return true;
+   }
+}
+
+memory_budget& body_budget()
+{
+   static memory_budget budget;
+   return budget;
+}
+
+bool budget_lease::resize(std::size_t n) noexcept
+{
+   if (n > size_) {
+      if (!body_budget().acquire(n - size_))
+	 return false;
+   } else {
+      body_budget().release(size_ - n);
+   }
+
+   size_ = n;
+   return true;
+}
+
+} // smms
@@ -0,0 +1,121 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <memory_resource>
+
+namespace smms
+{
+
+using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+// Memory pool of the calling thread for objects that live as long as
+// a connection, e.g. sessions and read buffers. Freed blocks are kept
+// for reuse so that, once warmed up, handling a connection does not
+// hit the global heap.
+std::pmr::memory_resource* connection_pool();
+
+// Makes the connection pools thread safe, for when requests are
+// handled on other threads than their connections, see io_queue. Must
+// be called before any pool is used.
+void synchronize_connection_pools() noexcept;
+
+/* Monotonic arena for everything allocated while handling a request,
+ * i.e. the parser fields, the request body and the response. The
+ * first N bytes are served from the object itself, more memory is
+ * taken from the connection pool and returned to it on release or
+ * destruction.
+ */
+template <std::size_t N>
+class arena {
+private:
+   alignas(std::max_align_t) std::array<std::byte, N> buffer_;
+   std::pmr::monotonic_buffer_resource resource_;
+
+public:
+   arena()
+   : resource_ {buffer_.data(), N, connection_pool()}
+   { }
+
+   arena(arena const&) = delete;
+   arena& operator=(arena const&) = delete;
+
+   auto get_allocator() noexcept { return allocator_type {&resource_}; }
+   void release() { resource_.release(); }
+};
+
+/* Process wide budget for the bytes held in request and response
+ * bodies and image buffers. Handlers reserve what they are about to
+ * hold with a budget_lease and answer with 503 when the reservation
+ * fails, so that load spikes are shed instead of growing the process
+ * until the OOM killer steps in. A limit of zero means no limit, the
+ * usage is tracked anyway.
+ */
+class memory_budget {
+private:
+   std::atomic<std::size_t> used_ {0};
+   std::atomic<std::size_t> limit_ {0};
+
+public:
+   void set_limit(std::size_t n) noexcept { limit_ = n; }
+   auto limit() const noexcept { return limit_.load(); }
+   auto used() const noexcept { return used_.load(); }
+
+   bool acquire(std::size_t n) noexcept;
+   void release(std::size_t n) noexcept { used_ -= n; }
+};
+
+memory_budget& body_budget();
+
+// Bytes of the body budget held by a request or response, released
+// on destruction.
+class budget_lease {
+private:
+   std::size_t size_ = 0;
+
+public:
+   budget_lease() = default;
+
+   budget_lease(budget_lease&& other) noexcept
+   : size_ {std::exchange(other.size_, 0)}
+   { }
+
+   budget_lease& operator=(budget_lease&& other) noexcept
+   {
+      if (this != &other) {
+	 body_budget().release(size_);
+	 size_ = std::exchange(other.size_, 0);
+      }
+      return *this;
+   }
+
+   ~budget_lease() { body_budget().release(size_); }
+
+   // Grows or shrinks the lease to n bytes. Only growing can fail,
+   // the lease is then left unchanged.
+   bool resize(std::size_t n) noexcept;
+
+   auto size() const noexcept { return size_; }
+};
+
+} // smms
@@ -0,0 +1,255 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metadata.hpp"
+
+#include <ctime>
+#include <cstring>
+
+#include <sys/xattr.h>
+
+namespace smms
+{
+
+namespace {
+
+constexpr char meta_version[4] = {'s', 'm', 'm', '1'};
+constexpr char meta_attribute[] = "user.smms.meta";
+
+// Laid out in meta_bytes after the version.
+struct stored_meta {
+   std::uint8_t format;
+   std::uint8_t encodings;
+   std::uint16_t reserved;
+   std::uint32_t width;
+   std::uint32_t height;
+   std::uint32_t reserved2;
+   std::uint64_t size;
+   std::int64_t mtime;
+   std::array<unsigned char, 8> checksum;
+};
+
+static_assert(sizeof(meta_version) + sizeof(stored_meta) == sizeof(meta_bytes));
+
+unsigned byte(string_view s, std::size_t i) noexcept
+{
+   return static_cast<unsigned char>(s[i]);
+}
+
+std::uint32_t be16(string_view s, std::size_t i) noexcept
+{
+   return byte(s, i) << 8 | byte(s, i + 1);
+}
+
+std::uint32_t be32(string_view s, std::size_t i) noexcept
+{
+   return be16(s, i) << 16 | be16(s, i + 2);
+}
+
+std::uint32_t le16(string_view s, std::size_t i) noexcept
+{
+   return byte(s, i) | byte(s, i + 1) << 8;
+}
+
+std::uint32_t le24(string_view s, std::size_t i) noexcept
+{
+   return le16(s, i) | byte(s, i + 2) << 16;
+}
+
+// Walks the segments up to the frame header, see ITU T.81, B.1.1.
+void detect_jpeg(string_view s, object_meta& meta) noexcept
+{
+   std::size_t i = 2;
+   while (i + 4 <= std::size(s)) {
+      if (byte(s, i) != 0xff)
+	 return;
+
+      auto const marker = byte(s, i + 1);
+      if (marker == 0xff) {
+	 ++i; // Fill byte.
+	 continue;
+      }
+
+      // Markers without a segment.
+      if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+	 i += 2;
+	 continue;
+      }
+
+      // The image data follows, there was no frame header.
+      if (marker == 0xda || marker == 0xd9)
+	 return;
+
+      // SOF0 to SOF15 except DHT, JPG and DAC.
+      auto const is_sof =
+	 marker >= 0xc0 && marker <= 0xcf &&
+	 marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+
+      if (is_sof) {
+	 if (i + 9 > std::size(s))
+	    return;
+
+	 meta.format = image_format::jpeg;
+	 meta.height = be16(s, i + 5);
+	 meta.width = be16(s, i + 7);
+	 return;
+      }
+
+      i += 2 + be16(s, i + 2);
+   }
+}
+
+void detect_webp(string_view s, object_meta& meta) noexcept
+{
+   if (std::size(s) < 30)
+      return;
+
+   auto const chunk = s.substr(12, 4);
+   if (chunk == "VP8 ") {
+      meta.width = le16(s, 26) & 0x3fff;
+      meta.height = le16(s, 28) & 0x3fff;
+   } else if (chunk == "VP8L") {
+      auto const b1 = byte(s, 22);
+      meta.width = 1 + (byte(s, 21) | (b1 & 0x3f) << 8);
+      meta.height = 1 + (b1 >> 6 | byte(s, 23) << 2 | (byte(s, 24) & 0xf) << 10);
+   } else if (chunk == "VP8X") {
+      meta.width = 1 + le24(s, 24);
+      meta.height = 1 + le24(s, 27);
+   } else {
+      return;
+   }
+
+   meta.format = image_format::webp;
+}
+
+}
+
+void detect_image(string_view s, object_meta& meta) noexcept
+{
+   auto const n = std::size(s);
+   if (n >= 4 && byte(s, 0) == 0xff && byte(s, 1) == 0xd8) {
+      detect_jpeg(s, meta);
+   } else if (n >= 24 && s.substr(0, 8) == "\x89PNG\r\n\x1a\n") {
+      meta.format = image_format::png;
+      meta.width = be32(s, 16);
+      meta.height = be32(s, 20);
+   } else if (n >= 10 && (s.substr(0, 6) == "GIF87a" || s.substr(0, 6) == "GIF89a")) {
+      meta.format = image_format::gif;
+      meta.width = le16(s, 6);
+      meta.height = le16(s, 8);
+   } else if (n >= 12 && s.substr(0, 4) == "RIFF" && s.substr(8, 4) == "WEBP") {
+      detect_webp(s, meta);
+   }
+}
+
+object_meta make_meta(string_view data, blake2b::digest_type const& digest)
+{
+   object_meta ret;
+   ret.size = std::size(data);
+   ret.mtime = std::time(nullptr);
+   std::memcpy(ret.checksum.data(), digest.data(), std::size(ret.checksum));
+   detect_image(data, ret);
+   return ret;
+}
+
+meta_bytes serialize(object_meta const& meta) noexcept
+{
+   stored_meta const s
+   { static_cast<std::uint8_t>(meta.format)
+   , meta.encodings
+   , 0
+   , meta.width
+   , meta.height
+   , 0
+   , meta.size
+   , meta.mtime
+   , meta.checksum};
+
+   meta_bytes ret;
+   std::memcpy(ret.data(), meta_version, sizeof meta_version);
+   std::memcpy(ret.data() + sizeof meta_version, &s, sizeof s);
+   return ret;
+}
+
+std::optional<object_meta> parse_meta(string_view in) noexcept
+{
+   if (std::size(in) != sizeof(meta_bytes))
+      return {};
+
+   if (std::memcmp(in.data(), meta_version, sizeof meta_version) != 0)
+      return {};
+
+   stored_meta s;
+   std::memcpy(&s, in.data() + sizeof meta_version, sizeof s);
+   if (s.format > static_cast<std::uint8_t>(image_format::webp))
+      return {};
+
+   object_meta ret;
+   ret.size = s.size;
+   ret.mtime = s.mtime;
+   ret.checksum = s.checksum;
+   ret.format = static_cast<image_format>(s.format);
+   ret.width = s.width;
+   ret.height = s.height;
+   ret.encodings = s.encodings;
+   return ret;
+}
+
+std::optional<object_meta> read_meta(char const* path) noexcept
+{
+   meta_bytes buffer;
+   auto const n = ::getxattr(path, meta_attribute, buffer.data(), std::size(buffer));
+   if (n == -1)
+      return {};
+
+   return parse_meta({buffer.data(), static_cast<std::size_t>(n)});
+}
+
+bool write_meta(char const* path, object_meta const& meta) noexcept
+{
+   auto const bytes = serialize(meta);
+   return ::setxattr(path, meta_attribute, bytes.data(), std::size(bytes), 0) == 0;
+}
+
+std::string make_etag(object_meta const& meta, string_view suffix)
+{
+   constexpr char hex[] = "0123456789abcdef";
+
+   std::string ret = "\"";
+   for (auto c : meta.checksum) {
+      ret += hex[c >> 4];
+      ret += hex[c & 0xf];
+   }
+
+   ret.append(suffix.data(), std::size(suffix));
+   ret += "\"";
+   return ret;
+}
+
+std::string http_date(std::int64_t t)
+{
+   auto const tt = static_cast<std::time_t>(t);
+   std::tm tm;
+   ::gmtime_r(&tt, &tm);
+
+   char buffer[32];
+   auto const n = std::strftime(buffer, sizeof buffer, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+   return {buffer, n};
+}
+
+}
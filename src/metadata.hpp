@@ -0,0 +1,99 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <cstdint>
+#include <optional>
+
+#include "types.hpp"
+#include "crypto.hpp"
+#include "compression.hpp"
+
+namespace smms
+{
+
+// Image formats detected from the content of uploads.
+enum class image_format : std::uint8_t {none, jpeg, png, gif, webp};
+
+// Bits of object_meta::encodings, the compressed siblings stored
+// along with the object, e.g. name.gz.
+namespace encoding {
+constexpr std::uint8_t gzip = 1;
+constexpr std::uint8_t br = 2;
+constexpr std::uint8_t zstd = 4;
+
+// The bit of the coding, none for identity.
+constexpr std::uint8_t bit(content_coding c) noexcept
+{
+   switch (c) {
+      case content_coding::gzip: return gzip;
+      case content_coding::br: return br;
+      case content_coding::zstd: return zstd;
+      default: return 0;
+   }
+}
+}
+
+/* Metadata of a stored object, computed when it is uploaded so that
+ * GETs can make the header, answer HEAD and conditional requests and
+ * reject invalid resizes without opening the file. Files keep it in
+ * an extended attribute, or in a file of its own when deduplicating,
+ * the volume_store in an object of its own, see make_post_response.
+ */
+struct object_meta {
+   std::uint64_t size = 0;
+
+   // Seconds since the epoch.
+   std::int64_t mtime = 0;
+
+   // Of the content, the ETag is made from it.
+   std::array<unsigned char, 8> checksum {};
+
+   image_format format = image_format::none;
+   std::uint32_t width = 0;
+   std::uint32_t height = 0;
+
+   std::uint8_t encodings = 0;
+};
+
+// The format and dimensions of the image in data, from its header.
+void detect_image(string_view data, object_meta& meta) noexcept;
+
+// The metadata of content with the given hash uploaded now.
+object_meta make_meta(string_view data, blake2b::digest_type const& digest);
+
+// The serialized form, it starts with a version.
+using meta_bytes = std::array<char, 44>;
+
+meta_bytes serialize(object_meta const& meta) noexcept;
+std::optional<object_meta> parse_meta(string_view in) noexcept;
+
+// Reads and writes the extended attribute of the file.
+std::optional<object_meta> read_meta(char const* path) noexcept;
+bool write_meta(char const* path, object_meta const& meta) noexcept;
+
+// The quoted ETag of the content, the suffix tells apart encodings.
+std::string make_etag(object_meta const& meta, string_view suffix = {});
+
+// The mtime as HTTP-date, e.g. Sun, 06 Nov 1994 08:49:37 GMT.
+std::string http_date(std::int64_t t);
+
+}
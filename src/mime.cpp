@@ -0,0 +1,257 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mime.hpp"
+
+#include <array>
+#include <cstdint>
+
+#include "utils.hpp"
+
+namespace smms
+{
+
+namespace {
+
+struct builtin {
+   std::string_view ext;
+   std::string_view mime;
+};
+
+constexpr builtin builtins[] =
+{ {".htm",  "text/html"}
+, {".html", "text/html"}
+, {".php",  "text/html"}
+, {".css",  "text/css"}
+, {".txt",  "text/plain"}
+, {".js",   "application/javascript"}
+, {".json", "application/json"}
+, {".xml",  "application/xml"}
+, {".swf",  "application/x-shockwave-flash"}
+, {".flv",  "video/x-flv"}
+, {".png",  "image/png"}
+, {".jpe",  "image/jpeg"}
+, {".jpeg", "image/jpeg"}
+, {".jpg",  "image/jpeg"}
+, {".gif",  "image/gif"}
+, {".webp", "image/webp"}
+, {".bmp",  "image/bmp"}
+, {".ico",  "image/vnd.microsoft.icon"}
+, {".tiff", "image/tiff"}
+, {".tif",  "image/tiff"}
+, {".svg",  "image/svg+xml"}
+, {".svgz", "image/svg+xml"}
+};
+
+constexpr std::string_view default_mime = "application/text";
+
+// Extensions longer than that are never matched.
+constexpr std::size_t max_ext_size = 32;
+
+// FNV-1a followed by a seeded finalizer so that every seed gives a
+// different distribution of the low bits.
+constexpr std::uint32_t
+hash(std::string_view s, std::uint32_t seed) noexcept
+{
+   std::uint32_t h = 2166136261u;
+   for (auto c : s) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 16777619u;
+   }
+
+   h ^= seed;
+   h ^= h >> 16;
+   h *= 0x7feb352du;
+   h ^= h >> 15;
+   h *= 0x846ca68bu;
+   h ^= h >> 16;
+   return h;
+}
+
+// The built-in table is indexed with a perfect hash, the seed is
+// searched for at compile time.
+constexpr std::size_t table_size = 64;
+
+constexpr std::uint32_t find_seed()
+{
+   for (std::uint32_t seed = 0;; ++seed) {
+      std::array<bool, table_size> used {};
+      auto ok = true;
+      for (auto const& b : builtins) {
+	 auto& u = used[hash(b.ext, seed) % table_size];
+	 if (u) {
+	    ok = false;
+	    break;
+	 }
+	 u = true;
+      }
+
+      if (ok)
+	 return seed;
+   }
+}
+
+constexpr auto seed = find_seed();
+
+constexpr auto make_table()
+{
+   std::array<signed char, table_size> table {};
+   for (auto& e : table)
+      e = -1;
+
+   for (std::size_t i = 0; i < std::size(builtins); ++i)
+      table[hash(builtins[i].ext, seed) % table_size] = i;
+
+   return table;
+}
+
+constexpr auto table = make_table();
+
+// Returns the index of ext in the builtins or their size if there is
+// no such extension.
+std::size_t builtin_index(std::string_view ext) noexcept
+{
+   auto const i = table[hash(ext, seed) % table_size];
+   if (i == -1 || builtins[i].ext != ext)
+      return std::size(builtins);
+
+   return i;
+}
+
+std::string_view builtin_mime(std::size_t i) noexcept
+{
+   if (i == std::size(builtins))
+      return default_mime;
+
+   return builtins[i].mime;
+}
+
+std::string_view builtin_mime(std::string_view ext) noexcept
+{
+   return builtin_mime(builtin_index(ext));
+}
+
+// Writes the lower case version of ext into buffer. Returns an empty
+// view if it does not fit.
+std::string_view
+to_lower(string_view ext, std::array<char, max_ext_size>& buffer) noexcept
+{
+   if (std::size(ext) > std::size(buffer))
+      return {};
+
+   for (std::size_t i = 0; i < std::size(ext); ++i) {
+      auto const c = ext[i];
+      buffer[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+   }
+
+   return {buffer.data(), std::size(ext)};
+}
+
+string_view to_view(std::string_view s) noexcept
+{
+   return {s.data(), std::size(s)};
+}
+
+}
+
+string_view mime_type(string_view path) noexcept
+{
+   std::array<char, max_ext_size> buffer;
+   return to_view(builtin_mime(to_lower(make_extension(path), buffer)));
+}
+
+file_types::entry* file_types::get(std::string_view ext)
+{
+   std::array<char, max_ext_size> buffer;
+   auto const key = to_lower({ext.data(), std::size(ext)}, buffer);
+   if (std::empty(key))
+      return nullptr;
+
+   auto match = map_.find(key);
+   if (match != std::end(map_))
+      return &match->second;
+
+   entry e;
+   e.mime = builtin_mime(key);
+   e.id = std::size(builtins) + 1 + std::size(keys_);
+   keys_.push_back(std::string {key});
+   return &map_.emplace(std::string {key}, std::move(e)).first->second;
+}
+
+void file_types::set_mime(std::string_view ext, std::string_view mime)
+{
+   if (auto e = get(ext))
+      e->mime = mime;
+}
+
+void file_types::set_gzip(std::string_view ext)
+{
+   if (auto e = get(ext))
+      e->gzip = true;
+}
+
+void
+file_types::set_cache_control(std::string_view ext, std::string_view value)
+{
+   if (auto e = get(ext))
+      e->cache_control = value;
+}
+
+void file_types::set_default_cache_control(std::string_view value)
+{
+   default_cache_control_ = value;
+}
+
+file_type file_types::classify(string_view path) const noexcept
+{
+   std::array<char, max_ext_size> buffer;
+   auto const ext = to_lower(make_extension(path), buffer);
+
+   if (!std::empty(map_)) {
+      auto const match = map_.find(ext);
+      if (match != std::end(map_))
+	 return make_type(match->second);
+   }
+
+   auto const i = builtin_index(ext);
+   return {to_view(builtin_mime(i)), default_cache_control_, false, i};
+}
+
+file_type file_types::make_type(entry const& e) const noexcept
+{
+   auto const& cc =
+      std::empty(e.cache_control) ? default_cache_control_
+				  : e.cache_control;
+   return {e.mime, cc, e.gzip, e.id};
+}
+
+std::size_t file_types::size() const noexcept
+{
+   return std::size(builtins) + 1 + std::size(keys_);
+}
+
+file_type file_types::at(std::size_t id) const
+{
+   if (id <= std::size(builtins))
+      return {to_view(builtin_mime(id)), default_cache_control_, false, id};
+
+   auto const match = map_.find(keys_.at(id - std::size(builtins) - 1));
+   return make_type(match->second);
+}
+
+} // smms
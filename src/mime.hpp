@@ -0,0 +1,88 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+#include "types.hpp"
+
+namespace smms
+{
+
+// Returns the mime type of path from the built-in table, see
+// mime.cpp. The lookup is case insensitive.
+string_view mime_type(string_view path) noexcept;
+
+// Everything we need to know about a file to build the response
+// headers, as determined by its extension. The id is unique within a
+// file_types object and lies in [0, file_types::size()).
+struct file_type {
+   string_view mime;
+   string_view cache_control;
+   bool gzip = false;
+   std::size_t id = 0;
+};
+
+/* Classifies files by their extension. Extensions mentioned in the
+ * config file are stored in a hash map together with their gzip
+ * eligibility and cache-control value, all others are looked up in
+ * the built-in mime table and get the default cache-control.
+ *
+ * Extensions are expected in the form ".ext" and are compared case
+ * insensitively, invalid ones are ignored by the setters.
+ */
+class file_types {
+private:
+   struct entry {
+      std::string mime;
+      std::string cache_control;
+      bool gzip = false;
+      std::size_t id = 0;
+   };
+
+   struct hash {
+      using is_transparent = void;
+      std::size_t operator()(std::string_view s) const noexcept
+         { return std::hash<std::string_view>{}(s); }
+   };
+
+   std::unordered_map<std::string, entry, hash, std::equal_to<>> map_;
+   std::vector<std::string> keys_;
+   std::string default_cache_control_;
+
+   entry* get(std::string_view ext);
+   file_type make_type(entry const& e) const noexcept;
+
+public:
+   void set_mime(std::string_view ext, std::string_view mime);
+   void set_gzip(std::string_view ext);
+   void set_cache_control(std::string_view ext, std::string_view value);
+   void set_default_cache_control(std::string_view value);
+
+   file_type classify(string_view path) const noexcept;
+
+   // Number of distinct file types, used to precompute data per type.
+   std::size_t size() const noexcept;
+   file_type at(std::size_t id) const;
+};
+
+} // smms
@@ -17,16 +17,213 @@
  */
 
 #include "net.hpp"
-#include "utils.hpp"
 #include "logger.hpp"
 
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
 namespace smms
 {
 
-bool load_ssl( ssl::context& ctx
-             , std::string const& ssl_cert_file
-             , std::string const& ssl_priv_key_file
-             , std::string const& ssl_dh_file)
+namespace {
+
+struct ticket_key {
+   std::array<unsigned char, 16> name;
+   std::array<unsigned char, 32> aes;
+   std::array<unsigned char, 32> hmac;
+};
+
+// The session ticket keys, rotated lazily when a ticket is issued
+// after the rotation period has elapsed. Shared by the handshakes of
+// all event loops, keys are handed out as copies.
+class ticket_keys {
+private:
+   using clock_type = std::chrono::steady_clock;
+
+   mutable std::mutex mutex_;
+
+   // Current and previous key.
+   std::array<ticket_key, 2> keys_;
+   clock_type::time_point created_;
+   std::chrono::seconds period_ {0};
+
+   static void make_key(ticket_key& key)
+   {
+      RAND_bytes(key.name.data(), std::size(key.name));
+      RAND_bytes(key.aes.data(), std::size(key.aes));
+      RAND_bytes(key.hmac.data(), std::size(key.hmac));
+   }
+
+   void rotate()
+   {
+      auto const now = clock_type::now();
+      if (now - created_ < period_)
+         return;
+
+      if (now - created_ < 2 * period_)
+         keys_[1] = keys_[0];
+      else
+         make_key(keys_[1]);
+
+      make_key(keys_[0]);
+      created_ = now;
+   }
+
+public:
+   void init(std::chrono::seconds period)
+   {
+      period_ = period;
+      make_key(keys_[0]);
+      make_key(keys_[1]);
+      created_ = clock_type::now();
+   }
+
+   ticket_key current()
+   {
+      std::lock_guard lock {mutex_};
+      rotate();
+      return keys_[0];
+   }
+
+   // Copies the key with the given name to key and returns its index
+   // or -1.
+   int find(unsigned char const* name, ticket_key& key) const
+   {
+      std::lock_guard lock {mutex_};
+      for (auto i = 0; i < 2; ++i) {
+         if (std::memcmp(name, keys_[i].name.data(), 16) == 0) {
+            key = keys_[i];
+            return i;
+         }
+      }
+
+      return -1;
+   }
+};
+
+ticket_keys keys;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+using mac_ctx = EVP_MAC_CTX;
+
+int set_mac_key(EVP_MAC_CTX* hctx, ticket_key const& key)
+{
+   char digest[] = "sha256";
+   OSSL_PARAM params[] =
+   { OSSL_PARAM_construct_octet_string(
+        OSSL_MAC_PARAM_KEY,
+        const_cast<unsigned char*>(key.hmac.data()),
+        std::size(key.hmac))
+   , OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0)
+   , OSSL_PARAM_construct_end()
+   };
+
+   return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+using mac_ctx = HMAC_CTX;
+
+int set_mac_key(HMAC_CTX* hctx, ticket_key const& key)
+{
+   return
+      HMAC_Init_ex(
+         hctx,
+         key.hmac.data(),
+         std::size(key.hmac),
+         EVP_sha256(),
+         nullptr);
+}
+#endif
+
+// See SSL_CTX_set_tlsext_ticket_key_evp_cb(3).
+int on_ticket_key(
+   SSL*,
+   unsigned char* key_name,
+   unsigned char* iv,
+   EVP_CIPHER_CTX* ctx,
+   mac_ctx* hctx,
+   int enc)
+{
+   if (enc) {
+      auto const key = keys.current();
+      if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+         return -1;
+
+      std::memcpy(key_name, key.name.data(), std::size(key.name));
+      if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.aes.data(), iv) != 1)
+         return -1;
+
+      return set_mac_key(hctx, key) == 1 ? 1 : -1;
+   }
+
+   ticket_key key;
+   auto const i = keys.find(key_name, key);
+   if (i == -1)
+      return 0; // Unknown or expired key, full handshake.
+
+   if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key.aes.data(), iv) != 1)
+      return -1;
+
+   if (set_mac_key(hctx, key) != 1)
+      return -1;
+
+   // Asks the client to renew tickets encrypted with the old key.
+   return i == 0 ? 1 : 2;
+}
+
+// Prefers h2 over http/1.1, clients without either get http/1.1
+// anyway.
+int on_alpn_select(
+   SSL*,
+   unsigned char const** out,
+   unsigned char* outlen,
+   unsigned char const* in,
+   unsigned int inlen,
+   void*)
+{
+   static constexpr unsigned char protos[] = "\x02h2\x08http/1.1";
+
+   unsigned char* selected = nullptr;
+   auto const r =
+      SSL_select_next_proto(
+         &selected,
+         outlen,
+         protos,
+         sizeof protos - 1,
+         in,
+         inlen);
+
+   if (r != OPENSSL_NPN_NEGOTIATED)
+      return SSL_TLSEXT_ERR_NOACK;
+
+   *out = selected;
+   return SSL_TLSEXT_ERR_OK;
+}
+
+}
+
+bool ktls_enabled(ssl::context& ctx) noexcept
+{
+#ifdef SSL_OP_ENABLE_KTLS
+   return SSL_CTX_get_options(ctx.native_handle()) & SSL_OP_ENABLE_KTLS;
+#else
+   return false;
+#endif
+}
+
+bool load_ssl(ssl::context& ctx, tls_config const& cfg)
 {
    boost::system::error_code ec;
 
@@ -44,7 +241,11 @@ bool load_ssl( ssl::context& ctx
    ctx.set_options(
       ssl::context::default_workarounds |
       ssl::context::no_sslv2 |
-      ssl::context::single_dh_use, ec);
+      ssl::context::no_sslv3 |
+      ssl::context::no_tlsv1 |
+      ssl::context::no_tlsv1_1 |
+      ssl::context::single_dh_use |
+      SSL_OP_CIPHER_SERVER_PREFERENCE, ec);
 
    if (ec) {
       log::write( log::level::emerg
@@ -53,9 +254,62 @@ bool load_ssl( ssl::context& ctx
       return false;
    }
 
+   auto* const handle = ctx.native_handle();
+
+   SSL_CTX_set_min_proto_version(handle, TLS1_2_VERSION);
+
+   if (!std::empty(cfg.ciphers) &&
+       SSL_CTX_set_cipher_list(handle, cfg.ciphers.data()) != 1) {
+      log::write( log::level::emerg
+                , "load_ssl: invalid cipher list: {}"
+                , cfg.ciphers);
+      return false;
+   }
+
+   if (!std::empty(cfg.ciphersuites) &&
+       SSL_CTX_set_ciphersuites(handle, cfg.ciphersuites.data()) != 1) {
+      log::write( log::level::emerg
+                , "load_ssl: invalid cipher suites: {}"
+                , cfg.ciphersuites);
+      return false;
+   }
+
+   // Cheap ECDHE groups first.
+   SSL_CTX_set1_groups_list(handle, "X25519:P-256:P-384");
+
+   // Server side session cache for clients resuming with session ids.
+   unsigned char const sid_ctx[] = "smms";
+   SSL_CTX_set_session_id_context(handle, sid_ctx, sizeof sid_ctx - 1);
+   SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_SERVER);
+   SSL_CTX_sess_set_cache_size(handle, cfg.session_cache_size);
+   SSL_CTX_set_timeout(handle, cfg.session_timeout);
+
+   if (cfg.ticket_key_rotation > 0) {
+      keys.init(std::chrono::seconds {cfg.ticket_key_rotation});
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+      SSL_CTX_set_tlsext_ticket_key_evp_cb(handle, on_ticket_key);
+#else
+      SSL_CTX_set_tlsext_ticket_key_cb(handle, on_ticket_key);
+#endif
+   } else {
+      SSL_CTX_set_options(handle, SSL_OP_NO_TICKET);
+   }
+
+   if (cfg.ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+      SSL_CTX_set_options(handle, SSL_OP_ENABLE_KTLS);
+#else
+      log::write( log::level::warning
+                , "load_ssl: OpenSSL has no kTLS support, ignoring ssl-ktls.");
+#endif
+   }
+
+   if (cfg.http2)
+      SSL_CTX_set_alpn_select_cb(handle, on_alpn_select, nullptr);
+
    ec = {};
 
-   ctx.use_certificate_chain_file(ssl_cert_file, ec);
+   ctx.use_certificate_chain_file(cfg.cert_file, ec);
 
    if (ec) {
       log::write( log::level::emerg
@@ -66,8 +320,9 @@ bool load_ssl( ssl::context& ctx
 
    ec = {};
 
-   ctx.use_private_key_file( ssl_priv_key_file
-                           , ssl::context::file_format::pem);
+   ctx.use_private_key_file( cfg.priv_key_file
+                           , ssl::context::file_format::pem
+                           , ec);
 
    if (ec) {
       log::write( log::level::emerg
@@ -76,9 +331,12 @@ bool load_ssl( ssl::context& ctx
       return false;
    }
 
+   if (std::empty(cfg.dh_file))
+      return true;
+
    ec = {};
 
-   ctx.use_tmp_dh_file(ssl_dh_file, ec);
+   ctx.use_tmp_dh_file(cfg.dh_file, ec);
 
    if (ec) {
       log::write( log::level::emerg
@@ -90,47 +348,4 @@ bool load_ssl( ssl::context& ctx
    return true;
 }
 
-beast::string_view mime_type(beast::string_view path)
-{
-   using beast::iequals;
-
-   auto const ext = make_extension(path);
-
-   if (iequals(ext, ".htm"))  return "text/html";
-   if (iequals(ext, ".html")) return "text/html";
-   if (iequals(ext, ".php"))  return "text/html";
-   if (iequals(ext, ".css"))  return "text/css";
-   if (iequals(ext, ".txt"))  return "text/plain";
-   if (iequals(ext, ".js"))   return "application/javascript";
-   if (iequals(ext, ".json")) return "application/json";
-   if (iequals(ext, ".xml"))  return "application/xml";
-   if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-   if (iequals(ext, ".flv"))  return "video/x-flv";
-   if (iequals(ext, ".png"))  return "image/png";
-   if (iequals(ext, ".jpe"))  return "image/jpeg";
-   if (iequals(ext, ".jpeg")) return "image/jpeg";
-   if (iequals(ext, ".jpg"))  return "image/jpeg";
-   if (iequals(ext, ".gif"))  return "image/gif";
-   if (iequals(ext, ".bmp"))  return "image/bmp";
-   if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-   if (iequals(ext, ".tiff")) return "image/tiff";
-   if (iequals(ext, ".tif"))  return "image/tiff";
-   if (iequals(ext, ".svg"))  return "image/svg+xml";
-   if (iequals(ext, ".svgz")) return "image/svg+xml";
-
-   return "application/text";
-}
-
-bool has_mime(beast::string_view path, std::vector<std::string> const& mimes)
-{
-   using beast::iequals;
-
-   auto const ext = make_extension(path);
-
-   auto f = [&](auto const& mime)
-     { return iequals(ext, mime); };
-
-   return std::any_of(std::cbegin(mimes), std::cend(mimes), f);
-}
-
 } // smms
@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <utility>
 #include <iostream>
 
@@ -25,6 +26,7 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
 
 #include <boost/beast/ssl.hpp>
 #include <boost/beast/core.hpp>
@@ -42,13 +44,63 @@ using tcp = net::ip::tcp;
 namespace smms
 {
 
-bool load_ssl( ssl::context& ctx
-             , std::string const& ssl_cert_file
-             , std::string const& ssl_priv_key_file
-             , std::string const& ssl_dh_file);
+// The sockets and streams of the sessions, TCP or Unix domain. They
+// keep the protocol of the listener, sessions only do what works on
+// both, see acceptor.hpp.
+using stream_socket = net::generic::stream_protocol::socket;
+using plain_stream = beast::basic_stream<net::generic::stream_protocol>;
 
-beast::string_view mime_type(beast::string_view path);
-bool has_mime(beast::string_view path, std::vector<std::string> const& mimes);
+struct tls_config {
+   std::string cert_file;
+   std::string priv_key_file;
+
+   // Optional, only needed for DHE cipher suites.
+   std::string dh_file;
+
+   // TLS 1.2 cipher list and TLS 1.3 cipher suites in OpenSSL format.
+   std::string ciphers;
+   std::string ciphersuites;
+
+   long session_cache_size {20480};
+   long session_timeout {300};
+
+   // Period in seconds after which a new session ticket key is
+   // generated. Tickets encrypted with the previous key are still
+   // accepted. Zero disables tickets.
+   long ticket_key_rotation {3600};
+
+   // Lets OpenSSL move record encryption into the kernel after the
+   // handshake so files can be sent with sendfile(2), see
+   // ktls_stream.
+   bool ktls {false};
+
+   // Offers h2 in ALPN, the sessions then hand connections that
+   // select it over to http2_session.
+   bool http2 {false};
+};
+
+bool load_ssl(ssl::context& ctx, tls_config const& cfg);
+
+// Whether load_ssl enabled kTLS on the context.
+bool ktls_enabled(ssl::context& ctx) noexcept;
+
+/* A completion condition for net::async_write that restarts the
+ * timeout of the stream before every write, i.e. the write fails when
+ * it makes no progress for the duration rather than when all of it
+ * takes longer, which a large response to a slow client may.
+ */
+template <class Stream>
+auto restart_timeout(Stream& stream, std::chrono::steady_clock::duration d)
+{
+   return [&stream, d](beast::error_code const& ec, std::size_t) -> std::size_t
+   {
+      if (ec)
+         return 0;
+
+      beast::get_lowest_layer(stream).expires_after(d);
+      return 65536;
+   };
+}
 
 } // smms
 
@@ -0,0 +1,307 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rate_limiter.hpp"
+
+#include <random>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+namespace smms
+{
+
+namespace {
+
+std::uint64_t mix(std::uint64_t x) noexcept
+{
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111eb;
+   x ^= x >> 31;
+   return x;
+}
+
+bool is_v4_mapped(std::array<unsigned char, 16> const& a) noexcept
+{
+   constexpr unsigned char prefix[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+   return std::memcmp(a.data(), prefix, sizeof prefix) == 0;
+}
+
+}
+
+rate_limiter::rate_limiter(limits const& l)
+: limits_ {l}
+{
+   // Addresses are chosen by the clients, a random seed keeps them
+   // from crafting collisions.
+   std::random_device rd;
+   seed_ = (std::uint64_t {rd()} << 32) | rd();
+}
+
+std::uint64_t rate_limiter::hash(key const& k) const noexcept
+{
+   std::uint64_t lo, hi;
+   std::memcpy(&lo, k.addr.data(), 8);
+   std::memcpy(&hi, k.addr.data() + 8, 8);
+
+   auto h = mix(seed_ ^ static_cast<std::uint64_t>(k.k));
+   h = mix(h ^ lo);
+   return mix(h ^ hi);
+}
+
+void rate_limiter::sweep(shard& s, clock_type::time_point now)
+{
+   // Buckets in debt are full again after this long, see take.
+   std::chrono::duration<double> const idle {2 * limits_.burst};
+   s.next_sweep = now + std::chrono::duration_cast<clock_type::duration>(idle);
+
+   auto const is_live = [&](entry const& e)
+      { return e.k != kind::empty && now - e.last < idle; };
+
+   auto const live = std::count_if(std::cbegin(s.entries), std::cend(s.entries), is_live);
+
+   // Keeps the load factor at or below one half.
+   std::size_t capacity = 16;
+   while (capacity < 2 * static_cast<std::size_t>(live) + 2)
+      capacity *= 2;
+
+   std::vector<entry> old(capacity);
+   std::swap(old, s.entries);
+   s.size = 0;
+
+   auto const mask = capacity - 1;
+   for (auto const& e : old) {
+      if (!is_live(e))
+	 continue;
+
+      auto i = hash({e.addr, e.k}) / shard_count & mask;
+      while (s.entries[i].k != kind::empty)
+	 i = (i + 1) & mask;
+
+      s.entries[i] = e;
+      ++s.size;
+   }
+}
+
+rate_limiter::entry*
+rate_limiter::find_or_insert(
+   shard& s,
+   key const& k,
+   std::uint64_t h,
+   clock_type::time_point now)
+{
+   if (now >= s.next_sweep)
+      sweep(s, now);
+
+   auto mask = std::size(s.entries) - 1;
+   auto i = h & mask;
+   for (; s.entries[i].k != kind::empty; i = (i + 1) & mask) {
+      if (s.entries[i].k == k.k && s.entries[i].addr == k.addr)
+	 return &s.entries[i];
+   }
+
+   if (s.size >= limits_.max_entries / shard_count)
+      return nullptr;
+
+   if (2 * (s.size + 1) > std::size(s.entries)) {
+      // Sweeping grows the table.
+      sweep(s, now);
+      mask = std::size(s.entries) - 1;
+      i = h & mask;
+      while (s.entries[i].k != kind::empty)
+	 i = (i + 1) & mask;
+   }
+
+   auto const factor = k.k == kind::prefix ? limits_.prefix_factor : 1.0;
+
+   auto& e = s.entries[i];
+   e.addr = k.addr;
+   e.k = k.k;
+   e.last = now;
+   e.tokens =
+   { limits_.connections * factor * limits_.burst
+   , limits_.requests * factor * limits_.burst
+   , limits_.bytes * factor * limits_.burst};
+
+   ++s.size;
+   return &e;
+}
+
+void
+rate_limiter::refill(
+   entry& e,
+   double factor,
+   clock_type::time_point now) const noexcept
+{
+   std::chrono::duration<double> const elapsed = now - e.last;
+   double const rates[] = {limits_.connections, limits_.requests, limits_.bytes};
+
+   for (auto i = 0; i < resource_count; ++i) {
+      auto const rate = rates[i] * factor;
+      e.tokens[i] = std::min(rate * limits_.burst, e.tokens[i] + rate * elapsed.count());
+   }
+
+   e.last = now;
+}
+
+bool
+rate_limiter::take(
+   key const& k,
+   costs const& c,
+   bool force,
+   clock_type::time_point now)
+{
+   auto const h = hash(k);
+   auto& s = shards_[h % shard_count];
+
+   std::lock_guard lock {s.mutex};
+   auto* e = find_or_insert(s, k, h / shard_count, now);
+   if (!e)
+      return true;
+
+   auto const factor = k.k == kind::prefix ? limits_.prefix_factor : 1.0;
+   refill(*e, factor, now);
+
+   double const rates[] = {limits_.connections, limits_.requests, limits_.bytes};
+
+   if (!force) {
+      for (auto i = 0; i < resource_count; ++i) {
+	 if (rates[i] != 0 && e->tokens[i] < c[i])
+	    return false;
+      }
+   }
+
+   // The debt is bounded by the bucket size, a client pays it off
+   // after being quiet for at most 2 * burst seconds.
+   for (auto i = 0; i < resource_count; ++i) {
+      auto const size = rates[i] * factor * limits_.burst;
+      e->tokens[i] = std::clamp(e->tokens[i] - c[i], -size, size);
+   }
+
+   return true;
+}
+
+bool
+rate_limiter::take(
+   ip::address const& addr,
+   costs const& c,
+   bool force,
+   clock_type::time_point now)
+{
+   key a {};
+   a.k = kind::address;
+   if (addr.is_v4())
+      a.addr = ip::make_address_v6(ip::v4_mapped, addr.to_v4()).to_bytes();
+   else
+      a.addr = addr.to_v6().to_bytes();
+
+   key p = a;
+   p.k = kind::prefix;
+   if (is_v4_mapped(p.addr))
+      p.addr[15] = 0;
+   else
+      std::fill(std::begin(p.addr) + 8, std::end(p.addr), 0);
+
+   if (!take(a, c, force, now))
+      return false;
+
+   if (take(p, c, force, now))
+      return true;
+
+   costs refund;
+   for (auto i = 0; i < resource_count; ++i)
+      refund[i] = -c[i];
+
+   take(a, refund, true, now);
+   return false;
+}
+
+bool
+rate_limiter::admit_connection(
+   ip::address const& addr,
+   clock_type::time_point now)
+{
+   return take(addr, {1, 1, 0}, false, now);
+}
+
+bool
+rate_limiter::admit_request(
+   ip::address const& addr,
+   clock_type::time_point now)
+{
+   return take(addr, {0, 1, 0}, false, now);
+}
+
+void
+rate_limiter::charge(
+   ip::address const& addr,
+   std::uint64_t n,
+   clock_type::time_point now)
+{
+   if (limits_.bytes != 0)
+      take(addr, {0, 0, static_cast<double>(n)}, true, now);
+}
+
+std::size_t rate_limiter::size()
+{
+   std::size_t ret = 0;
+   for (auto& s : shards_) {
+      std::lock_guard lock {s.mutex};
+      ret += s.size;
+   }
+
+   return ret;
+}
+
+std::optional<ip::address> peer_address(stream_socket& socket)
+{
+   sockaddr_storage ss {};
+   socklen_t len = sizeof ss;
+   auto* const sa = reinterpret_cast<sockaddr*>(&ss);
+   if (::getpeername(socket.native_handle(), sa, &len) == -1)
+      return {};
+
+   if (ss.ss_family == AF_INET) {
+      auto const* in = reinterpret_cast<sockaddr_in const*>(&ss);
+      return ip::address_v4 {ntohl(in->sin_addr.s_addr)};
+   }
+
+   if (ss.ss_family == AF_INET6) {
+      auto const* in6 = reinterpret_cast<sockaddr_in6 const*>(&ss);
+      ip::address_v6::bytes_type bytes;
+      std::memcpy(bytes.data(), &in6->sin6_addr, std::size(bytes));
+      return ip::address_v6 {bytes};
+   }
+
+   return {};
+}
+
+void charge_peer(rate_limiter* limiter, stream_socket& socket, std::uint64_t n)
+{
+   if (!limiter || limiter->get_limits().bytes == 0)
+      return;
+
+   if (auto const addr = peer_address(socket))
+      limiter->charge(*addr, n);
+}
+
+}
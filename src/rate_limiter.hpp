@@ -0,0 +1,150 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <optional>
+
+#include "net.hpp"
+
+namespace smms
+{
+
+/* Token buckets for the connections, requests and bytes of every
+ * client address and of its network, the /24 for IPv4 and the /64 for
+ * IPv6, so that a client can't get around the limits by using many
+ * addresses of the same network.
+ *
+ * Connections and requests are taken before they are served. Bytes
+ * are only known afterwards, they are charged and may put the bucket
+ * in debt, in which case the client gets no further connections or
+ * requests until it is paid off.
+ *
+ * The buckets live in a sharded open addressing table. A bucket that
+ * was idle for 2 * burst seconds is full, even one that was in debt
+ * by its whole size, i.e. the same as a new one, so such entries are
+ * dropped lazily when their shard is used after that time. Clients
+ * that don't fit in a full shard are not limited.
+ */
+class rate_limiter {
+public:
+   using clock_type = std::chrono::steady_clock;
+
+   struct limits {
+      // Per second and client address, 0 disables the bucket.
+      double connections = 0;
+      double requests = 0;
+      double bytes = 0;
+
+      // Bucket size in seconds of the rate.
+      double burst = 10;
+
+      // The network of the address gets this many times the rates
+      // of an address.
+      double prefix_factor = 16;
+
+      // Maximum number of addresses and networks tracked.
+      std::size_t max_entries = 1 << 18;
+
+      auto enabled() const noexcept
+         { return connections != 0 || requests != 0 || bytes != 0; }
+   };
+
+private:
+   static constexpr std::size_t shard_count = 16;
+
+   // Indexes of the buckets.
+   enum resource {connections, requests, bytes, resource_count};
+   using costs = std::array<double, resource_count>;
+
+   enum class kind : std::uint8_t {empty, address, prefix};
+
+   struct key {
+      std::array<unsigned char, 16> addr;
+      kind k;
+   };
+
+   struct entry {
+      std::array<unsigned char, 16> addr;
+      kind k = kind::empty;
+      clock_type::time_point last;
+      std::array<double, resource_count> tokens;
+   };
+
+   struct shard {
+      std::mutex mutex;
+      std::vector<entry> entries;
+      std::size_t size = 0;
+      clock_type::time_point next_sweep;
+   };
+
+   limits limits_;
+   std::uint64_t seed_;
+   std::array<shard, shard_count> shards_;
+
+   std::uint64_t hash(key const& k) const noexcept;
+   entry* find_or_insert(shard& s, key const& k, std::uint64_t h, clock_type::time_point now);
+   void sweep(shard& s, clock_type::time_point now);
+   void refill(entry& e, double factor, clock_type::time_point now) const noexcept;
+   bool take(key const& k, costs const& c, bool force, clock_type::time_point now);
+   bool take(ip::address const& addr, costs const& c, bool force, clock_type::time_point now);
+
+public:
+   explicit rate_limiter(limits const& l);
+
+   rate_limiter(rate_limiter const&) = delete;
+   rate_limiter& operator=(rate_limiter const&) = delete;
+
+   // Takes a connection and a request, an HTTP/1.1 connection carries
+   // a single request. Returns false if the client is over the limits.
+   bool admit_connection(
+      ip::address const& addr,
+      clock_type::time_point now = clock_type::now());
+
+   // Takes a request, e.g. for a new HTTP/2 stream.
+   bool admit_request(
+      ip::address const& addr,
+      clock_type::time_point now = clock_type::now());
+
+   // Charges bytes read or written on behalf of the client.
+   void charge(
+      ip::address const& addr,
+      std::uint64_t n,
+      clock_type::time_point now = clock_type::now());
+
+   // Number of addresses and networks tracked.
+   std::size_t size();
+
+   auto const& get_limits() const noexcept { return limits_; }
+};
+
+// The address of the peer of a TCP socket or nothing, e.g. for Unix
+// domain sockets.
+std::optional<ip::address> peer_address(stream_socket& socket);
+
+// Charges n bytes to the peer of the socket. Does nothing without a
+// limiter or a byte limit, so that sessions don't ask for the address
+// in vain.
+void charge_peer(rate_limiter* limiter, stream_socket& socket, std::uint64_t n);
+
+}
@@ -21,10 +21,15 @@
 #include "net.hpp"
 
 #include <vector>
+#include <cstring>
+#include <algorithm>
 #include <iterator>
 
 #include "logger.hpp"
+#include "ktls_stream.hpp"
+#include "rate_limiter.hpp"
 #include "session_impl.hpp"
+#include "http2_session.hpp"
 
 namespace smms
 {
@@ -32,12 +37,23 @@ namespace smms
 template<class Derived>
 class session {
 protected:
-   beast::flat_buffer buffer_ {8192};
+   buffer_type buffer_;
 
 private:
-   http::request_parser<http::string_body> parser_;
-   http::response<http::string_body> response_;
-   
+   arena<4096> arena_;
+   request_parser parser_;
+   response response_;
+   budget_lease body_lease_;
+   body_hasher hasher_;
+
+   // When the body started and how much of it was read, see
+   // config::body_time_left.
+   std::chrono::steady_clock::time_point body_start_;
+   std::uint64_t body_read_ = 0;
+
+   // Bounds the waits for the socket while sending files.
+   net::steady_timer send_timer_;
+
    config const& cfg_;
 
    Derived& derived()
@@ -45,16 +61,64 @@ private:
 
    void post_handler(beast::string_view raw_target)
    {
-      response_ = make_post_response(raw_target, parser_, cfg_);
+      response_ = make_post_response(raw_target, parser_.get(), cfg_);
       write_response();
    }
 
    void get_handler(beast::string_view raw_target)
    {
-      response_ = make_get_response(raw_target, parser_, cfg_);
+      response_ = make_get_response(raw_target, parser_.get(), cfg_);
       write_response();
    }
 
+   // Reserves the body in the budget before reading it.
+   void on_read_header(boost::system::error_code ec, std::size_t n)
+   {
+      if (ec || parser_.is_done()) {
+	 on_read(ec, n);
+	 return;
+      }
+
+      auto const length = parser_.content_length().value_or(cfg_.body_limit);
+      if (!body_lease_.resize(std::min(length, cfg_.body_limit))) {
+	 log::write(log::level::info, "on_read_header: Memory budget exhausted.");
+	 response_ = response {cfg_.responses.service_unavailable};
+	 write_response();
+	 return;
+      }
+
+      hasher_.start(parser_.get(), cfg_);
+      body_start_ = std::chrono::steady_clock::now();
+      do_read_body();
+   }
+
+   // Reads the body piecewise, each read gets the time the minimum
+   // body rate leaves for it, so slow clients are dropped early.
+   void do_read_body()
+   {
+      auto const elapsed = std::chrono::steady_clock::now() - body_start_;
+      auto const left = cfg_.body_time_left(body_read_, elapsed);
+      beast::get_lowest_layer(derived().stream()).expires_after(left);
+
+      auto self = derived().shared_from_this();
+      auto f = [self](auto ec, auto n)
+	 { self->on_read_body(ec, n); };
+
+      http::async_read_some(derived().stream(), buffer_, parser_, f);
+   }
+
+   void on_read_body(boost::system::error_code ec, std::size_t n)
+   {
+      body_read_ += n;
+      hasher_.update(parser_.get());
+      if (ec || parser_.is_done()) {
+	 on_read(ec, body_read_);
+	 return;
+      }
+
+      do_read_body();
+   }
+
    void on_read(boost::system::error_code ec, std::size_t n)
    {
       log::write(
@@ -62,46 +126,196 @@ private:
 	 "on_read: number of bytes read {0}.",
 	 n);
 
+      auto const* id = hasher_.finish(parser_.get());
+
       if (ec) {
-	 response_.result(http::status::bad_request);
-	 response_.set(http::field::content_type, "text/plain");
-	 response_.body() = "Invalid body size.\r\n";
-	 response_.set(http::field::content_length,
-		       beast::to_static_string(std::size(response_.body())));
+	 response_ = response {cfg_.responses.invalid_body_size};
+      } else if (auto* queue = io_queue(parser_.get(), cfg_)) {
+	 auto self = derived().shared_from_this();
+	 auto f = [self](response res)
+	    { self->on_response(std::move(res)); };
+
+	 auto const is_ssl = derived().is_ssl();
+	 auto const ex = derived().stream().get_executor();
+	 async_make_response(*queue, parser_.get(), cfg_, is_ssl, id, net::bind_executor(ex, f));
+	 return;
       } else {
 	 auto const is_ssl = derived().is_ssl();
-	 response_ = make_response(parser_, cfg_, is_ssl);
+	 response_ = make_response(parser_.get(), cfg_, is_ssl, id);
       }
 
       write_response();
    }
 
+   void on_response(response res)
+   {
+      response_ = std::move(res);
+      write_response();
+   }
+
    void write_response()
    {
+      if (response_.has_file() && !derived().can_sendfile()) {
+	 if (!response_.lease().resize(response_.file_size()))
+	    response_ = response {cfg_.responses.service_unavailable};
+	 else if (!response_.load_file())
+	    log::write(log::level::debug, "write_response: Can't read file.");
+      }
+
+      auto const bytes =
+	 std::size(parser_.get().body()) +
+	 net::buffer_size(response_.buffers()) +
+	 response_.file_size();
+
+      auto& socket = beast::get_lowest_layer(derived().stream()).socket();
+      charge_peer(cfg_.limiter, socket, bytes);
+
       auto self = derived().shared_from_this();
       auto f = [self](auto ec, auto)
-	 { self->derived().do_eof(); };
+	 { self->on_write(ec); };
 
-      http::async_write(derived().stream(), response_, f);
+      auto& stream = derived().stream();
+      auto const timeout = std::chrono::seconds(cfg_.write_timeout);
+      net::async_write(stream, response_.buffers(), restart_timeout(stream, timeout), f);
+   }
+
+   void on_write(beast::error_code ec)
+   {
+      if (!ec && response_.has_file()) {
+	 send_file();
+	 return;
+      }
+
+      derived().do_eof();
+   }
+
+   void send_file()
+   {
+      auto& socket = beast::get_lowest_layer(derived().stream()).socket();
+
+      beast::error_code ec;
+      socket.non_blocking(true, ec);
+
+      auto const status = response_.send_file(socket.native_handle());
+      if (status != response::send_status::blocked) {
+	 send_timer_.cancel();
+	 if (status == response::send_status::failed) {
+	    log::write(log::level::debug,
+	               "send_file: {0}",
+	               strerror(errno));
+	 }
+
+	 derived().do_eof();
+	 return;
+      }
+
+      send_timer_.expires_after(std::chrono::seconds(cfg_.write_timeout));
+      send_timer_.async_wait([w = derived().weak_from_this()](auto ec) {
+	 if (ec)
+	    return;
+
+	 if (auto self = w.lock())
+	    beast::get_lowest_layer(self->stream()).socket().cancel(ec);
+      });
+
+      auto self = derived().shared_from_this();
+      auto f = [self](auto ec) {
+	 if (ec) {
+	    log::write(log::level::debug, "send_file: {0}", ec.message());
+	    return;
+	 }
+
+	 self->send_file();
+      };
+
+      socket.async_wait(stream_socket::wait_write, f);
+   }
+
+protected:
+   config const& cfg() const noexcept { return cfg_; }
+
+   void expires_after(int seconds)
+   {
+      auto const d = std::chrono::seconds(seconds);
+      beast::get_lowest_layer(derived().stream()).expires_after(d);
+   }
+
+   // Continues after the TLS handshake, as HTTP/2 if ALPN selected it.
+   void on_tls_ready()
+   {
+      if (http2::is_h2_selected(derived().stream().native_handle())) {
+	 run_http2_session(std::move(derived().stream()), cfg_, std::move(buffer_));
+	 return;
+      }
+
+      do_read();
+   }
+
+   // With h2c, reads until the buffer is or can't be the HTTP/2
+   // preface and continues accordingly.
+   void detect_h2c()
+   {
+      if (!cfg_.h2c) {
+	 do_read();
+	 return;
+      }
+
+      auto const data = buffer_.data();
+      string_view const in {static_cast<char const*>(data.data()), data.size()};
+
+      switch (http2::match_preface(in)) {
+	 case http2::preface_match::complete:
+	    run_http2_session(std::move(derived().stream()), cfg_, std::move(buffer_));
+	    return;
+	 case http2::preface_match::no:
+	    do_read();
+	    return;
+	 default:
+	    break;
+      }
+
+      expires_after(cfg_.header_timeout);
+
+      auto self = derived().shared_from_this();
+      auto f = [self](auto ec, auto n) {
+	 if (ec) {
+	    log::write(log::level::debug, "detect_h2c: {0}", ec.message());
+	    return;
+	 }
+
+	 self->buffer_.commit(n);
+	 self->detect_h2c();
+      };
+
+      derived().stream().async_read_some(
+	 buffer_.prepare(std::size(http2::preface)), f);
    }
 
 public:
-   session(config const& arg, beast::flat_buffer buffer)
-   : cfg_ {arg}
-   , buffer_(std::move(buffer))
+   session(
+      config const& arg,
+      buffer_type buffer,
+      net::any_io_executor const& ex)
+   : buffer_(std::move(buffer))
+   , parser_
+     { std::piecewise_construct
+     , std::make_tuple(arena_.get_allocator())
+     , std::make_tuple(arena_.get_allocator())}
+   , response_ {arena_.get_allocator()}
+   , send_timer_ {ex}
+   , cfg_ {arg}
    { }
 
    void do_read()
    {
-      auto const n = cfg_.http_session_timeout;
-      beast::get_lowest_layer(derived().stream()).expires_after(std::chrono::seconds(n));
+      expires_after(cfg_.header_timeout);
 
       auto self = derived().shared_from_this();
       auto f = [self](auto ec, auto n)
-	 { self->on_read(ec, n); };
+	 { self->on_read_header(ec, n); };
 
       parser_.body_limit(cfg_.body_limit);
-      http::async_read(derived().stream(), buffer_, parser_, f);
+      http::async_read_header(derived().stream(), buffer_, parser_, f);
    }
 };
 
@@ -109,47 +323,48 @@ class plain_session
     : public session<plain_session>
     , public std::enable_shared_from_this<plain_session>
 {
-    beast::tcp_stream stream_;
+    plain_stream stream_;
 
 public:
     plain_session(
-       tcp::socket&& socket,
+       stream_socket&& socket,
        config const& cfg,
-       beast::flat_buffer buffer)
-    : session<plain_session>(cfg, std::move(buffer))
+       buffer_type buffer)
+    : session<plain_session>(cfg, std::move(buffer), socket.get_executor())
     , stream_(std::move(socket))
     { }
 
-    beast::tcp_stream& stream() { return stream_; }
+    plain_stream& stream() { return stream_; }
 
     void run()
     {
-       do_read();
+       detect_h2c();
     }
 
     void do_eof()
     {
         beast::error_code ec;
-        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        stream_.socket().shutdown(stream_socket::shutdown_send, ec);
     }
 
     auto is_ssl() const noexcept { return false; }
+    auto can_sendfile() const noexcept { return true; }
 };
 
 class ssl_session
     : public session<ssl_session>
     , public std::enable_shared_from_this<ssl_session>
 {
-    beast::ssl_stream<beast::tcp_stream> stream_;
+    beast::ssl_stream<plain_stream> stream_;
 
 public:
     // Create the session
     ssl_session(
-       tcp::socket&& peer,
+       stream_socket&& peer,
        ssl::context& ctx,
        config const& cfg,
-       beast::flat_buffer buffer)
-       : session<ssl_session>(cfg, std::move(buffer))
+       buffer_type buffer)
+       : session<ssl_session>(cfg, std::move(buffer), peer.get_executor())
        , stream_(std::move(peer), ctx)
     { }
 
@@ -161,8 +376,7 @@ public:
         // We need to be executing within a strand to perform async operations
         // on the I/O objects in this session.
         net::dispatch(stream_.get_executor(), [self]() {
-            beast::get_lowest_layer(
-	       self->stream_).expires_after(std::chrono::seconds(30));
+            self->expires_after(self->cfg().handshake_timeout);
 
             // Perform the SSL handshake
             // Note, this is the buffered version of the handshake.
@@ -183,12 +397,12 @@ public:
 	}
 
         buffer_.consume(bytes_used);
-        do_read();
+        on_tls_ready();
     }
 
     void do_eof()
     {
-        beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+        expires_after(cfg().shutdown_timeout);
 
         stream_.async_shutdown(
             beast::bind_front_handler(
@@ -206,6 +420,77 @@ public:
     }
 
     auto is_ssl() const noexcept { return true; }
+    auto can_sendfile() const noexcept { return false; }
+};
+
+// Like ssl_session but on a ktls_stream, files are sent with
+// sendfile(2) when the kernel took over the record encryption.
+class ktls_session
+    : public session<ktls_session>
+    , public std::enable_shared_from_this<ktls_session>
+{
+    ktls_stream stream_;
+
+public:
+    ktls_session(
+       stream_socket&& peer,
+       ssl::context& ctx,
+       config const& cfg,
+       buffer_type buffer)
+       : session<ktls_session>(cfg, std::move(buffer), peer.get_executor())
+       , stream_(std::move(peer), ctx, buffer_.data())
+    {
+        buffer_.consume(std::size(buffer_));
+    }
+
+    auto& stream() { return stream_; }
+
+    void run()
+    {
+        expires_after(cfg().handshake_timeout);
+        stream_.async_handshake(
+            beast::bind_front_handler(
+                &ktls_session::on_handshake,
+                shared_from_this()));
+    }
+
+    void on_handshake(beast::error_code ec, std::size_t)
+    {
+        if (ec) {
+	    log::write(log::level::debug,
+		       "on_handshake (ktls): {0}",
+		       ec.message());
+            return;
+	}
+
+        log::write(log::level::debug,
+                   "on_handshake (ktls): kernel TLS {0}",
+                   stream_.ktls_send() ? "enabled" : "unavailable");
+
+        on_tls_ready();
+    }
+
+    void do_eof()
+    {
+        expires_after(cfg().shutdown_timeout);
+
+        stream_.async_shutdown(
+            beast::bind_front_handler(
+                &ktls_session::on_shutdown,
+                shared_from_this()));
+    }
+
+    void on_shutdown(beast::error_code ec, std::size_t)
+    {
+        if (ec) {
+	    log::write(log::level::debug,
+		       "on_shutdown (ktls): {0}",
+		       ec.message());
+	}
+    }
+
+    auto is_ssl() const noexcept { return true; }
+    auto can_sendfile() const noexcept { return stream_.ktls_send(); }
 };
 
 }
@@ -20,66 +20,934 @@
 
 #include <iterator>
 #include <algorithm>
-#include <fstream>
+#include <charconv>
+#include <cstring>
 
-#include <boost/filesystem.hpp>
-#include <boost/gil.hpp>
-#include <boost/gil/extension/io/jpeg.hpp>
-#include <boost/gil/extension/numeric/sampler.hpp>
-#include <boost/gil/extension/numeric/resample.hpp>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #include "crypto.hpp"
 #include "logger.hpp"
+#include "image.hpp"
 #include "utils.hpp"
-
-namespace fs = boost::filesystem;
+#include "storage.hpp"
+#include "metadata.hpp"
+#include "volume_store.hpp"
 
 namespace smms {
 
-beast::string_view
-config::get_cache_control(beast::string_view path) const noexcept
+namespace {
+
+void add_field(std::string& out, http::field f, string_view value)
+{
+   auto const name = http::to_string(f);
+   out.append(name.data(), std::size(name));
+   out += ": ";
+   out.append(value.data(), std::size(value));
+   out += "\r\n";
+}
+
+void add_status(std::string& out, http::status s)
+{
+   auto const reason = http::obsolete_reason(s);
+   out += "HTTP/1.1 ";
+   out += std::to_string(static_cast<unsigned>(s));
+   out += " ";
+   out.append(reason.data(), std::size(reason));
+   out += "\r\n";
+}
+
+std::string make_text_response(http::status s, string_view body)
+{
+   std::string ret;
+   add_status(ret, s);
+   add_field(ret, http::field::content_type, mime_type(".txt"));
+   add_field(ret, http::field::content_length, std::to_string(std::size(body)));
+   ret += "\r\n";
+   ret.append(body.data(), std::size(body));
+   return ret;
+}
+
+// The object stored in the volumes for the name, i.e. the target
+// without a root.
+std::optional<volume_store::object>
+find_object(config const& cfg, string_view name)
+{
+   if (!cfg.volumes)
+      return {};
+
+   return cfg.volumes->find(name);
+}
+
+// The coding of a compressed sibling by its suffix, e.g. br for
+// name.br, identity for other names.
+content_coding sibling_coding(string_view name) noexcept
+{
+   using c = content_coding;
+   for (auto coding : {c::gzip, c::br, c::zstd}) {
+      if (name.ends_with(coding_suffix(coding)))
+	 return coding;
+   }
+
+   return c::identity;
+}
+
+// A file and its compressed siblings are placed by the name of the
+// file, so that they are on the same root.
+string_view placement_name(string_view name) noexcept
+{
+   name.remove_suffix(std::size(coding_suffix(sibling_coding(name))));
+   return name;
+}
+
+// The root that holds the name, in the rank-th place, see root_set.
+string_view root_of(config const& cfg, string_view name, std::size_t rank = 0)
+{
+   if (!cfg.roots)
+      return cfg.doc_root;
+
+   return cfg.roots->path(cfg.roots->place(placement_name(name), rank));
+}
+
+// Opens the file of the name under its root. Files placed on a root
+// that was added later may still be on their previous root, the other
+// roots are tried in the order of placement.
+unique_fd
+open_stored(
+   config const& cfg,
+   string_view root,
+   std::pmr::string const& path,
+   std::size_t& size)
+{
+   auto fd = open_file(path.c_str(), size);
+   if (fd || !cfg.roots)
+      return fd;
+
+   auto const name = string_view {path}.substr(std::size(root));
+   std::pmr::string other {path.get_allocator()};
+   for (std::size_t rank = 1; !fd && rank < cfg.roots->size(); ++rank) {
+      auto const root = root_of(cfg, name, rank);
+      other.assign(root.data(), std::size(root));
+      other.append(name.data(), std::size(name));
+      fd = open_file(other.c_str(), size);
+   }
+
+   return fd;
+}
+
+// The file of the content under root/.content/.
+std::pmr::string
+content_path(
+   string_view root,
+   content_id const& id,
+   allocator_type const& alloc)
+{
+   auto const hex = blake2b::to_hex(id);
+
+   std::pmr::string ret {alloc};
+   ret.append(root.data(), std::size(root));
+   ret += "/.content/";
+   ret.append(hex, 0, 2);
+   ret += "/";
+   ret.append(hex, 2);
+   return ret;
+}
+
+// The content file of the link at path if the link is the last one to
+// it, otherwise empty. The content is found by hashing the link.
+std::pmr::string
+last_link_content(string_view root, std::pmr::string const& path)
+{
+   auto const alloc = path.get_allocator();
+   struct stat st;
+   if (::lstat(path.c_str(), &st) != 0 || st.st_nlink != 2)
+      return std::pmr::string {alloc};
+
+   std::pmr::string body {alloc};
+   if (!read_file(path.c_str(), body))
+      return std::pmr::string {alloc};
+
+   auto file = content_path(root, blake2b::hash({body.data(), std::size(body)}), alloc);
+   struct stat content;
+   if (::stat(file.c_str(), &content) != 0 ||
+       content.st_dev != st.st_dev ||
+       content.st_ino != st.st_ino)
+      file.clear();
+
+   return file;
+}
+
+// Removes the content file if no target links to it anymore.
+void drop_content(std::pmr::string const& file)
+{
+   struct stat st;
+   if (!std::empty(file) && ::stat(file.c_str(), &st) == 0 && st.st_nlink == 1)
+      ::unlink(file.c_str());
+}
+
+// Stores the content once under its id, in the volumes or in a file
+// under root/.content/ that the targets are hard linked to. Content the
+// target linked to before is dropped when nothing else links to it.
+bool
+store_content(
+   config const& cfg,
+   string_view root,
+   string_view target,
+   std::pmr::string const& path,
+   string_view body,
+   content_id const& id)
+{
+   if (cfg.volumes)
+      return cfg.volumes->put(target, body, &id);
+
+   auto const file = content_path(root, id, path.get_allocator());
+   auto const old = last_link_content(root, path);
+
+   // Written again if an overwrite or removal dropped it meanwhile.
+   for (auto i = 0; i < 2; ++i) {
+      if (!file_exists(file.c_str())) {
+	 create_dir(file.substr(0, file.rfind('/')).c_str());
+	 if (!write_file(file.c_str(), body))
+	    return false;
+      }
+
+      if (link_file(file.c_str(), path.c_str())) {
+	 drop_content(old);
+	 return true;
+      }
+   }
+
+   return false;
+}
+
+// The name of the metadata of the object in the volumes. Targets have
+// no query, so it is not the name of another object.
+std::pmr::string meta_name(string_view name, allocator_type const& alloc)
+{
+   std::pmr::string ret {name.data(), std::size(name), alloc};
+   ret += "?meta";
+   return ret;
+}
+
+// Where the metadata of the file with the name and path is kept when
+// deduplicating. The targets of the same content share the inode of
+// their file, so it isn't kept in its attributes then but under .meta
+// in the root.
+std::pmr::string
+meta_path(string_view name, std::pmr::string const& path)
+{
+   std::pmr::string ret {path, path.get_allocator()};
+   ret.insert(std::size(path) - std::size(name), "/.meta");
+   return ret;
+}
+
+// The metadata of the object with the name and path, kept in the
+// volumes, in a file of its own or in an attribute of the file.
+std::optional<object_meta>
+load_meta(config const& cfg, string_view name, std::pmr::string const& path)
 {
-   auto ext = make_extension(path);
+   if (auto const o = find_object(cfg, meta_name(name, path.get_allocator()))) {
+      meta_bytes buffer;
+      if (o->size != std::size(buffer))
+	 return {};
+
+      auto const n = ::pread(o->fd, buffer.data(), std::size(buffer), o->offset);
+      if (n != static_cast<ssize_t>(std::size(buffer)))
+	 return {};
 
-   auto f = [&](beast::string_view const& mime)
-     { return beast::iequals(ext, mime); };
+      return parse_meta({buffer.data(), std::size(buffer)});
+   }
 
-   auto match =
-     std::find_if(std::cbegin(local_cache_control_mime),
-		  std::cend(local_cache_control_mime),
-		  f);
+   if (cfg.dedup && !cfg.volumes) {
+      std::pmr::string buffer {path.get_allocator()};
+      if (!read_file(meta_path(name, path).c_str(), buffer))
+	 return {};
 
-   if (match == std::end(local_cache_control_mime))
-     return default_cache_control;
+      return parse_meta({buffer.data(), std::size(buffer)});
+   }
 
-   auto d = std::distance(std::cbegin(local_cache_control_mime), match);
-   return local_cache_control_value[d];
+   return read_meta(path.c_str());
 }
 
-http::response<http::string_body>
+bool
+store_meta(
+   config const& cfg,
+   string_view name,
+   std::pmr::string const& path,
+   object_meta const& meta)
+{
+   if (!cfg.volumes && !cfg.dedup)
+      return write_meta(path.c_str(), meta);
+
+   auto const bytes = serialize(meta);
+   if (!cfg.volumes) {
+      auto const file = meta_path(name, path);
+      create_dir(file.substr(0, file.rfind('/')).c_str());
+      return write_file(file.c_str(), {bytes.data(), std::size(bytes)});
+   }
+
+   auto const stored = meta_name(name, path.get_allocator());
+   return cfg.volumes->put(stored, {bytes.data(), std::size(bytes)});
+}
+
+// Whether the upload_pipeline writes the compressed siblings of the
+// upload, see compression_stage.
+bool compresses_upload(config const& cfg, string_view name) noexcept
+{
+   return cfg.pipeline
+       && !std::empty(cfg.upload_codings)
+       && sibling_coding(name) == content_coding::identity
+       && cfg.types.classify(name).gzip;
+}
+
+// Keeps the metadata of an upload. A compressed sibling, e.g. name.gz,
+// is recorded in the metadata of the object it belongs to.
+void
+record_meta(
+   config const& cfg,
+   string_view name,
+   std::pmr::string const& path,
+   string_view body,
+   content_id const& id)
+{
+   auto const alloc = path.get_allocator();
+   auto meta = make_meta(body, id);
+
+   // As the file says, e.g. for the compression_cache. Linked files
+   // say when their content was first stored.
+   struct stat st;
+   if (!cfg.volumes && !cfg.dedup && ::stat(path.c_str(), &st) == 0)
+      meta.mtime = st.st_mtime;
+
+   auto const coding = sibling_coding(name);
+   if (coding != content_coding::identity) {
+      auto const n = std::size(coding_suffix(coding));
+      auto const plain_name = name.substr(0, std::size(name) - n);
+      std::pmr::string plain {path, alloc};
+      plain.resize(std::size(path) - n);
+      if (auto m = load_meta(cfg, plain_name, plain)) {
+	 m->encodings |= encoding::bit(coding);
+	 store_meta(cfg, plain_name, plain, *m);
+      }
+   } else {
+      using c = content_coding;
+      auto const rewritten = compresses_upload(cfg, name);
+      for (auto other : {c::gzip, c::br, c::zstd}) {
+	 // Left out until the pipeline replaced them, they belong to
+	 // the previous content.
+	 if (rewritten && std::ranges::count(cfg.upload_codings, other) != 0)
+	    continue;
+
+	 auto const suffix = coding_suffix(other);
+	 std::pmr::string sibling_name {name.data(), std::size(name), alloc};
+	 sibling_name.append(suffix.data(), std::size(suffix));
+	 std::pmr::string sibling {path, alloc};
+	 sibling.append(suffix.data(), std::size(suffix));
+	 if (find_object(cfg, sibling_name) || file_exists(sibling.c_str()))
+	    meta.encodings |= encoding::bit(other);
+      }
+   }
+
+   // GETs do without it, only slower.
+   if (!store_meta(cfg, name, path, meta))
+      log::write(log::level::info, "make_post_response: Can't store metadata.");
+}
+
+// Writes the body under the name as configured, the path is where it
+// goes. The metadata is recorded apart, see record_meta.
+bool
+write_object(
+   config const& cfg,
+   string_view name,
+   string_view body,
+   content_id const& digest,
+   std::pmr::string& path)
+{
+   auto const alloc = path.get_allocator();
+   auto const root = root_of(cfg, name);
+   path.append(root.data(), std::size(root));
+   path.append(name.data(), std::size(name));
+
+   if (!cfg.volumes) {
+      // Content is stored elsewhere but the link is made here.
+      std::pmr::string full_dir {alloc};
+      full_dir.append(root.data(), std::size(root));
+      full_dir += "/";
+      auto const dir = parse_dir(name);
+      full_dir.append(dir.data(), std::size(dir));
+
+      create_dir(full_dir.data());
+   }
+
+   log::write(
+      log::level::debug,
+      "make_post_response: target: {0}",
+      path);
+
+   if (cfg.dedup)
+      return store_content(cfg, root, name, path, body, digest);
+
+   if (cfg.volumes)
+      return cfg.volumes->put(name, body);
+
+   return write_file(path.c_str(), body);
+}
+
+// Removes the object and its metadata.
+void remove_object(config const& cfg, string_view name, std::pmr::string const& path)
+{
+   if (!cfg.volumes) {
+      if (!cfg.dedup) {
+	 ::unlink(path.c_str());
+	 return;
+      }
+
+      auto const content = last_link_content(root_of(cfg, name), path);
+      ::unlink(path.c_str());
+      ::unlink(meta_path(name, path).c_str());
+      drop_content(content);
+      return;
+   }
+
+   cfg.volumes->remove(name);
+   cfg.volumes->remove(meta_name(name, path.get_allocator()));
+}
+
+// Removes what the upload_pipeline derived from the previous content
+// of the name, i.e. its thumbnails and the compressed siblings that
+// are left out of its metadata, see record_meta. Thumbnails are
+// removed even if no pipeline makes them anymore.
+void
+remove_derived(
+   config const& cfg,
+   string_view name,
+   std::pmr::string const& path)
+{
+   auto const alloc = path.get_allocator();
+   if (compresses_upload(cfg, name)) {
+      for (auto c : cfg.upload_codings) {
+	 auto const suffix = coding_suffix(c);
+	 std::pmr::string sibling_name {name.data(), std::size(name), alloc};
+	 sibling_name.append(suffix.data(), std::size(suffix));
+	 std::pmr::string sibling {path, alloc};
+	 sibling.append(suffix.data(), std::size(suffix));
+	 remove_object(cfg, sibling_name, sibling);
+      }
+   }
+
+   auto const* rule = find_thumbnail_rule(cfg.thumbnails, name);
+   if (!rule)
+      return;
+
+   auto const remove = [&](std::pmr::string const& thumb) {
+      auto const root = root_of(cfg, thumb);
+      std::pmr::string thumb_path {alloc};
+      thumb_path.append(root.data(), std::size(root));
+      thumb_path += thumb;
+      remove_object(cfg, thumb, thumb_path);
+   };
+
+   auto const webp = image_extension(image_format::webp);
+   for (auto const& size : rule->sizes) {
+      auto thumb = thumbnail_name(name, size, alloc);
+      remove(thumb);
+      thumb.append(webp.data(), std::size(webp));
+      remove(thumb);
+   }
+}
+
+// Stores the body of an upload under the name as configured. The id
+// is computed if not given.
+bool
+store_upload(
+   config const& cfg,
+   string_view name,
+   string_view body,
+   content_id const* id,
+   allocator_type const& alloc)
+{
+   std::string_view const in {body.data(), std::size(body)};
+   auto const digest = id ? *id : blake2b::hash(in);
+
+   std::pmr::string path {alloc};
+   if (!write_object(cfg, name, body, digest, path))
+      return false;
+
+   // Jobs of the previous content that write after this see that the
+   // target changed, see store_derived.
+   record_meta(cfg, name, path, body, digest);
+   remove_derived(cfg, name, path);
+   return true;
+}
+
+// Whether the target of the upload still holds its body.
+bool is_current(config const& cfg, upload_pipeline::upload const& u)
+{
+   auto const root = root_of(cfg, u.target);
+   std::pmr::string path;
+   path.append(root.data(), std::size(root));
+   path.append(u.target);
+
+   auto const meta = load_meta(cfg, u.target, path);
+   return meta && std::equal(
+      std::cbegin(meta->checksum),
+      std::cend(meta->checksum),
+      std::cbegin(u.id));
+}
+
+// Stores an object derived from the upload, e.g. a compressed sibling.
+// It is dropped when the target was overwritten before or while it is
+// written, it belongs to the previous content then.
+void
+store_derived(
+   config const& cfg,
+   upload_pipeline::upload const& u,
+   string_view name,
+   string_view body,
+   char const* stage)
+{
+   if (!is_current(cfg, u)) {
+      log::write(log::level::debug, "{0}: {1} changed.", stage, u.target);
+      return;
+   }
+
+   std::string_view const in {body.data(), std::size(body)};
+   auto const digest = blake2b::hash(in);
+
+   std::pmr::string path;
+   if (!write_object(cfg, name, body, digest, path)) {
+      log::write(log::level::info, "{0}: Can't write {1}.", stage, name);
+      return;
+   }
+
+   if (!is_current(cfg, u)) {
+      log::write(log::level::debug, "{0}: {1} changed.", stage, u.target);
+      remove_object(cfg, name, path);
+      return;
+   }
+
+   record_meta(cfg, name, path, body, digest);
+}
+
+// The size of the object, found without opening it.
+std::optional<std::uint64_t>
+stored_size(config const& cfg, string_view name, std::pmr::string const& path)
+{
+   if (auto const o = find_object(cfg, name))
+      return o->size;
+
+   struct stat st;
+   if (::stat(path.c_str(), &st) == -1)
+      return {};
+
+   return st.st_size;
+}
+
+// The thumbnail of the name made on upload, if the size is one of
+// those of its thumbnail_rule, see thumbnail_stage. Its WebP variant
+// is preferred when webp is set.
+std::optional<response>
+find_thumbnail(
+   config const& cfg,
+   string_view name,
+   image_size size,
+   file_type const& type,
+   bool webp,
+   allocator_type const& alloc)
+{
+   auto const* rule = find_thumbnail_rule(cfg.thumbnails, name);
+   if (!rule)
+      return {};
+
+   auto const configured = std::ranges::any_of(rule->sizes, [&](auto const& s)
+      { return s.width == size.width && s.height == size.height; });
+
+   if (!configured)
+      return {};
+
+   auto const open = [&](string_view stored, file_type const& t) -> std::optional<response> {
+      auto const& head = cfg.responses.get_header(t, content_coding::identity);
+      if (auto const o = find_object(cfg, stored))
+	 return response {head, o->fd, o->offset, o->size, alloc};
+
+      auto const root = root_of(cfg, stored);
+      std::pmr::string path {alloc};
+      path.append(root.data(), std::size(root));
+      path.append(stored.data(), std::size(stored));
+
+      std::size_t file_size = 0;
+      auto file = open_stored(cfg, root, path, file_size);
+      if (!file)
+	 return {};
+
+      return response {head, std::move(file), file_size, alloc};
+   };
+
+   auto const thumb = thumbnail_name(name, size, alloc);
+   if (webp) {
+      auto const ext = image_extension(image_format::webp);
+      std::pmr::string variant {thumb, alloc};
+      variant.append(ext.data(), std::size(ext));
+      if (auto res = open(variant, cfg.types.classify(ext)))
+	 return res;
+   }
+
+   return open(thumb, type);
+}
+
+// Whether the validators sent by the client match, see RFC 9110,
+// 13.2.2. Dates are compared as strings like nginx does, clients send
+// back the Last-Modified they got.
+bool
+not_modified(
+   request_type const& req,
+   string_view etag,
+   string_view last_modified)
+{
+   auto const inm = req.find(http::field::if_none_match);
+   if (inm != std::end(req))
+      return inm->value() == "*" || inm->value().find(etag) != string_view::npos;
+
+   auto const ims = req.find(http::field::if_modified_since);
+   return ims != std::end(req) && ims->value() == last_modified;
+}
+
+}
+
+void response::set_length(std::size_t n) noexcept
+{
+   auto const r =
+      std::to_chars(length_.data(), length_.data() + std::size(length_), n);
+
+   std::memcpy(r.ptr, "\r\n\r\n", 4);
+   length_size_ = r.ptr + 4 - length_.data();
+}
+
+response::response(string_view head, std::size_t length) noexcept
+: head_ {head}
+{
+   set_length(length);
+}
+
+response::response(string_view head, std::pmr::string body)
+: head_ {head}
+, body_ {std::move(body)}
+{
+   set_length(std::size(body_));
+}
+
+response::response(
+   string_view head,
+   std::pmr::string body,
+   budget_lease lease)
+: response {head, std::move(body)}
+{
+   lease_ = std::move(lease);
+}
+
+response::response(
+   string_view head,
+   std::shared_ptr<std::string const> body) noexcept
+: head_ {head}
+, shared_body_ {std::move(body)}
+{
+   set_length(std::size(*shared_body_));
+}
+
+response::response(
+   string_view head,
+   unique_fd file,
+   std::size_t size,
+   allocator_type const& alloc)
+: head_ {head}
+, body_ {alloc}
+, file_ {std::move(file)}
+, fd_ {file_.get()}
+, file_size_ {size}
+{
+   set_length(size);
+}
+
+response::response(
+   string_view head,
+   int fd,
+   std::size_t offset,
+   std::size_t size,
+   allocator_type const& alloc)
+: head_ {head}
+, body_ {alloc}
+, fd_ {fd}
+, file_begin_ {offset}
+, file_size_ {size}
+{
+   set_length(size);
+}
+
+bool response::add_fields(string_view fields) noexcept
+{
+   auto const n = std::size(fields);
+   if (length_size_ == 0 || length_size_ + n > std::size(length_))
+      return false;
+
+   // Before the empty line that ends the header.
+   auto* const p = length_.data() + length_size_ - 2;
+   std::memcpy(p, fields.data(), n);
+   std::memcpy(p + n, "\r\n", 2);
+   length_size_ += n;
+   return true;
+}
+
+void response::omit_body() noexcept
+{
+   // Canned responses have the body in the head.
+   if (length_size_ == 0) {
+      auto const end = head_.find("\r\n\r\n");
+      if (end != string_view::npos)
+	 head_ = head_.substr(0, end + 4);
+   }
+
+   body_.clear();
+   shared_body_.reset();
+   file_ = unique_fd {};
+   fd_ = -1;
+   lease_ = budget_lease {};
+}
+
+bool response::load_file()
+{
+   auto const ok = smms::read_file(fd_, file_size_, body_, file_begin_);
+   file_ = unique_fd {};
+   fd_ = -1;
+   return ok;
+}
+
+bool
+response::read_file(std::size_t offset, char* out, std::size_t n) const noexcept
+{
+   while (n != 0) {
+      auto const r = pread(fd_, out, n, file_begin_ + offset);
+      if (r == -1 && errno == EINTR)
+	 continue;
+
+      if (r <= 0)
+	 return false;
+
+      out += r;
+      offset += r;
+      n -= r;
+   }
+
+   return true;
+}
+
+response::send_status response::send_file(int socket) noexcept
+{
+   while (file_offset_ < file_size_) {
+      auto offset = static_cast<off_t>(file_begin_ + file_offset_);
+      auto const r =
+	 sendfile(socket, fd_, &offset, file_size_ - file_offset_);
+
+      if (r == -1 && errno == EINTR)
+	 continue;
+
+      if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	 return send_status::blocked;
+
+      // Zero means the file was truncated meanwhile.
+      if (r <= 0)
+	 return send_status::failed;
+
+      file_offset_ += r;
+   }
+
+   file_ = unique_fd {};
+   fd_ = -1;
+   return send_status::done;
+}
+
+std::array<net::const_buffer, 5> response::buffers() const noexcept
+{
+   return
+   { net::buffer(head_.data(), std::size(head_))
+   , net::buffer(length_.data(), length_size_)
+   , net::buffer(location_.data(), std::size(location_))
+   , net::buffer(tail_.data(), std::size(tail_))
+   , net::buffer(body().data(), std::size(body()))
+   };
+}
+
+void config::make_responses()
+{
+   using s = http::status;
+
+   responses = {};
+   responses.bad_request = make_text_response(s::bad_request, "");
+   responses.invalid_body_size = make_text_response(s::bad_request, "Invalid body size.\r\n");
+   responses.empty_hmac = make_text_response(s::bad_request, "hmacsha256 is empty.\r\n");
+   responses.invalid_hmac = make_text_response(s::bad_request, "Invalid hmacsha256.\r\n");
+   responses.invalid_signature = make_text_response(s::bad_request, "Invalid signature.\r\n");
+   responses.write_error = make_text_response(s::bad_request, "Error\r\n");
+   responses.invalid_size = make_text_response(s::bad_request, "Invalid size.\r\n");
+   responses.invalid_query = make_text_response(s::bad_request, "Invalid query.\r\n");
+   responses.not_found = make_text_response(s::not_found, "File not found.\r\n");
+
+   std::string const busy = "Service unavailable.\r\n";
+   auto& unavailable = responses.service_unavailable;
+   add_status(unavailable, s::service_unavailable);
+   add_field(unavailable, http::field::retry_after, std::to_string(retry_after));
+   add_field(unavailable, http::field::content_type, mime_type(".txt"));
+   add_field(unavailable, http::field::content_length, std::to_string(std::size(busy)));
+   unavailable += "\r\n";
+   unavailable += busy;
+
+   std::string const slow_down = "Too many requests.\r\n";
+   auto& too_many = responses.too_many_requests;
+   add_status(too_many, s::too_many_requests);
+   add_field(too_many, http::field::retry_after, std::to_string(retry_after));
+   add_field(too_many, http::field::content_type, mime_type(".txt"));
+   add_field(too_many, http::field::content_length, std::to_string(std::size(slow_down)));
+   too_many += "\r\n";
+   too_many += slow_down;
+
+   auto& post_ok = responses.post_ok;
+   add_status(post_ok, s::ok);
+   if (!std::empty(server_name))
+      add_field(post_ok, http::field::server, server_name);
+   add_field(post_ok, http::field::access_control_allow_origin, allow_origin);
+   add_field(post_ok, http::field::content_length, "0");
+   post_ok += "\r\n";
+
+   auto& redirect_head = responses.redirect_head;
+   add_status(redirect_head, s::moved_permanently);
+   redirect_head += "Location: ";
+   redirect_head += redirect_url;
+
+   auto& redirect_tail = responses.redirect_tail;
+   redirect_tail += "\r\n";
+   add_field(redirect_tail, http::field::content_length, "0");
+   add_field(redirect_tail, http::field::access_control_allow_origin, allow_origin);
+   redirect_tail += "\r\n";
+
+   for (std::size_t id = 0; id < std::size(types); ++id) {
+      auto const type = types.at(id);
+      for (std::size_t c = 0; c < content_coding_count; ++c) {
+	 auto const coding = static_cast<content_coding>(c);
+	 std::string h;
+	 add_status(h, s::ok);
+	 if (!std::empty(server_name))
+	    add_field(h, http::field::server, server_name);
+	 add_field(h, http::field::content_type, type.mime);
+	 add_field(h, http::field::access_control_allow_origin, allow_origin);
+	 if (type.gzip)
+	    add_field(h, http::field::vary, "Accept-Encoding");
+	 if (coding != content_coding::identity)
+	    add_field(h, http::field::content_encoding, coding_name(coding));
+	 if (set_cache_control())
+	    add_field(h, http::field::cache_control, type.cache_control);
+	 h += "Content-Length: ";
+	 responses.get_headers.push_back(std::move(h));
+      }
+
+      std::string h;
+      add_status(h, s::not_modified);
+      if (!std::empty(server_name))
+	 add_field(h, http::field::server, server_name);
+      add_field(h, http::field::access_control_allow_origin, allow_origin);
+      if (type.gzip)
+	 add_field(h, http::field::vary, "Accept-Encoding");
+      if (set_cache_control())
+	 add_field(h, http::field::cache_control, type.cache_control);
+      h += "Content-Length: ";
+      responses.not_modified_headers.push_back(std::move(h));
+   }
+}
+
+void config::make_host_set()
+{
+   hosts = host_set {host_names};
+}
+
+std::chrono::steady_clock::duration
+config::body_time_left(
+   std::uint64_t n,
+   std::chrono::steady_clock::duration elapsed) const noexcept
+{
+   using namespace std::chrono;
+
+   if (min_body_rate == 0)
+      return seconds(http_session_timeout) - elapsed;
+
+   duration<double> const allowed
+      {header_timeout + static_cast<double>(n) / min_body_rate};
+
+   return duration_cast<steady_clock::duration>(allowed) - elapsed;
+}
+
+void config::make_file_types()
+{
+   types = {};
+   types.set_default_cache_control(default_cache_control);
+
+   for (std::size_t i = 0; i < std::size(mime_type_extension); ++i)
+      types.set_mime(mime_type_extension[i], mime_type_value[i]);
+
+   for (auto const& ext : gzip_mimes)
+      types.set_gzip(ext);
+
+   for (std::size_t i = 0; i < std::size(local_cache_control_mime); ++i)
+      types.set_cache_control(local_cache_control_mime[i],
+                              local_cache_control_value[i]);
+}
+
+void body_hasher::start(request_type const& req, config const& cfg)
+{
+   if (cfg.dedup && req.method() == http::verb::post)
+      hasher_.emplace();
+}
+
+void body_hasher::update(request_type const& req) noexcept
+{
+   if (!hasher_)
+      return;
+
+   std::string_view const body {req.body()};
+   hasher_->update(body.substr(hashed_));
+   hashed_ = std::size(body);
+}
+
+content_id const* body_hasher::finish(request_type const& req) noexcept
+{
+   if (!hasher_)
+      return nullptr;
+
+   update(req);
+   digest_ = hasher_->digest();
+   hasher_.reset();
+   return &digest_;
+}
+
+response
 make_post_response(
    beast::string_view raw_target,
-   http::request_parser<http::string_body> const& parser,
-   config const& cfg)
+   request_type const& req,
+   config const& cfg,
+   content_id const* id)
 {
-   http::response<http::string_body> response;
+   auto const alloc = req.body().get_allocator();
 
-   std::string path;
    auto const target_query = split_from_query(raw_target);
    auto const target = target_query.first;
    auto const query = target_query.second;
-   auto const queries = parse_query({query.data(), std::size(query)});
-   
-   auto const expected_hex_auth = get_field_value(queries, "hmac");
-
-   if (expected_hex_auth.empty()) {
-      response.result(http::status::bad_request);
-      response.set(http::field::content_type, "text/plain");
-      response.body() = "hmacsha256 is empty.\r\n";
-      response.set(http::field::content_length,
-		    beast::to_static_string(std::size(response.body())));
-      return response;
-   }
+   query_view const queries {query};
+
+   std::string hmac_buffer;
+   auto const expected_hex_auth =
+      percent_decode(get_field_value(queries, "hmac"), hmac_buffer);
+
+   if (expected_hex_auth.empty())
+      return response {cfg.responses.empty_hmac};
 
    hmacsha256::auth_type expected_auth = {{0}};
 
@@ -93,85 +961,138 @@ make_post_response(
 	 nullptr,
 	 nullptr);
 
-   if (r == -1) {
-      response.result(http::status::bad_request);
-      response.set(http::field::content_type, "text/plain");
-      response.body() = "Invalid hmacsha256.\r\n";
-      response.set(http::field::content_length,
-		    beast::to_static_string(std::size(response.body())));
-      return response;
-   }
+   if (r == -1)
+      return response {cfg.responses.invalid_hmac};
 
-   auto const in = std::string{target.data(), std::size(target)};
+   std::string_view const in {target.data(), std::size(target)};
    auto const auth = hmacsha256::make_auth(in, cfg.key);
 
    // Before posting we check if the digest and the rest of the
    // target have been produced by the same key.
-   if (auth == expected_auth) {
-      path = cfg.doc_root;
-      path.append(target.data(), std::size(target));
-
-      std::string full_dir;
-      full_dir += cfg.doc_root;
-      full_dir += "/";
-      full_dir += parse_dir({target.data(), std::size(target)});
-
-      create_dir(full_dir.data());
-   }
-
-   log::write(
-      log::level::debug,
-      "make_post_response: target: {0}",
-      path);
-
-   if (std::empty(path)) {
-      response.result(http::status::bad_request);
-      response.set(http::field::content_type, "text/plain");
-      response.body() = "Invalid signature.\r\n";
-      response.set(http::field::content_length,
-		    beast::to_static_string(std::size(response.body())));
-      return response;
-   }
+   if (auth != expected_auth)
+      return response {cfg.responses.invalid_signature};
 
    log::write(
       log::level::debug,
       "make_post_response: body size: {0}.",
-      std::size(parser.get().body()));
+      std::size(req.body()));
+
+   string_view const stored {target.data(), std::size(target)};
+   string_view const body {req.body().data(), std::size(req.body())};
+   auto const digest =
+      id ? *id : blake2b::hash({req.body().data(), std::size(req.body())});
 
-   std::ofstream ofs(path, std::ios::binary);
-   if (!ofs) {
+   if (!store_upload(cfg, stored, body, &digest, alloc)) {
       log::write(
 	 log::level::info,
-	 "make_post_response: Can't open file for writing.");
-
-      response.result(http::status::bad_request);
-      response.set(http::field::content_type, "text/plain");
-      response.body() = "Error\r\n";
-      response.set(http::field::content_length,
-		beast::to_static_string(std::size(response.body())));
-      return response;
+	 "make_post_response: Can't write file.");
+
+      return response {cfg.responses.write_error};
    }
 
-   ofs << parser.get().body();
+   if (cfg.pipeline)
+      cfg.pipeline->post(stored, body, digest);
+
+   return response {cfg.responses.post_ok};
+}
+
+upload_pipeline::stage compression_stage(config const& cfg)
+{
+   auto accepts = [&cfg](string_view target)
+      { return compresses_upload(cfg, target); };
+
+   auto process = [&cfg](upload_pipeline::upload const& u) {
+      string_view const body {u.body.data(), std::size(u.body)};
+      std::string out;
+      for (auto c : cfg.upload_codings) {
+	 // Also written when it doesn't shrink, a sibling of the
+	 // previous content would be served otherwise.
+	 if (!compress(c, body, out, static_level(c)))
+	    continue;
+
+	 auto name = u.target;
+	 auto const suffix = coding_suffix(c);
+	 name.append(suffix.data(), std::size(suffix));
+	 store_derived(cfg, u, name, out, "compression_stage");
+      }
+   };
+
+   return {accepts, process};
+}
+
+upload_pipeline::stage thumbnail_stage(config const& cfg)
+{
+   auto accepts = [&cfg](string_view target) {
+      auto const mime = cfg.types.classify(target).mime;
+      return (mime == "image/jpeg" || mime == "image/png")
+	  && find_thumbnail_rule(cfg.thumbnails, target);
+   };
+
+   auto process = [&cfg](upload_pipeline::upload const& u) {
+      string_view const body {u.body.data(), std::size(u.body)};
+
+      // Known by its extension only.
+      object_meta meta;
+      detect_image(body, meta);
+      if (meta.format != image_format::jpeg && meta.format != image_format::png)
+	 return;
+
+      // As a GET that resizes it without further parameters makes it,
+      // followed by the variant for clients that accept WebP. The
+      // image is decoded once for all of them.
+      transform t;
+      t.quality = cfg.image_quality;
+      auto const format = cfg.types.classify(u.target).mime == "image/png"
+	 ? image_format::png
+	 : image_format::jpeg;
+
+      auto const* rule = find_thumbnail_rule(cfg.thumbnails, u.target);
+      auto const webp = image_extension(image_format::webp);
+      std::vector<transform> transforms;
+      std::vector<std::pmr::string> names;
+      for (auto const& size : rule->sizes) {
+	 t.size = size;
+	 t.format = format;
+	 transforms.push_back(t);
+	 names.push_back(thumbnail_name(u.target, size, {}));
+
+	 if (!cfg.image_webp)
+	    continue;
+
+	 t.format = image_format::webp;
+	 transforms.push_back(t);
+	 names.push_back(names.back());
+	 names.back().append(webp.data(), std::size(webp));
+      }
+
+      budget_lease lease;
+      std::vector<std::pmr::string> out(std::size(transforms));
+      auto const status = transform_image(
+	 body,
+	 meta.format,
+	 transforms,
+	 cfg.image_limits.max_source_pixels,
+	 lease,
+	 out);
+
+      if (status != transform_status::ok) {
+	 log::write(log::level::info, "thumbnail_stage: Can't transform {0}.", u.target);
+	 return;
+      }
 
-   response.result(http::status::ok);
-   response.set(http::field::server, cfg.server_name);
-   response.set(http::field::access_control_allow_origin,
-	     cfg.allow_origin);
+      for (std::size_t i = 0; i < std::size(out); ++i)
+	 store_derived(cfg, u, names[i], out[i], "thumbnail_stage");
+   };
 
-   response.set(http::field::content_length,
-	     beast::to_static_string(std::size(response.body())));
-   return response;
+   return {accepts, process};
 }
 
-http::response<http::string_body>
+response
 make_get_response(
    beast::string_view raw_target,
-   http::request_parser<http::string_body> const& parser,
+   request_type const& req,
    config const& cfg)
 {
-   http::response<http::string_body> response;
-
    log::write(
       log::level::debug,
       "get_handler: target: {0}",
@@ -181,30 +1102,47 @@ make_get_response(
    auto const target = target_query.first;
    assert(!std::empty(target));
 
-   auto path = cfg.doc_root;
+   auto const alloc = req.body().get_allocator();
+
+   std::pmr::string path {alloc};
    path.append(target.data(), std::size(target));
    if (std::size(target) == 1)
       path += cfg.default_file;
 
-   auto final_path = path;
-   auto gzip = false;
-   if (has_mime(path, cfg.gzip_mimes)) {
-     // We must be able to server this mime type with
-     // pre-compressed files. That means we have to add a ".gz" to
-     // the path but only if the client accepts that encoding. If
-     // it doesn't we do not change the filename.
-     auto const match =
-	parser.get().find(http::field::accept_encoding);
-
-     if (match != std::end(parser.get())) {
-	if (match->value().find("gzip") != std::string::npos) {
-	  // check whether gzip version exists.
-	  if (fs::exists(fs::path(final_path + ".gz"))) {
-	    final_path += ".gz";
-	    gzip = true;
-	  }
-	}
-     }
+   auto const root = root_of(cfg, path);
+   path.insert(0, root.data(), std::size(root));
+
+   // The target as stored, i.e. without the root.
+   auto const name = [&](std::pmr::string const& p)
+      { return string_view {p}.substr(std::size(root)); };
+
+   auto const type = cfg.types.classify(path);
+   auto const meta = load_meta(cfg, name(path), path);
+
+   std::pmr::string final_path {path, alloc};
+   auto coding = content_coding::identity;
+   std::optional<std::uint64_t> coded_size;
+   coding_preference preference;
+   if (type.gzip) {
+      // Served from a compressed sibling, e.g. path.br, in the coding
+      // the client prefers most of those there are. They are looked
+      // for even if the metadata doesn't know them, siblings may be
+      // added by hand.
+      auto const match = req.find(http::field::accept_encoding);
+      if (match != std::end(req))
+	 preference = coding_preference {match->value()};
+
+      for (auto c : preference) {
+	 auto const suffix = coding_suffix(c);
+	 final_path.append(suffix.data(), std::size(suffix));
+	 coded_size = stored_size(cfg, name(final_path), final_path);
+	 if (coded_size) {
+	    coding = c;
+	    break;
+	 }
+
+	 final_path.resize(std::size(path));
+      }
    }
 
    log::write(
@@ -212,119 +1150,320 @@ make_get_response(
       "get_handler: target (final): {0}",
       final_path);
 
-   std::ifstream ifs{final_path};
-   if (!ifs) {
-      log::write(log::level::debug, "get_handler: Can't open file.");
-      response.result(http::status::not_found);
-      response.set(http::field::content_type, mime_type(".txt"));
-      response.body() = "File not found.\r\n";
-      response.set(http::field::content_length,
-		beast::to_static_string(std::size(response.body())));
-      return response;
-   }
+   auto const object = find_object(cfg, name(final_path));
 
-   std::string body;
+   std::pmr::string body {alloc};
+   budget_lease lease;
 
-   auto const is_jpeg = make_extension(path) == ".jpeg";
-   auto const is_jpg = make_extension(path) == ".jpg";
+   auto const is_image = type.mime == "image/jpeg" || type.mime == "image/png";
 
    auto const query = target_query.second;
-   auto const queries = parse_query({query.data(), std::size(query)});
-   auto const width_str = get_field_value(queries, "width");
-   auto const height_str = get_field_value(queries, "height");
+   query_view const queries {query};
+
+   std::string width_buffer;
+   auto const width_str =
+      percent_decode(get_field_value(queries, "width"), width_buffer);
+
+   std::string height_buffer;
+   auto const height_str =
+      percent_decode(get_field_value(queries, "height"), height_buffer);
+
    auto const is_img_query = !std::empty(width_str) && !std::empty(height_str);
 
-   if ((is_jpeg || is_jpg) && is_img_query) {
+   // Files without a compressed sibling are compressed on the fly and
+   // served from the cache once that is done.
+   compression_cache::variant variant;
+   auto const dynamic =
+      cfg.compression &&
+      type.gzip &&
+      coding == content_coding::identity &&
+      !object &&
+      !(is_image && is_img_query);
+
+   if (dynamic && !std::empty(preference)) {
+      auto const c = *std::begin(preference);
+      struct stat st;
+      if (::stat(final_path.c_str(), &st) == 0) {
+	 compression_cache::version const v {st.st_mtime, static_cast<std::uint64_t>(st.st_size)};
+	 variant = cfg.compression->find(final_path, v, c);
+	 if (variant) {
+	    coding = c;
+	    coded_size = std::size(*variant);
+	 }
+      }
+   }
+
+   // Files served whole get validators from the metadata, which also
+   // answers HEAD and conditional requests without opening them.
+   std::pmr::string validators {alloc};
+   if (meta && !(is_image && is_img_query)) {
+      std::pmr::string suffix {alloc};
+      if (coding != content_coding::identity) {
+	 auto const n = coding_name(coding);
+	 suffix += "-";
+	 suffix.append(n.data(), std::size(n));
+      }
+
+      auto const etag = make_etag(*meta, suffix);
+      auto const last_modified = http_date(meta->mtime);
+      validators += "ETag: ";
+      validators += etag;
+      validators += "\r\nLast-Modified: ";
+      validators += last_modified;
+      validators += "\r\n";
+
+      auto const size = coded_size ? *coded_size : meta->size;
+      if (not_modified(req, etag, last_modified)) {
+	 response res {cfg.responses.not_modified_header(type), size};
+	 res.add_fields(validators);
+	 return res;
+      }
+
+      if (req.method() == http::verb::head) {
+	 response res {cfg.responses.get_header(type, coding), size};
+	 res.add_fields(validators);
+	 return res;
+      }
+   }
+
+   auto out_type = type;
+   auto vary_accept = false;
+   if (is_image && is_img_query) {
       auto wec = error_code::ok;
       auto const width = stoi_nothrow(width_str, wec);
 
       auto hec = error_code::ok;
       auto const height = stoi_nothrow(height_str, hec);
 
-      if (wec == error_code::ok && hec == error_code::ok) {
-	 auto const ok_sizes_w = width <= 1000 && width > 0;
-	 auto const ok_sizes_h = height <= 1000 && height > 0;
-	 if (ok_sizes_w && ok_sizes_h) {
-	    namespace bg = boost::gil;
-	    bg::rgb8_image_t img;
-	    bg::read_image(ifs, img, bg::jpeg_tag{});
-	    bg::rgb8_image_t square(width, height);
-	    bg::resize_view(
-	       bg::const_view(img),
-	       bg::view(square),
-	       bg::bilinear_sampler{});
-
-	    std::ostringstream oss;
-	    bg::write_view(oss, bg::const_view(square), bg::jpeg_tag{});
-	    body = oss.str();
-	 } else {
-	    response.result(http::status::bad_request);
-	    response.set(http::field::content_type, mime_type(".txt"));
-	    response.body() = "Invalid size.\r\n";
-	    response.set(http::field::content_length,
-	       	 beast::to_static_string(std::size(response.body())));
-	    return response;
+      if (wec != error_code::ok || hec != error_code::ok)
+	 return response {cfg.responses.invalid_query};
+
+      transform t;
+      t.size = {width, height};
+      t.quality = cfg.image_quality;
+      t.format = type.mime == "image/png" ? image_format::png : image_format::jpeg;
+
+      std::string mode_buffer;
+      auto const mode_str =
+	 percent_decode(get_field_value(queries, "mode"), mode_buffer);
+      if (!std::empty(mode_str)) {
+	 auto const mode = parse_resize_mode(mode_str);
+	 if (!mode)
+	    return response {cfg.responses.invalid_query};
+
+	 t.mode = *mode;
+      }
+
+      std::string quality_buffer;
+      auto const quality_str =
+	 percent_decode(get_field_value(queries, "quality"), quality_buffer);
+      if (!std::empty(quality_str)) {
+	 auto ec = error_code::ok;
+	 t.quality = stoi_nothrow(quality_str, ec);
+	 if (ec != error_code::ok || t.quality < 1 || t.quality > 100)
+	    return response {cfg.responses.invalid_query};
+      }
+
+      std::string format_buffer;
+      auto const format_str =
+	 percent_decode(get_field_value(queries, "format"), format_buffer);
+      if (format_str == "png") {
+	 t.format = image_format::png;
+      } else if (format_str == "jpeg" || format_str == "jpg") {
+	 t.format = image_format::jpeg;
+      } else if (format_str == "webp") {
+	 t.format = image_format::webp;
+      } else if (!std::empty(format_str)) {
+	 return response {cfg.responses.invalid_query};
+      } else if (cfg.image_webp) {
+	 // Clients that take WebP get it, so the response varies.
+	 vary_accept = true;
+	 auto const accept = req.find(http::field::accept);
+	 if (accept != std::end(req) && accepts_webp(accept->value()))
+	    t.format = image_format::webp;
+      }
+
+      auto const& limits = cfg.image_limits;
+      auto const ok_sizes_w = width <= limits.max_width && width > 0;
+      auto const ok_sizes_h = height <= limits.max_height && height > 0;
+      if (!ok_sizes_w || !ok_sizes_h)
+	 return response {cfg.responses.invalid_size};
+
+      // Known not to be an image we decode from its content.
+      auto const ok_format =
+	 !meta ||
+	 meta->format == image_format::jpeg ||
+	 meta->format == image_format::png;
+
+      if (!ok_format)
+	 return response {cfg.responses.invalid_query};
+
+      // Made on upload, served as they are.
+      auto const plain =
+	 t.mode == resize_mode::scale &&
+	 std::empty(quality_str) &&
+	 std::empty(format_str);
+
+      if (plain) {
+	 auto const webp = t.format == image_format::webp;
+	 auto thumbnail = find_thumbnail(cfg, name(path), t.size, type, webp, alloc);
+	 if (thumbnail) {
+	    if (vary_accept)
+	       thumbnail->add_fields("Vary: Accept\r\n");
+
+	    return std::move(*thumbnail);
 	 }
+      }
+
+      std::pmr::string encoded {alloc};
+      unique_fd file;
+      std::size_t offset = 0;
+      std::size_t size = 0;
+      if (object) {
+	 offset = object->offset;
+	 size = object->size;
       } else {
-         response.result(http::status::bad_request);
-         response.set(http::field::content_type, mime_type(".txt"));
-         response.body() = "Invalid query.\r\n";
-         response.set(http::field::content_length,
-       	      beast::to_static_string(std::size(response.body())));
-         return response;
+	 file = open_stored(cfg, root, final_path, size);
+	 if (!file) {
+	    log::write(log::level::debug, "get_handler: Can't open file.");
+	    return response {cfg.responses.not_found};
+	 }
+      }
+
+      if (!lease.resize(size)) {
+	 log::write(log::level::info, "get_handler: Memory budget exhausted.");
+	 return response {cfg.responses.service_unavailable};
+      }
+
+      auto const fd = object ? object->fd : file.get();
+      if (!read_file(fd, size, encoded, offset)) {
+	 log::write(log::level::debug, "get_handler: Can't read file.");
+	 return response {cfg.responses.not_found};
+      }
+
+      object_meta detected;
+      if (meta)
+	 detected.format = meta->format;
+      else
+	 detect_image(encoded, detected);
+
+      auto status = transform_status::ok;
+      try {
+	 status = transform_image(
+	    encoded,
+	    detected.format,
+	    t,
+	    limits.max_source_pixels,
+	    lease,
+	    body);
+      } catch (std::exception const& e) {
+	 log::write(log::level::debug, "get_handler: {0}", e.what());
+	 return response {cfg.responses.invalid_query};
+      }
+
+      if (status == transform_status::no_memory) {
+	 log::write(log::level::info, "get_handler: Memory budget exhausted.");
+	 return response {cfg.responses.service_unavailable};
       }
+
+      if (status == transform_status::too_large)
+	 return response {cfg.responses.invalid_size};
+
+      out_type = cfg.types.classify(image_extension(t.format));
+   } else if (variant) {
+      auto const& head = cfg.responses.get_header(type, coding);
+      response res {head, std::move(variant)};
+      res.add_fields(validators);
+      return res;
+   } else if (object) {
+      auto const& head = cfg.responses.get_header(type, coding);
+      response res {head, object->fd, object->offset, object->size, alloc};
+      res.add_fields(validators);
+      return res;
    } else {
-      using iter_type = std::istreambuf_iterator<char>;
-      body = std::string {iter_type {ifs}, {}};
+      std::size_t size = 0;
+      auto file = open_stored(cfg, root, final_path, size);
+      if (!file) {
+	 log::write(log::level::debug, "get_handler: Can't open file.");
+	 return response {cfg.responses.not_found};
+      }
+
+      auto const& head = cfg.responses.get_header(type, coding);
+      response res {head, std::move(file), size, alloc};
+      res.add_fields(validators);
+      return res;
    }
 
-   auto const body_size = std::size(body);
-   response.body() = std::move(body);
-   response.set(http::field::server, cfg.server_name);
-   response.set(http::field::content_type, mime_type(path));
-   response.content_length(body_size);
-   response.keep_alive(parser.keep_alive());
-   response.set(http::field::access_control_allow_origin,
-		 cfg.allow_origin);
-   if (gzip)
-     response.set(http::field::content_encoding, "gzip");
-
-   if (cfg.set_cache_control()) {
-     response.set(
-	http::field::cache_control,
-	cfg.get_cache_control(path));
+   auto const& head = cfg.responses.get_header(out_type, coding);
+   response res {head, std::move(body), std::move(lease)};
+   if (vary_accept)
+      res.add_fields("Vary: Accept\r\n");
+
+   return res;
+}
+
+net::thread_pool* io_queue(request_type const& req, config const& cfg)
+{
+   if (!cfg.roots)
+      return nullptr;
+
+   auto const method = req.method();
+   auto const handled =
+      method == http::verb::get ||
+      method == http::verb::head ||
+      method == http::verb::post;
+
+   if (!handled)
+      return nullptr;
+
+   auto const target = split_from_query(req.target()).first;
+   if (std::empty(target))
+      return nullptr;
+
+   if (std::size(target) == 1) {
+      auto const name = "/" + cfg.default_file;
+      return cfg.roots->queue(cfg.roots->place(placement_name(name)));
    }
 
-   return response;
+   auto const name = placement_name({target.data(), std::size(target)});
+   return cfg.roots->queue(cfg.roots->place(name));
 }
 
-http::response<http::string_body>
+// A GET without the body.
+response
+make_head_response(
+   beast::string_view raw_target,
+   request_type const& req,
+   config const& cfg)
+{
+   auto res = make_get_response(raw_target, req, cfg);
+   res.omit_body();
+   return res;
+}
+
+response
 make_redirect_response(beast::string_view target, config const& cfg)
 {
    log::write(log::level::debug,
 	      "make_redirect_response: redirecting to {0}",
 	      cfg.redirect_url);
 
-   http::response<http::string_body> response;
-   response.result(http::status::moved_permanently);
-   auto url = cfg.redirect_url;
-   url.append(target.data(), std::size(target));
-   response.set(http::field::location, url);
-   response.set(http::field::content_length, beast::to_static_string(0));
-   response.set(http::field::access_control_allow_origin, cfg.allow_origin);
-   return response;
+   return
+      response
+      { cfg.responses.redirect_head
+      , target
+      , cfg.responses.redirect_tail};
 }
 
-http::response<http::string_body>
+response
 make_response(
-   http::request_parser<http::string_body> const& parser,
+   request_type const& req,
    config const& cfg,
-   bool is_ssl)
+   bool is_ssl,
+   content_id const* id)
 {
-   http::response<http::string_body> response;
-
    if (!log::ignore(log::level::debug)) { // Optimization.
-      for (auto const& field : parser.get()) {
+      for (auto const& field : req) {
 	 log::write(
 	    log::level::debug,
 	    "   {0}: {1}",
@@ -333,36 +1472,21 @@ make_response(
       }
    }
 
-   auto const target = parser.get().target();
-   auto const match = parser.get().find(http::field::host);
+   auto const target = req.target();
+   auto const match = req.find(http::field::host);
    auto no_host_match = false;
-   if (match != std::end(parser.get())) {
-      auto const v = match->value();
-      auto const n =
-	 std::count(std::begin(cfg.host_names),
-		    std::end(cfg.host_names),
-		    std::string {v.data(), std::size(v)});
-      no_host_match = n == 0;
-   }
+   if (match != std::end(req))
+      no_host_match = !cfg.hosts.match(match->value());
 
    auto const empty_redir_url = std::empty(cfg.redirect_url);
    if (no_host_match || !(empty_redir_url || is_ssl))
       return make_redirect_response(target, cfg);
 
-   response.version(parser.get().version());
-   response.keep_alive(false);
-
-   switch (parser.get().method()) {
-      case http::verb::post: return make_post_response(target, parser, cfg);
-      case http::verb::get: return make_get_response(target, parser, cfg);
-      default:
-      {
-	 response.result(http::status::bad_request);
-	 response.set(http::field::content_type, "text/plain");
-	 response.set(http::field::content_length,
-		      beast::to_static_string(std::size(response.body())));
-	 return response;
-      } break;
+   switch (req.method()) {
+      case http::verb::post: return make_post_response(target, req, cfg, id);
+      case http::verb::get: return make_get_response(target, req, cfg);
+      case http::verb::head: return make_head_response(target, req, cfg);
+      default: return response {cfg.responses.bad_request};
    }
 }
 
@@ -18,14 +18,202 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <memory>
 #include <vector>
 #include <string>
+#include <optional>
 
 #include "net.hpp"
+#include "mime.hpp"
+#include "memory.hpp"
+#include "utils.hpp"
 #include "crypto.hpp"
+#include "image.hpp"
+#include "compression.hpp"
+#include "upload_pipeline.hpp"
 
 namespace smms {
 
+class rate_limiter;
+class volume_store;
+class root_set;
+
+using body_type =
+   http::basic_string_body<char, std::char_traits<char>, allocator_type>;
+
+using request_parser = http::request_parser<body_type, allocator_type>;
+using request_type = request_parser::value_type;
+using buffer_type = beast::basic_flat_buffer<allocator_type>;
+
+// Responses and header blocks serialized once at startup, see
+// config::make_responses.
+struct canned_responses {
+   std::string bad_request;
+   std::string invalid_body_size;
+   std::string empty_hmac;
+   std::string invalid_hmac;
+   std::string invalid_signature;
+   std::string write_error;
+   std::string invalid_size;
+   std::string invalid_query;
+   std::string not_found;
+   std::string post_ok;
+
+   // 503 with Retry-After, when the body budget is exhausted.
+   std::string service_unavailable;
+
+   // 429 with Retry-After, when a client is over its rate limits.
+   std::string too_many_requests;
+
+   // The Location field is written in between.
+   std::string redirect_head;
+   std::string redirect_tail;
+
+   // Status line and header fields of successful GETs, indexed by
+   // content_coding_count * file_type::id + content_coding. They end
+   // in "Content-Length: ".
+   std::vector<std::string> get_headers;
+
+   // As above for 304 Not Modified, indexed by file_type::id.
+   std::vector<std::string> not_modified_headers;
+
+   string_view
+   get_header(file_type const& type, content_coding c) const noexcept
+   {
+      auto const i = content_coding_count * type.id + static_cast<std::size_t>(c);
+      return get_headers[i];
+   }
+
+   string_view not_modified_header(file_type const& type) const noexcept
+      { return not_modified_headers[type.id]; }
+};
+
+/* A response written with scatter-gather I/O. The prebuilt parts are
+ * referenced and not copied, the only data computed per request is
+ * the Content-Length value and the body.
+ *
+ * Files are not read when the response is made. Streams that write
+ * to the socket directly send them with sendfile(2) after the header,
+ * see send_file, the others call load_file first.
+ */
+class response {
+public:
+   enum class send_status {done, blocked, failed};
+
+private:
+   string_view head_;
+   string_view location_;
+   string_view tail_;
+   // The Content-Length value and the fields added after it.
+   std::array<char, 128> length_ {};
+   std::size_t length_size_ = 0;
+   std::pmr::string body_;
+
+   // Used as the body instead of body_ when set.
+   std::shared_ptr<std::string const> shared_body_;
+
+   // The file is owned by file_ unless it was borrowed, fd_ refers to
+   // it in both cases. The body is its range from file_begin_ on.
+   unique_fd file_;
+   int fd_ = -1;
+   std::size_t file_begin_ = 0;
+   std::size_t file_size_ = 0;
+   std::size_t file_offset_ = 0;
+   budget_lease lease_;
+
+   void set_length(std::size_t n) noexcept;
+
+public:
+   response() = default;
+
+   explicit response(allocator_type const& alloc) noexcept
+   : body_ {alloc}
+   { }
+
+   // A complete canned response.
+   explicit response(string_view canned) noexcept
+   : head_ {canned}
+   { }
+
+   // A header block ending in "Content-Length: " with the length of
+   // a body that is not sent, e.g. for HEAD and 304.
+   response(string_view head, std::size_t length) noexcept;
+
+   // A header block ending in "Content-Length: " followed by the body.
+   response(string_view head, std::pmr::string body);
+
+   // As above, the lease accounts for the body.
+   response(string_view head, std::pmr::string body, budget_lease lease);
+
+   // As above with a body shared with other responses, e.g. a cached
+   // compressed variant.
+   response(string_view head, std::shared_ptr<std::string const> body) noexcept;
+
+   // A header block ending in "Content-Length: " followed by the
+   // content of the file. The allocator is used by load_file.
+   response(
+      string_view head,
+      unique_fd file,
+      std::size_t size,
+      allocator_type const& alloc);
+
+   // As above with size bytes from offset on of a borrowed file that
+   // outlives the response, e.g. a volume of the volume_store.
+   response(
+      string_view head,
+      int fd,
+      std::size_t offset,
+      std::size_t size,
+      allocator_type const& alloc);
+
+   // A redirect, the location is written between head and tail.
+   response(string_view head, string_view location, string_view tail) noexcept
+   : head_ {head}
+   , location_ {location}
+   , tail_ {tail}
+   { }
+
+   string_view body() const noexcept
+   {
+      if (shared_body_)
+	 return *shared_body_;
+
+      return {body_.data(), std::size(body_)};
+   }
+
+   // Adds header fields, each ending in "\r\n", after the
+   // Content-Length. Returns false if they don't fit.
+   bool add_fields(string_view fields) noexcept;
+
+   // Drops the body but keeps the header, for HEAD.
+   void omit_body() noexcept;
+
+   // The part of the body budget held by the response, e.g. to
+   // reserve the file size before load_file.
+   auto& lease() noexcept { return lease_; }
+
+   // Whether the file still has to be sent after buffers().
+   auto has_file() const noexcept { return fd_ != -1; }
+   auto file_size() const noexcept { return has_file() ? file_size_ : 0; }
+
+   // Copies n bytes of the file at offset to out. Used where the file
+   // can't be sent with sendfile nor loaded at once, i.e. HTTP/2.
+   bool read_file(std::size_t offset, char* out, std::size_t n) const noexcept;
+
+   // Reads the file into the body. Returns false on a read error, the
+   // body is then shorter than the Content-Length.
+   bool load_file();
+
+   // Sends the rest of the file on the non-blocking socket. Returns
+   // blocked when the socket is not writable, the call must then be
+   // repeated once it is.
+   send_status send_file(int socket) noexcept;
+
+   std::array<net::const_buffer, 5> buffers() const noexcept;
+};
+
 struct config {
    std::vector<std::string> host_names;
    std::vector<std::string> gzip_mimes;
@@ -33,6 +221,18 @@ struct config {
    std::vector<std::string> local_cache_control_mime;
    std::vector<std::string> local_cache_control_value;
 
+   std::vector<std::string> mime_type_extension;
+   std::vector<std::string> mime_type_value;
+
+   // Built from the fields above, see make_file_types.
+   file_types types;
+
+   // Built from host_names, see make_host_set.
+   host_set hosts;
+
+   // Built from the fields below, see make_responses.
+   canned_responses responses;
+
    std::string server_name;
    std::string redirect_url;
    std::string doc_root;
@@ -41,31 +241,182 @@ struct config {
    std::string default_file;
    std::string default_cache_control;
    std::uint64_t body_limit {1000000}; 
+
+   // Idle timeout of HTTP/2 connections, and of request bodies when
+   // min_body_rate is 0.
    int http_session_timeout {30};
 
+   // Deadlines in seconds of the phases of a connection, so that
+   // stalled clients are dropped early. Writes fail when they make no
+   // progress for write_timeout.
+   int handshake_timeout {10};
+   int header_timeout {10};
+   int write_timeout {30};
+   int shutdown_timeout {30};
+
+   // The minimum average rate in bytes per second at which request
+   // bodies must arrive, after header_timeout seconds of slack.
+   std::uint64_t min_body_rate {1024};
+
+   // Limit of body_budget() and the Retry-After value in seconds of
+   // the 503 responses when it is exhausted.
+   std::uint64_t memory_budget {0};
+   int retry_after {1};
+
+   // Limits the connections, requests and bytes of each client when
+   // set, see rate_limiter.
+   rate_limiter* limiter = nullptr;
+
+   // Uploads are stored in and served from the volumes when set, see
+   // volume_store. Targets not found there are served from doc_root.
+   volume_store* volumes = nullptr;
+
+   // Spreads the files over several directories instead of doc_root
+   // when set, see root_set.
+   root_set* roots = nullptr;
+
+   // Compresses files of the gzip_mimes on the fly when set, see
+   // compression_cache.
+   compression_cache* compression = nullptr;
+
+   // Runs work on uploads after they are stored when set, see
+   // upload_pipeline.
+   upload_pipeline* pipeline = nullptr;
+
+   // The codings of the siblings the pipeline writes for uploads of
+   // the gzip_mimes, see compression_stage.
+   std::vector<content_coding> upload_codings;
+
+   // Sizes of the thumbnails the pipeline makes of image uploads, by
+   // the prefix of their target, see thumbnail_stage.
+   std::vector<thumbnail_rule> thumbnails;
+
+   // Bounds of the images clients may ask for and the JPEG quality
+   // of transforms that don't set it, see transform.
+   transform_limits image_limits;
+   int image_quality {85};
+
+   // Transforms without a format are encoded as WebP for clients that
+   // accept it, see accepts_webp.
+   bool image_webp {true};
+
+   // Stores the content of uploads once, identified by its hash, and
+   // links the targets to it, see make_post_response.
+   bool dedup {false};
+
+   // Accept HTTP/2 with prior knowledge on plain connections, see
+   // http2_session.
+   bool h2c {false};
+
    auto set_cache_control() const noexcept
       { return !std::empty(default_cache_control);}
 
-   beast::string_view
-   get_cache_control(beast::string_view path) const noexcept;
+   // The time left to read the rest of a body of which n bytes were
+   // read in the elapsed time, see min_body_rate.
+   std::chrono::steady_clock::duration
+   body_time_left(
+      std::uint64_t n,
+      std::chrono::steady_clock::duration elapsed) const noexcept;
+
+   void make_file_types();
+   void make_host_set();
+   void make_responses();
+};
+
+// Identifies the content of an upload when deduplicating.
+using content_id = blake2b::digest_type;
+
+/* Hashes the body of an upload while it is received when uploads are
+ * deduplicated, so that its content_id is ready with the body instead
+ * of taking another pass over it.
+ */
+class body_hasher {
+private:
+   std::optional<blake2b::hasher> hasher_;
+   std::size_t hashed_ = 0;
+   content_id digest_;
+
+public:
+   // Starts hashing when the request is an upload and cfg.dedup is
+   // set, to be called once the header is read.
+   void start(request_type const& req, config const& cfg);
+
+   // Hashes the part of the body received since the last call.
+   void update(request_type const& req) noexcept;
+
+   // Hashes the rest of the body. Returns the content_id or null when
+   // not hashing.
+   content_id const* finish(request_type const& req) noexcept;
 };
 
-http::response<http::string_body>
+// The functions below allocate the response from the same arena as
+// the request, i.e. the allocator of the request body. They serve
+// HTTP/1.1 and HTTP/2 requests alike.
+
+// The id of the body is computed if not given, see body_hasher.
+response
 make_post_response(
    beast::string_view raw_target,
-   http::request_parser<http::string_body> const& parser,
-   config const& cfg);
+   request_type const& req,
+   config const& cfg,
+   content_id const* id = nullptr);
 
-http::response<http::string_body>
+response
 make_get_response(
    beast::string_view raw_target,
-   http::request_parser<http::string_body> const& parser,
+   request_type const& req,
    config const& cfg);
 
-http::response<http::string_body>
+response
 make_response(
-   http::request_parser<http::string_body> const& parser,
+   request_type const& req,
    config const& cfg,
-   bool is_ssl);
+   bool is_ssl,
+   content_id const* id = nullptr);
+
+// A stage of the upload_pipeline that writes the compressed siblings
+// of uploads of the gzip_mimes, e.g. name.br, in the upload_codings
+// at their static_level, so that GETs serve them instead of
+// compressing on the fly.
+upload_pipeline::stage compression_stage(config const& cfg);
+
+// A stage of the upload_pipeline that makes the thumbnails of JPEG and
+// PNG uploads in the sizes of their thumbnail_rule, stored next to
+// them, e.g. /a/img.100x50.jpg for /a/img.jpg. GETs scaling to one of
+// these sizes serve the thumbnail instead of decoding the image. With
+// image_webp every thumbnail has a WebP variant, e.g.
+// /a/img.100x50.jpg.webp.
+upload_pipeline::stage thumbnail_stage(config const& cfg);
+
+// The I/O queue of the root that holds the target of the request, if
+// it has one. The response should then be made there, so that a slow
+// disk doesn't block the event loop.
+net::thread_pool* io_queue(request_type const& req, config const& cfg);
+
+// Makes the response on the queue and completes with it on the
+// executor associated with the handler.
+template <class CompletionToken>
+auto
+async_make_response(
+   net::thread_pool& queue,
+   request_type const& req,
+   config const& cfg,
+   bool is_ssl,
+   content_id const* id,
+   CompletionToken&& token)
+{
+   auto initiation = [&queue, &req, &cfg, is_ssl, id](auto handler) {
+      auto work = net::make_work_guard(handler);
+      net::post(queue, [&req, &cfg, is_ssl, id, handler = std::move(handler), work = std::move(work)]() mutable {
+	 auto res = make_response(req, cfg, is_ssl, id);
+	 auto ex = work.get_executor();
+	 net::post(ex, [handler = std::move(handler), res = std::move(res)]() mutable {
+	    std::move(handler)(std::move(res));
+	 });
+      });
+   };
+
+   return net::async_initiate<CompletionToken, void(response)>(initiation, token);
+}
 
 } // smms
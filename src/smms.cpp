@@ -23,6 +23,10 @@
 #include <fstream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <future>
 
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/parsers.hpp>
@@ -36,7 +40,13 @@
 #include "crypto.hpp"
 #include "logger.hpp"
 #include "session.hpp"
+#include "utils.hpp"
 #include "acceptor.hpp"
+#include "compression.hpp"
+#include "upload_pipeline.hpp"
+#include "storage.hpp"
+#include "rate_limiter.hpp"
+#include "volume_store.hpp"
 
 namespace smms {
 
@@ -44,19 +54,48 @@ struct server_cfg {
    int exit = -1;
    unsigned short http_port;
    unsigned short https_port;
+   protocol http_protocol;
+   protocol https_protocol;
+   std::string listen_address;
+   std::string unix_socket;
+   protocol unix_socket_protocol;
    log::level logfilter;
    config session_cfg;
    int max_listen_connections;
+   rate_limiter::limits limits;
 
-   std::string ssl_cert_file;
-   std::string ssl_priv_key_file;
-   std::string ssl_dh_file;
+   // Stores uploads in volumes in this directory when not empty, see
+   // volume_store.
+   std::string volume_dir;
+   std::uint64_t volume_size;
+
+   // Spread the files over these instead of doc_root when not empty,
+   // see root_set.
+   std::vector<storage_root> storage_roots;
+   std::size_t io_queue_threads;
+
+   // Bytes of compressed variants kept and the threads that make
+   // them, see compression_cache. Disabled if zero.
+   std::size_t compression_cache_size;
+   std::size_t compression_threads;
+
+   // Threads of the upload_pipeline, it runs when a stage is
+   // configured.
+   std::size_t upload_threads;
+
+   // Number of event loops, the CPUs they are pinned to and whether
+   // connections are steered to the loop of the CPU that received
+   // them.
+   std::size_t io_threads;
+   std::vector<int> io_cpus;
+   bool steer_connections;
+
+   tls_config tls;
 
    auto with_ssl() const noexcept
    {
-      auto const r = std::empty(ssl_cert_file) ||
-                     std::empty(ssl_priv_key_file) ||
-                     std::empty(ssl_dh_file);
+      auto const r = std::empty(tls.cert_file) ||
+                     std::empty(tls.priv_key_file);
       return !r;
    }
 
@@ -66,16 +105,41 @@ struct server_cfg {
        std::size(session_cfg.local_cache_control_mime) ==
        std::size(session_cfg.local_cache_control_value);
    }
+
+   auto has_compatible_mime_type() const noexcept
+   {
+     return
+       std::size(session_cfg.mime_type_extension) ==
+       std::size(session_cfg.mime_type_value);
+   }
 };
 
 namespace po = boost::program_options;
 
+// Forward secret AEAD ciphers for TLS 1.2, ECDHE first.
+char const* default_ciphers =
+   "ECDHE-ECDSA-AES128-GCM-SHA256:"
+   "ECDHE-RSA-AES128-GCM-SHA256:"
+   "ECDHE-ECDSA-AES256-GCM-SHA384:"
+   "ECDHE-RSA-AES256-GCM-SHA384:"
+   "ECDHE-ECDSA-CHACHA20-POLY1305:"
+   "ECDHE-RSA-CHACHA20-POLY1305:"
+   "DHE-RSA-AES128-GCM-SHA256:"
+   "DHE-RSA-AES256-GCM-SHA384";
+
 auto make_cfg(int argc, char* argv[])
 {
    server_cfg cfg {-1};
    std::string conf_file;
    std::string logfilter_str;
    std::string key;
+   std::string http_protocol;
+   std::string https_protocol;
+   std::string unix_socket_protocol;
+   std::string io_cpus;
+   std::vector<std::string> storage_roots;
+   std::vector<std::string> upload_codings;
+   std::vector<std::string> thumbnails;
 
    po::options_description desc("Options");
    desc.add_options()
@@ -84,22 +148,68 @@ auto make_cfg(int argc, char* argv[])
    ("gzip-mimes", po::value<std::vector<std::string>>(&cfg.session_cfg.gzip_mimes))
    ("local-cache-control-mime", po::value<std::vector<std::string>>(&cfg.session_cfg.local_cache_control_mime))
    ("local-cache-control-value", po::value<std::vector<std::string>>(&cfg.session_cfg.local_cache_control_value))
+   ("mime-type-extension", po::value<std::vector<std::string>>(&cfg.session_cfg.mime_type_extension))
+   ("mime-type-value", po::value<std::vector<std::string>>(&cfg.session_cfg.mime_type_value))
    ("server-name", po::value<std::string>(&cfg.session_cfg.server_name))
    ("redirect-url", po::value<std::string>(&cfg.session_cfg.redirect_url))
    ("doc-root", po::value<std::string>(&cfg.session_cfg.doc_root)->default_value("/data/www"))
+   ("storage-root", po::value<std::vector<std::string>>(&storage_roots))
+   ("io-queue-threads", po::value<std::size_t>(&cfg.io_queue_threads)->default_value(0))
+   ("compression-cache-size", po::value<std::size_t>(&cfg.compression_cache_size)->default_value(64 << 20))
+   ("compression-threads", po::value<std::size_t>(&cfg.compression_threads)->default_value(1))
+   ("upload-codings", po::value<std::vector<std::string>>(&upload_codings))
+   ("thumbnails", po::value<std::vector<std::string>>(&thumbnails))
+   ("image-max-width", po::value<int>(&cfg.session_cfg.image_limits.max_width)->default_value(1000))
+   ("image-max-height", po::value<int>(&cfg.session_cfg.image_limits.max_height)->default_value(1000))
+   ("image-max-pixels", po::value<std::uint64_t>(&cfg.session_cfg.image_limits.max_source_pixels)->default_value(50000000))
+   ("image-webp", po::value<bool>(&cfg.session_cfg.image_webp)->default_value(true))
+   ("image-quality", po::value<int>(&cfg.session_cfg.image_quality)->default_value(85))
+   ("upload-threads", po::value<std::size_t>(&cfg.upload_threads)->default_value(1))
+   ("volume-dir", po::value<std::string>(&cfg.volume_dir))
+   ("volume-size", po::value<std::uint64_t>(&cfg.volume_size)->default_value(std::uint64_t {1} << 30))
+   ("dedup", po::value<bool>(&cfg.session_cfg.dedup)->default_value(false))
+   ("h2c", po::value<bool>(&cfg.session_cfg.h2c)->default_value(false))
    ("body-limit", po::value<std::uint64_t>(&cfg.session_cfg.body_limit)->default_value(1000000))
+   ("memory-budget", po::value<std::uint64_t>(&cfg.session_cfg.memory_budget)->default_value(0))
+   ("retry-after", po::value<int>(&cfg.session_cfg.retry_after)->default_value(1))
+   ("handshake-timeout", po::value<int>(&cfg.session_cfg.handshake_timeout)->default_value(10))
+   ("header-timeout", po::value<int>(&cfg.session_cfg.header_timeout)->default_value(10))
+   ("min-body-rate", po::value<std::uint64_t>(&cfg.session_cfg.min_body_rate)->default_value(1024))
+   ("write-timeout", po::value<int>(&cfg.session_cfg.write_timeout)->default_value(30))
+   ("http-session-timeout", po::value<int>(&cfg.session_cfg.http_session_timeout)->default_value(30))
+   ("rate-limit-connections", po::value<double>(&cfg.limits.connections)->default_value(0))
+   ("rate-limit-requests", po::value<double>(&cfg.limits.requests)->default_value(0))
+   ("rate-limit-bytes", po::value<double>(&cfg.limits.bytes)->default_value(0))
+   ("rate-limit-burst", po::value<double>(&cfg.limits.burst)->default_value(10))
+   ("rate-limit-prefix-factor", po::value<double>(&cfg.limits.prefix_factor)->default_value(16))
    ("config", po::value<std::string>(&conf_file))
    ("default-file", po::value<std::string>(&cfg.session_cfg.default_file))
    ("default-cache-control", po::value<std::string>(&cfg.session_cfg.default_cache_control))
    ("http-port", po::value<unsigned short>(&cfg.http_port)->default_value(80))
    ("https-port", po::value<unsigned short>(&cfg.https_port)->default_value(443))
+   ("http-protocol", po::value<std::string>(&http_protocol)->default_value("auto"))
+   ("https-protocol", po::value<std::string>(&https_protocol)->default_value("auto"))
+   ("listen-address", po::value<std::string>(&cfg.listen_address)->default_value("0.0.0.0"))
+   ("unix-socket", po::value<std::string>(&cfg.unix_socket))
+   ("unix-socket-protocol", po::value<std::string>(&unix_socket_protocol)->default_value("plain"))
    ("log-level", po::value<std::string>(&logfilter_str)->default_value("debug"))
    ("key", po::value<std::string>(&key))
    ("allow-origin", po::value<std::string>(&cfg.session_cfg.allow_origin)->default_value("*"))
    ("max-listen-connections", po::value<int>(&cfg.max_listen_connections)->default_value(511))
-   ("ssl-certificate-file", po::value<std::string>(&cfg.ssl_cert_file))
-   ("ssl-private-key-file", po::value<std::string>(&cfg.ssl_priv_key_file))
-   ("ssl-dh-file", po::value<std::string>(&cfg.ssl_dh_file))
+   ("io-threads", po::value<std::size_t>(&cfg.io_threads)->default_value(1))
+   ("io-cpus", po::value<std::string>(&io_cpus))
+   ("steer-connections", po::value<bool>(&cfg.steer_connections)->default_value(false))
+   ("ssl-certificate-file", po::value<std::string>(&cfg.tls.cert_file))
+   ("ssl-private-key-file", po::value<std::string>(&cfg.tls.priv_key_file))
+   ("ssl-dh-file", po::value<std::string>(&cfg.tls.dh_file))
+   ("ssl-ciphers", po::value<std::string>(&cfg.tls.ciphers)->default_value(default_ciphers))
+   ("ssl-ciphersuites", po::value<std::string>(&cfg.tls.ciphersuites))
+   ("ssl-session-cache-size", po::value<long>(&cfg.tls.session_cache_size)->default_value(20480))
+   ("ssl-session-timeout", po::value<long>(&cfg.tls.session_timeout)->default_value(300))
+   ("ssl-ticket-key-rotation", po::value<long>(&cfg.tls.ticket_key_rotation)->default_value(3600))
+   ("ssl-ktls", po::value<bool>(&cfg.tls.ktls)->default_value(false))
+   ("ssl-http2", po::value<bool>(&cfg.tls.http2)->default_value(false))
+   ("ssl-shutdown-timeout", po::value<int>(&cfg.session_cfg.shutdown_timeout)->default_value(30))
    ;
 
    po::positional_options_description pos;
@@ -123,6 +233,82 @@ auto make_cfg(int argc, char* argv[])
       return server_cfg {1};
    }
 
+   if (!cfg.has_compatible_mime_type()) {
+      log::write(log::level::err, "Incompatible size of mime-type-* fields.");
+      return server_cfg {1};
+   }
+
+   auto const http_proto = to_protocol(http_protocol);
+   auto const https_proto = to_protocol(https_protocol);
+   auto const unix_proto = to_protocol(unix_socket_protocol);
+   if (!http_proto || !https_proto || !unix_proto) {
+      log::write(log::level::err, "Invalid protocol, use plain, tls or auto.");
+      return server_cfg {1};
+   }
+
+   if (cfg.io_threads == 0) {
+      log::write(log::level::err, "io-threads must be at least 1.");
+      return server_cfg {1};
+   }
+
+   if (!std::empty(io_cpus)) {
+      cfg.io_cpus = parse_cpu_list(io_cpus);
+      if (std::empty(cfg.io_cpus)) {
+         log::write(log::level::err, "Invalid io-cpus list.");
+         return server_cfg {1};
+      }
+   }
+
+   for (auto const& r : storage_roots) {
+      auto root = parse_storage_root(r);
+      if (!root) {
+         log::write(log::level::err, "Invalid storage-root: {0}", r);
+         return server_cfg {1};
+      }
+
+      cfg.storage_roots.push_back(std::move(*root));
+   }
+
+   for (auto const& name : upload_codings) {
+      using c = content_coding;
+      auto found = false;
+      for (auto coding : {c::gzip, c::br, c::zstd}) {
+         if (coding_name(coding) == name) {
+            cfg.session_cfg.upload_codings.push_back(coding);
+            found = true;
+         }
+      }
+
+      if (!found) {
+         log::write(log::level::err, "Invalid upload-codings: {0}", name);
+         return server_cfg {1};
+      }
+   }
+
+   auto const quality = cfg.session_cfg.image_quality;
+   if (quality < 1 || quality > 100) {
+      log::write(log::level::err, "image-quality must be between 1 and 100.");
+      return server_cfg {1};
+   }
+
+   for (auto const& t : thumbnails) {
+      auto rule = parse_thumbnail_rule(t);
+      if (!rule) {
+         log::write(log::level::err, "Invalid thumbnails: {0}", t);
+         return server_cfg {1};
+      }
+
+      cfg.session_cfg.thumbnails.push_back(std::move(*rule));
+   }
+
+   cfg.http_protocol = *http_proto;
+   cfg.https_protocol = *https_proto;
+   cfg.unix_socket_protocol = *unix_proto;
+
+   cfg.session_cfg.make_host_set();
+   cfg.session_cfg.make_file_types();
+   cfg.session_cfg.make_responses();
+
    if (vm.count("help")) {
       std::cout << desc << "\n";
       return server_cfg {0};
@@ -149,6 +335,63 @@ auto make_cfg(int argc, char* argv[])
    return cfg;
 }
 
+// The listeners of one event loop. All loops listen on the same
+// ports, SO_REUSEPORT spreads the connections over them.
+struct event_loop {
+   net::io_context ioc {BOOST_ASIO_CONCURRENCY_HINT_UNSAFE};
+   std::unique_ptr<acceptor> http;
+   std::unique_ptr<acceptor> https;
+   std::unique_ptr<local_acceptor> local;
+};
+
+// Called on the thread that runs the loop. The thread is pinned
+// before anything is allocated, the memory of the loop, e.g. its
+// connection_pool(), then lives on the NUMA node of its CPU.
+std::unique_ptr<event_loop>
+make_event_loop(
+   std::size_t i,
+   server_cfg const& cfg,
+   config const& session_cfg,
+   ssl::context& ctx)
+{
+   auto const cpu =
+      std::empty(cfg.io_cpus) ? -1 : cfg.io_cpus[i % std::size(cfg.io_cpus)];
+
+   if (cpu != -1 && !pin_thread(cpu)) {
+      log::write(log::level::notice,
+                 "Unable to pin event loop {0} to CPU {1}.", i, cpu);
+   }
+
+   auto loop = std::make_unique<event_loop>();
+   auto const address = net::ip::make_address(cfg.listen_address);
+
+   auto const listen = [&](auto& acc, unsigned short port) {
+      if (cfg.steer_connections && cpu != -1)
+         acc->steer(cpu, i == 0 ? cfg.io_threads : 0);
+
+      acc->run(session_cfg, {address, port}, cfg.max_listen_connections);
+   };
+
+   if (cfg.http_port != 0) {
+      loop->http = std::make_unique<acceptor>(loop->ioc, ctx, cfg.http_protocol);
+      listen(loop->http, cfg.http_port);
+   }
+
+   if (cfg.https_port != 0) {
+      loop->https = std::make_unique<acceptor>(loop->ioc, ctx, cfg.https_protocol);
+      listen(loop->https, cfg.https_port);
+   }
+
+   // A socket file can't be shared, the first loop serves it.
+   if (i == 0 && !std::empty(cfg.unix_socket)) {
+      loop->local =
+         std::make_unique<local_acceptor>(loop->ioc, ctx, cfg.unix_socket_protocol);
+      loop->local->run(session_cfg, {cfg.unix_socket}, cfg.max_listen_connections);
+   }
+
+   return loop;
+}
+
 } // smms
 
 using namespace smms;
@@ -156,7 +399,7 @@ using namespace smms;
 int main(int argc, char* argv[])
 {
    try {
-      auto const cfg = make_cfg(argc, argv);
+      auto cfg = make_cfg(argc, argv);
       if (cfg.exit == 0)
          return 0;
 
@@ -165,40 +408,165 @@ int main(int argc, char* argv[])
 
       init_libsodium();
       log::upto(cfg.logfilter);
+      body_budget().set_limit(cfg.session_cfg.memory_budget);
 
-      if (cfg.http_port == 0 && cfg.https_port == 0) {
+      if (cfg.http_port == 0 && cfg.https_port == 0 &&
+          std::empty(cfg.unix_socket)) {
 	 log::write(log::level::notice,
 	            "No ports have been enabled, leaving ...");
 	 return 0;
       }
 
-      net::io_context ioc {BOOST_ASIO_CONCURRENCY_HINT_UNSAFE};
-      ssl::context ctx {ssl::context::tlsv12};
+      ssl::context ctx {ssl::context::tls_server};
       config session_cfg {cfg.session_cfg};
 
-      std::unique_ptr<acceptor> http;
-      if (cfg.http_port != 0) {
-	 http = std::make_unique<acceptor>(ioc, ctx);
-	 http->run(session_cfg, cfg.http_port, cfg.max_listen_connections);
+      std::unique_ptr<rate_limiter> limiter;
+      if (cfg.limits.enabled()) {
+         limiter = std::make_unique<rate_limiter>(cfg.limits);
+         session_cfg.limiter = limiter.get();
+      }
+
+      std::unique_ptr<volume_store> volumes;
+      if (!std::empty(cfg.volume_dir)) {
+         volumes = std::make_unique<volume_store>(cfg.volume_dir, cfg.volume_size);
+         session_cfg.volumes = volumes.get();
+         log::write(log::level::notice, "Volumes hold {0} objects.", volumes->size());
+      }
+
+      std::unique_ptr<root_set> roots;
+      if (!std::empty(cfg.storage_roots)) {
+         // Requests are then handled on the queues with memory of the
+         // connections.
+         if (cfg.io_queue_threads != 0)
+            synchronize_connection_pools();
+
+         roots = std::make_unique<root_set>(cfg.storage_roots, cfg.io_queue_threads);
+         session_cfg.roots = roots.get();
+      }
+
+      std::unique_ptr<compression_cache> compression;
+      if (cfg.compression_cache_size != 0 && cfg.compression_threads != 0) {
+         compression = std::make_unique<compression_cache>(
+            cfg.compression_cache_size,
+            cfg.compression_threads);
+         session_cfg.compression = compression.get();
+      }
+
+      // Its stages store into the components above.
+      std::unique_ptr<upload_pipeline> pipeline;
+      if (cfg.upload_threads != 0) {
+         pipeline = std::make_unique<upload_pipeline>(cfg.upload_threads);
+         if (!std::empty(session_cfg.upload_codings))
+            pipeline->add(compression_stage(session_cfg));
+
+         if (!std::empty(session_cfg.thumbnails))
+            pipeline->add(thumbnail_stage(session_cfg));
+
+         if (pipeline->empty())
+            pipeline.reset();
+
+         session_cfg.pipeline = pipeline.get();
       }
 
-      std::unique_ptr<acceptor> https;
-      if (cfg.https_port != 0 && cfg.with_ssl()) {
-         auto const b =
-            load_ssl( ctx
-                    , cfg.ssl_cert_file
-                    , cfg.ssl_priv_key_file
-                    , cfg.ssl_dh_file);
-         if (!b) {
+      // All listeners may need the ssl files, depending on the
+      // protocol.
+      auto const needs_ssl = [&](auto enabled, auto proto)
+         { return enabled && proto != protocol::plain; };
+
+      auto ssl_loaded = false;
+      if (cfg.with_ssl() &&
+          (needs_ssl(cfg.http_port != 0, cfg.http_protocol) ||
+           needs_ssl(cfg.https_port != 0, cfg.https_protocol) ||
+           needs_ssl(!std::empty(cfg.unix_socket), cfg.unix_socket_protocol))) {
+         ssl_loaded = load_ssl(ctx, cfg.tls);
+         if (!ssl_loaded) {
             log::write(log::level::notice, "Unable to load ssl files.");
          } else {
             log::write(log::level::notice, "Load ssl files.");
-	    https = std::make_unique<acceptor>(ioc, ctx);
-	    https->run(session_cfg, cfg.https_port, cfg.max_listen_connections);
-	 }
+         }
+      }
+
+      if (cfg.http_port != 0 && cfg.http_protocol == protocol::tls && !ssl_loaded) {
+         log::write(log::level::notice, "http-port: tls requires the ssl files.");
+         cfg.http_port = 0;
+      }
+
+      if (!ssl_loaded && cfg.https_protocol != protocol::plain)
+         cfg.https_port = 0;
+
+      if (!std::empty(cfg.unix_socket) &&
+          cfg.unix_socket_protocol == protocol::tls && !ssl_loaded) {
+         log::write(log::level::notice, "unix-socket: tls requires the ssl files.");
+         cfg.unix_socket.clear();
+      }
+
+      if (cfg.steer_connections && std::empty(cfg.io_cpus)) {
+         log::write(log::level::notice, "steer-connections: requires io-cpus.");
+         cfg.steer_connections = false;
+      }
+
+      // The loops are made one after the other, the reuseport program
+      // indexes the listeners of a port in that order.
+      std::vector<std::unique_ptr<event_loop>> loops(cfg.io_threads);
+      std::vector<std::thread> threads;
+      std::atomic<bool> failed {false};
+
+      auto const stop = [&]() {
+         for (auto& loop : loops) {
+            if (loop)
+               loop->ioc.stop();
+         }
+
+         for (auto& t : threads)
+            t.join();
+
+         // The jobs left in the queues hold sessions, they must go
+         // before the loops. The pipeline may still store to the
+         // roots.
+         pipeline.reset();
+         roots.reset();
+      };
+
+      loops[0] = make_event_loop(0, cfg, session_cfg, ctx);
+
+      for (std::size_t i = 1; i < cfg.io_threads; ++i) {
+         std::promise<void> made;
+         auto ready = made.get_future();
+
+         threads.emplace_back([&, i](std::promise<void> made) {
+            try {
+               loops[i] = make_event_loop(i, cfg, session_cfg, ctx);
+            } catch (...) {
+               made.set_exception(std::current_exception());
+               return;
+            }
+
+            made.set_value();
+
+            try {
+               loops[i]->ioc.run();
+            } catch (std::exception const& e) {
+               log::write(log::level::notice, e.what());
+               failed = true;
+               loops[0]->ioc.stop();
+            }
+         }, std::move(made));
+
+         try {
+            ready.get();
+         } catch (...) {
+            stop();
+            throw;
+         }
       }
 
-      ioc.run();
+      loops[0]->ioc.run();
+      stop();
+
+      if (failed) {
+         log::write(log::level::notice, "Exiting with status 1 ...");
+         return 1;
+      }
    } catch(std::exception const& e) {
       log::write(log::level::notice, e.what());
       log::write(log::level::notice, "Exiting with status 1 ...");
@@ -0,0 +1,129 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "storage.hpp"
+
+#include <cmath>
+#include <charconv>
+#include <algorithm>
+
+namespace smms
+{
+
+namespace {
+
+// The placement must not change between runs, the hashes are not
+// seeded.
+std::uint64_t fnv1a(string_view s) noexcept
+{
+   std::uint64_t h = 0xcbf29ce484222325;
+   for (unsigned char c : s) {
+      h ^= c;
+      h *= 0x100000001b3;
+   }
+
+   return h;
+}
+
+std::uint64_t mix(std::uint64_t x) noexcept
+{
+   x ^= x >> 30;
+   x *= 0xbf58476d1ce4e5b9;
+   x ^= x >> 27;
+   x *= 0x94d049bb133111eb;
+   x ^= x >> 31;
+   return x;
+}
+
+}
+
+std::optional<storage_root> parse_storage_root(string_view s)
+{
+   storage_root ret;
+
+   auto const colon = s.rfind(':');
+   if (colon != string_view::npos) {
+      auto const w = s.substr(colon + 1);
+      auto const r = std::from_chars(w.data(), w.data() + std::size(w), ret.weight);
+      if (r.ec != std::errc {} || r.ptr != w.data() + std::size(w) || !(ret.weight > 0))
+	 return {};
+
+      s = s.substr(0, colon);
+   }
+
+   if (std::empty(s))
+      return {};
+
+   ret.path.assign(s.data(), std::size(s));
+   return ret;
+}
+
+root_set::root_set(std::vector<storage_root> const& roots, std::size_t threads)
+{
+   for (auto const& r : roots) {
+      auto queue = threads == 0 ? nullptr : std::make_unique<net::thread_pool>(threads);
+      roots_.push_back({r.path, r.weight, mix(fnv1a(r.path)), std::move(queue)});
+   }
+}
+
+root_set::~root_set()
+{
+   for (auto& r : roots_) {
+      if (r.queue)
+	 r.queue->join();
+   }
+}
+
+double root_set::score(root const& r, std::uint64_t target_hash) const noexcept
+{
+   // A uniform value in (0, 1), -weight / ln of it is distributed so
+   // that each root wins with a probability proportional to its
+   // weight.
+   auto const h = mix(target_hash ^ r.hash);
+   auto const u = (static_cast<double>(h >> 11) + 0.5) / 9007199254740992.0;
+   return -r.weight / std::log(u);
+}
+
+std::size_t root_set::place(string_view target, std::size_t rank) const
+{
+   auto const h = fnv1a(target);
+
+   if (rank == 0) {
+      std::size_t best = 0;
+      auto best_score = score(roots_[0], h);
+      for (std::size_t i = 1; i < std::size(roots_); ++i) {
+	 auto const s = score(roots_[i], h);
+	 if (s > best_score) {
+	    best = i;
+	    best_score = s;
+	 }
+      }
+
+      return best;
+   }
+
+   std::vector<std::pair<double, std::size_t>> scores;
+   for (std::size_t i = 0; i < std::size(roots_); ++i)
+      scores.emplace_back(score(roots_[i], h), i);
+
+   auto const nth = std::begin(scores) + rank;
+   std::nth_element(std::begin(scores), nth, std::end(scores), std::greater {});
+   return nth->second;
+}
+
+}
@@ -0,0 +1,94 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+
+#include "net.hpp"
+#include "types.hpp"
+
+namespace smms
+{
+
+// A directory, typically on a disk of its own, that holds a share of
+// the files proportional to its weight.
+struct storage_root {
+   std::string path;
+   double weight = 1;
+};
+
+// Parses "path" or "path:weight", the weight must be positive.
+std::optional<storage_root> parse_storage_root(string_view s);
+
+/* Spreads the targets over several storage roots with weighted
+ * rendezvous hashing: every root gets a score for the target from a
+ * hash of both and the root with the highest score holds it. Adding a
+ * root moves only the targets for which the new root scores highest,
+ * i.e. a share proportional to its weight, and all of them move to
+ * it. The previous root of such a target scores second, see place.
+ *
+ * The hash of a root is that of its path, so that the placement
+ * doesn't depend on the order of the roots.
+ *
+ * Every root may have an I/O queue, i.e. threads of its own that
+ * handle the requests for its files, so that a slow disk only delays
+ * its own requests and not the event loops.
+ */
+class root_set {
+private:
+   struct root {
+      std::string path;
+      double weight;
+      std::uint64_t hash;
+      std::unique_ptr<net::thread_pool> queue;
+   };
+
+   std::vector<root> roots_;
+
+   double score(root const& r, std::uint64_t target_hash) const noexcept;
+
+public:
+   // Starts threads threads per root, none if zero.
+   root_set(std::vector<storage_root> const& roots, std::size_t threads);
+
+   // Waits for the requests in the queues.
+   ~root_set();
+
+   root_set(root_set const&) = delete;
+   root_set& operator=(root_set const&) = delete;
+
+   // The index of the root with the rank-th highest score for the
+   // target, rank must be less than size().
+   std::size_t place(string_view target, std::size_t rank = 0) const;
+
+   string_view path(std::size_t i) const noexcept
+      { return roots_[i].path; }
+
+   // Null when the root has no I/O queue.
+   net::thread_pool* queue(std::size_t i) const noexcept
+      { return roots_[i].queue.get(); }
+
+   auto size() const noexcept { return std::size(roots_); }
+};
+
+}
@@ -16,16 +16,114 @@
  * along with smms.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <new>
+#include <chrono>
 #include <vector>
 #include <string>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
 #include <iostream>
+#include <sstream>
+#include <filesystem>
 
+#include <zlib.h>
+
+#include <boost/gil.hpp>
+#include <boost/gil/extension/io/jpeg.hpp>
+
+#include "mime.hpp"
 #include "utils.hpp"
+#include "hpack.hpp"
+#include "http2.hpp"
+#include "image.hpp"
 #include "crypto.hpp"
+#include "storage.hpp"
+#include "compression.hpp"
+#include "metadata.hpp"
+#include "rate_limiter.hpp"
+#include "session_impl.hpp"
+#include "upload_pipeline.hpp"
+#include "volume_store.hpp"
 
 using namespace smms;
 using namespace hmacsha256;
 
+// Counts the number of global allocations while enabled. All forms
+// of new and delete are replaced, those left to the library would
+// not be counted or would free memory they didn't allocate.
+namespace counter {
+bool enabled = false;
+std::size_t allocations = 0;
+
+void* allocate(std::size_t n, std::align_val_t a) noexcept
+{
+   if (enabled)
+      ++allocations;
+
+   auto const align = static_cast<std::size_t>(a);
+   n = n ? n : 1;
+   if (align <= alignof(std::max_align_t))
+      return std::malloc(n);
+
+   // A multiple of the alignment, as aligned_alloc wants.
+   return std::aligned_alloc(align, (n + align - 1) & ~(align - 1));
+}
+
+void* allocate(std::size_t n) noexcept
+{
+   return allocate(n, std::align_val_t {alignof(std::max_align_t)});
+}
+
+// Not inlined, the compiler would otherwise see memory from new
+// passed to free.
+[[gnu::noinline]] void release(void* p) noexcept
+{
+   std::free(p);
+}
+}
+
+void* operator new(std::size_t n)
+{
+   if (auto p = counter::allocate(n))
+      return p;
+
+   throw std::bad_alloc{};
+}
+
+void* operator new(std::size_t n, std::align_val_t a)
+{
+   if (auto p = counter::allocate(n, a))
+      return p;
+
+   throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t n) { return operator new(n); }
+void* operator new[](std::size_t n, std::align_val_t a) { return operator new(n, a); }
+
+void* operator new(std::size_t n, std::nothrow_t const&) noexcept
+   { return counter::allocate(n); }
+void* operator new[](std::size_t n, std::nothrow_t const&) noexcept
+   { return counter::allocate(n); }
+void* operator new(std::size_t n, std::align_val_t a, std::nothrow_t const&) noexcept
+   { return counter::allocate(n, a); }
+void* operator new[](std::size_t n, std::align_val_t a, std::nothrow_t const&) noexcept
+   { return counter::allocate(n, a); }
+
+void operator delete(void* p) noexcept { counter::release(p); }
+void operator delete(void* p, std::size_t) noexcept { counter::release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counter::release(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { counter::release(p); }
+void operator delete(void* p, std::nothrow_t const&) noexcept { counter::release(p); }
+void operator delete(void* p, std::align_val_t, std::nothrow_t const&) noexcept { counter::release(p); }
+void operator delete[](void* p) noexcept { counter::release(p); }
+void operator delete[](void* p, std::size_t) noexcept { counter::release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counter::release(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { counter::release(p); }
+void operator delete[](void* p, std::nothrow_t const&) noexcept { counter::release(p); }
+void operator delete[](void* p, std::align_val_t, std::nothrow_t const&) noexcept { counter::release(p); }
+
 using ret_type = std::vector<std::string>;
 
 void
@@ -34,7 +132,12 @@ check_query(
    ret_type const& res,
    std::string const& info)
 {
-   auto const r1 = parse_query(q);
+   ret_type r1;
+   for (auto const& e : query_view {q}) {
+      r1.push_back({e.key.data(), std::size(e.key)});
+      r1.push_back({e.value.data(), std::size(e.value)});
+   }
+
    if (r1 != res)
       std::cout << "Error: " << info << std::endl;
    else
@@ -102,6 +205,124 @@ void query_test3()
    check_query(q25, {}, "r25");
 }
 
+void
+check_field(
+   std::string const& q,
+   std::string const& field,
+   std::string const& expected,
+   std::string const& info)
+{
+   auto const r1 = get_field_value(query_view {q}, field);
+   if (r1 != expected)
+      std::cout << "Error: " << info << std::endl;
+   else
+      std::cout << "Success: " << info << std::endl;
+}
+
+void field_test1()
+{
+   check_field("", "f1", "", "f1");
+   check_field("f1=v1", "f1", "v1", "f2");
+   check_field("f1=v1&f2=v2", "f2", "v2", "f3");
+   check_field("f1=v1&f2=v2&", "f3", "", "f4");
+   check_field("f1=v1&f1=v2", "f1", "v1", "f5");
+   check_field("f1=&f2=v2", "f1", "", "f6");
+   check_field("f1=v1&f2", "f1", "", "f7");
+}
+
+void
+check_decode(
+   std::string const& in,
+   std::string const& expected,
+   std::string const& info)
+{
+   std::string buffer;
+   auto const r1 = percent_decode(in, buffer);
+   if (r1 != expected)
+      std::cout << "Error: " << info << std::endl;
+   else
+      std::cout << "Success: " << info << std::endl;
+}
+
+void percent_decode_test1()
+{
+   check_decode("", "", "p1");
+   check_decode("abc", "abc", "p2");
+   check_decode("a%20b", "a b", "p3");
+   check_decode("a+b", "a b", "p4");
+   check_decode("%2F%2f", "//", "p5");
+   check_decode("%2", "", "p6");
+   check_decode("%zz", "", "p7");
+   check_decode("100%", "", "p8");
+}
+
+void
+check_type(
+   file_types const& types,
+   std::string const& path,
+   file_type const& expected,
+   std::string const& info)
+{
+   auto const r = types.classify(path);
+   if (r.mime != expected.mime ||
+       r.cache_control != expected.cache_control ||
+       r.gzip != expected.gzip)
+      std::cout << "Error: " << info << std::endl;
+   else
+      std::cout << "Success: " << info << std::endl;
+}
+
+void file_types_test1()
+{
+   file_types types;
+   types.set_default_cache_control("no-store");
+   types.set_mime(".webp", "image/webp");
+   types.set_gzip(".HTML");
+   types.set_cache_control(".jpg", "immutable");
+
+   check_type(types, "/a/b.html", {"text/html", "no-store", true}, "m1");
+   check_type(types, "/a/b.HtMl", {"text/html", "no-store", true}, "m2");
+   check_type(types, "/a/b.jpg", {"image/jpeg", "immutable", false}, "m3");
+   check_type(types, "/a/b.JPEG", {"image/jpeg", "no-store", false}, "m4");
+   check_type(types, "/a/b.webp", {"image/webp", "no-store", false}, "m5");
+   check_type(types, "/a/b.svgz", {"image/svg+xml", "no-store", false}, "m6");
+   check_type(types, "/a/b", {"application/text", "no-store", false}, "m7");
+   check_type(types, "/a/b.foo", {"application/text", "no-store", false}, "m8");
+
+   if (mime_type("x.TIF") != "image/tiff" || mime_type(".js") != "application/javascript")
+      std::cout << "Error: m9" << std::endl;
+   else
+      std::cout << "Success: m9" << std::endl;
+}
+
+void host_set_test1()
+{
+   host_set const hosts {{"example.com", "Foo.com:8080", "*.bar.com"}};
+
+   std::vector<std::pair<std::string, bool>> const cases
+   { {"example.com", true}
+   , {"EXAMPLE.com", true}
+   , {"www.example.com", false}
+   , {"foo.com:8080", true}
+   , {"foo.com", false}
+   , {"bar.com", false}
+   , {"a.bar.com", true}
+   , {"a.b.BAR.com", true}
+   , {".bar.com", false}
+   , {"abar.com", false}
+   , {"", false}
+   };
+
+   auto i = 0;
+   for (auto const& c : cases) {
+      auto const info = "h" + std::to_string(++i);
+      if (hosts.match(c.first) != c.second)
+	 std::cout << "Error: " << info << std::endl;
+      else
+	 std::cout << "Success: " << info << std::endl;
+   }
+}
+
 void
 check_dir(
    std::string const& target,
@@ -134,6 +355,1135 @@ void parse_dir_test1()
    check_dir(t7, {"//"}, "t7");
 }
 
+void cpu_list_test1()
+{
+   auto const ok =
+      parse_cpu_list("0-3,8") == std::vector<int>{0, 1, 2, 3, 8} &&
+      parse_cpu_list("5") == std::vector<int>{5} &&
+      std::empty(parse_cpu_list("3-1")) &&
+      std::empty(parse_cpu_list("1,,2")) &&
+      std::empty(parse_cpu_list("a"));
+
+   if (!ok)
+      std::cout << "Error: cpu_list_test1" << std::endl;
+   else
+      std::cout << "Success: cpu_list_test1" << std::endl;
+}
+
+// Handles GET requests the way a session does and checks that, once
+// the connection pool is warm, no global allocations take place, also
+// when served from the compression cache.
+void allocation_test1()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: allocation_test1 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   std::ofstream {std::string {dir} + "/file.txt"} << "Some content.";
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.host_names = {"localhost"};
+   cfg.default_cache_control = "no-store";
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   std::string const req =
+      "GET /file.txt HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "User-Agent: smms-test\r\n"
+      "Accept: */*\r\n"
+      "Accept-Encoding: gzip, deflate\r\n"
+      "\r\n";
+
+   auto handle = [&]() {
+      arena<4096> a;
+      request_parser parser
+         { std::piecewise_construct
+         , std::make_tuple(a.get_allocator())
+         , std::make_tuple(a.get_allocator())};
+
+      beast::error_code ec;
+      parser.put(net::buffer(req), ec);
+      // Reads the file the way sessions that can't sendfile do.
+      auto res = make_response(parser.get(), cfg, false);
+      if (!res.load_file())
+         return std::size_t {0};
+
+      return std::size(res.body());
+   };
+
+   auto const count = [&]() {
+      counter::allocations = 0;
+      counter::enabled = true;
+      std::size_t total = 0;
+      for (auto i = 0; i < 100; ++i)
+	 total += handle();
+      counter::enabled = false;
+      return total;
+   };
+
+   auto const n = handle() + handle();
+   auto const total = count();
+   auto const allocations = counter::allocations;
+
+   // Variants come from the compression cache once made, until then
+   // the file is sent as is.
+   compression_cache cache {1 << 20, 1};
+   cfg.compression = &cache;
+   cfg.gzip_mimes = {".txt"};
+   cfg.make_file_types();
+   std::ofstream {std::string {dir} + "/file.txt"} << std::string(1000, 'a');
+
+   auto m = handle();
+   for (auto i = 0; m == 1000 && i < 1000; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds {1});
+      m = handle();
+   }
+
+   auto const compressed = count();
+   cfg.compression = nullptr;
+
+   if (n != 26 || total != 1300 || allocations != 0 ||
+       m >= 1000 || compressed != 100 * m || counter::allocations != 0) {
+      std::cout << "Error: allocation_test1 ("
+                << allocations << ", " << counter::allocations
+                << " allocations)" << std::endl;
+   } else {
+      std::cout << "Success: allocation_test1" << std::endl;
+   }
+
+   std::remove((std::string {dir} + "/file.txt").data());
+   std::remove(dir);
+}
+
+// Fills volumes small enough to roll over and an index beyond its
+// initial capacity, then finds the objects after reopening. Removed
+// targets are gone and can be stored again.
+void volume_store_test1()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: volume_store_test1 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   auto const target = [](int i)
+      { return "/a/" + std::to_string(i) + ".jpg"; };
+
+   auto const data = [](int i)
+      { return std::string(i % 100, static_cast<char>('a' + i % 26)); };
+
+   auto const read = [](std::optional<volume_store::object> const& o) {
+      std::pmr::string out;
+      if (o)
+	 read_file(o->fd, o->size, out, o->offset);
+      return std::string {out};
+   };
+
+   constexpr int n = 70000;
+   std::string const big(3 << 20, 'b');
+
+   auto ok = true;
+   {
+      volume_store store {dir, 1 << 20};
+      for (auto i = 0; i < n; ++i)
+	 ok = ok && store.put(target(i), data(i));
+
+      ok = ok &&
+	 store.put("/big", big) &&
+	 store.put(target(1), "replaced") &&
+	 store.remove(target(2)) &&
+	 store.remove(target(3)) &&
+	 !store.remove(target(3)) &&
+	 !store.remove("/missing") &&
+	 store.put(target(3), "again") &&
+	 store.size() == n &&
+	 !store.find("/missing");
+   }
+
+   volume_store store {dir, 1 << 20};
+   for (auto i = 0; i < n; i += 7)
+      ok = ok && read(store.find(target(i))) == data(i);
+
+   ok = ok &&
+      store.size() == n &&
+      !store.find(target(2)) &&
+      read(store.find(target(3))) == "again" &&
+      read(store.find(target(1))) == "replaced" &&
+      read(store.find("/big")) == big;
+
+   if (!ok)
+      std::cout << "Error: volume_store_test1" << std::endl;
+   else
+      std::cout << "Success: volume_store_test1" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+// Checks the incremental hash used as content id and that the same
+// content is stored once, in the volumes and in linked files.
+void dedup_test1()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: dedup_test1 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   std::string const data(100000, 'd');
+
+   blake2b::hasher h;
+   h.update(std::string_view {data}.substr(0, 1000));
+   h.update(std::string_view {data}.substr(1000));
+   auto const id = h.digest();
+
+   auto ok =
+      id == blake2b::hash(data) &&
+      blake2b::to_hex(blake2b::hash("")) ==
+	 "0e5751c026e543b2e8ab2eb06099daa1d1e5df47778f7787faab45cdf12fe3a8";
+
+   {
+      volume_store store {std::string {dir} + "/volumes", 1 << 20};
+      ok = ok &&
+	 store.put("/a.jpg", data, &id) &&
+	 store.put("/b.jpg", data, &id) &&
+	 store.put("/c.jpg", data);
+
+      auto const a = store.find("/a.jpg");
+      auto const b = store.find("/b.jpg");
+      auto const c = store.find("/c.jpg");
+
+      // Two targets, the content and its location.
+      ok = ok && a && b && c &&
+	 store.size() == 5 &&
+	 a->offset == b->offset &&
+	 a->offset != c->offset;
+
+      // The content is dead with its last target and alive again when
+      // linked to.
+      ok = ok &&
+	 store.dead_bytes() == 0 &&
+	 store.put("/a.jpg", "other") &&
+	 store.dead_bytes() == 0 &&
+	 store.remove("/b.jpg") &&
+	 store.dead_bytes() == std::size(data) &&
+	 store.put("/d.jpg", data, &id) &&
+	 store.dead_bytes() == 0 &&
+	 store.remove("/c.jpg") &&
+	 store.dead_bytes() == std::size(data);
+   }
+
+   auto const content = std::string {dir} + "/content";
+   auto const a = std::string {dir} + "/a.jpg";
+   auto const b = std::string {dir} + "/b.jpg";
+
+   ok = ok &&
+      write_file(content.c_str(), data) &&
+      link_file(content.c_str(), a.c_str()) &&
+      link_file(content.c_str(), b.c_str()) &&
+      std::filesystem::equivalent(a, b) &&
+      std::filesystem::hard_link_count(content) == 3;
+
+   // Writing a target replaces the link instead of the shared content.
+   std::pmr::string out;
+   ok = ok &&
+      write_file(a.c_str(), "other") &&
+      std::filesystem::hard_link_count(content) == 2 &&
+      read_file(content.c_str(), out) && std::string {out} == data;
+
+   if (!ok)
+      std::cout << "Error: dedup_test1" << std::endl;
+   else
+      std::cout << "Success: dedup_test1" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+// Uploads the body to the target signed with the key of cfg. Returns
+// whether it was stored.
+bool post_upload(config const& cfg, std::string const& target, std::string const& body)
+{
+   auto const auth = make_auth(target, cfg.key);
+   std::string hex;
+   for (unsigned char c : auth) {
+      hex += "0123456789abcdef"[c >> 4];
+      hex += "0123456789abcdef"[c & 15];
+   }
+
+   std::string const req =
+      "POST " + target + "?hmac=" + hex + " HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Content-Length: " + std::to_string(std::size(body)) + "\r\n"
+      "\r\n" + body;
+
+   request_parser parser;
+   parser.body_limit(std::size(body));
+   beast::error_code ec;
+   std::size_t n = 0;
+   while (!ec && !parser.is_done())
+      n += parser.put(net::buffer(req.substr(n)), ec);
+
+   auto const res = make_post_response(parser.get().target(), parser.get(), cfg);
+   auto const head = res.buffers()[0];
+   return !ec && string_view {static_cast<char const*>(head.data()), head.size()}
+      == cfg.responses.post_ok;
+}
+
+// Targets linked to the same content keep metadata of their own,
+// siblings added by hand are served although it doesn't know them and
+// the content goes with the last target linked to it.
+void dedup_test2()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: dedup_test2 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.host_names = {"localhost"};
+   cfg.gzip_mimes = {".html"};
+   cfg.key = make_random_key();
+   cfg.dedup = true;
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   auto const handle = [&](std::string const& req) {
+      request_parser parser;
+      parser.body_limit(1000);
+      beast::error_code ec;
+      std::size_t n = 0;
+      while (!ec && !parser.is_done())
+	 n += parser.put(net::buffer(req.substr(n)), ec);
+
+      auto const res = make_response(parser.get(), cfg, false);
+      auto const head = res.buffers()[0];
+      return std::string {static_cast<char const*>(head.data()), head.size()};
+   };
+
+   auto const meta = [&](std::string const& name) {
+      std::pmr::string bytes;
+      read_file((std::string {dir} + "/.meta" + name).c_str(), bytes);
+      return parse_meta({bytes.data(), std::size(bytes)});
+   };
+
+   std::string const page = "<p>Page</p>";
+   auto ok =
+      post_upload(cfg, "/a.html", page) &&
+      post_upload(cfg, "/b.html", page) &&
+      post_upload(cfg, "/a.html.gz", "compressed");
+
+   auto const a = meta("/a.html");
+   auto const b = meta("/b.html");
+   ok = ok && a && b &&
+      std::filesystem::equivalent(std::string {dir} + "/a.html", std::string {dir} + "/b.html") &&
+      a->encodings == encoding::gzip &&
+      b->encodings == 0;
+
+   std::ofstream {std::string {dir} + "/b.html.br"} << "by hand";
+   auto const res = handle(
+      "GET /b.html HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Accept-Encoding: br\r\n"
+      "\r\n");
+
+   ok = ok && res.find("Content-Encoding: br\r\n") != std::string::npos;
+
+   // Content no target links to anymore is removed.
+   auto const hex = blake2b::to_hex(blake2b::hash(page));
+   auto const content = std::string {dir} + "/.content/" + hex.substr(0, 2) + "/" + hex.substr(2);
+   ok = ok &&
+      std::filesystem::exists(content) &&
+      post_upload(cfg, "/a.html", "<p>Other</p>") &&
+      std::filesystem::exists(content) &&
+      post_upload(cfg, "/b.html", "<p>Other</p>") &&
+      !std::filesystem::exists(content);
+
+   if (!ok)
+      std::cout << "Error: dedup_test2" << std::endl;
+   else
+      std::cout << "Success: dedup_test2" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+// Checks the detection of images from their headers and that the
+// metadata survives being stored.
+void metadata_test1()
+{
+   using namespace std::string_literals;
+
+   auto const detect = [](std::string const& data) {
+      object_meta m;
+      detect_image(data, m);
+      return m;
+   };
+
+   // SOI, an APP0 segment and SOF0 of 640x480.
+   auto const jpeg = detect(
+      "\xff\xd8\xff\xe0\x00\x04\x00\x00"
+      "\xff\xc0\x00\x11\x08\x01\xe0\x02\x80"s);
+
+   auto const png = detect("\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR\x00\x00\x01\x00\x00\x00\x00\x20"s);
+   auto const gif = detect("GIF89a\x10\x00\x20\x00"s);
+   auto const text = detect("GIF88a\x10\x00\x20\x00"s);
+
+   auto ok =
+      jpeg.format == image_format::jpeg && jpeg.width == 640 && jpeg.height == 480 &&
+      png.format == image_format::png && png.width == 256 && png.height == 32 &&
+      gif.format == image_format::gif && gif.width == 16 && gif.height == 32 &&
+      text.format == image_format::none &&
+      http_date(784111777) == "Sun, 06 Nov 1994 08:49:37 GMT";
+
+   auto const content = "GIF89a\x10\x00\x20\x00"s;
+   auto meta = make_meta(content, blake2b::hash("x"));
+   meta.encodings = encoding::gzip;
+   auto const bytes = serialize(meta);
+   auto const parsed = parse_meta({bytes.data(), std::size(bytes)});
+
+   ok = ok && parsed &&
+      parsed->size == 10 &&
+      parsed->mtime == meta.mtime &&
+      parsed->format == image_format::gif &&
+      parsed->encodings == encoding::gzip &&
+      make_etag(*parsed, "-gzip") == make_etag(meta, "-gzip") &&
+      std::size(make_etag(meta)) == 18 &&
+      !parse_meta({bytes.data(), std::size(bytes) - 1});
+
+   char path[] = "/tmp/smms-test-XXXXXX";
+   auto const fd = mkstemp(path);
+   if (fd == -1) {
+      std::cout << "Error: metadata_test1 (mkstemp)" << std::endl;
+      return;
+   }
+
+   close(fd);
+
+   // Not every file system has extended attributes.
+   if (write_meta(path, meta)) {
+      auto const read = read_meta(path);
+      ok = ok && read && read->checksum == meta.checksum;
+   }
+
+   if (!ok)
+      std::cout << "Error: metadata_test1" << std::endl;
+   else
+      std::cout << "Success: metadata_test1" << std::endl;
+
+   std::filesystem::remove(path);
+}
+
+// Checks that variants are made in the background, that they
+// decompress to the file and that the cache stays within its size.
+void compression_cache_test1()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: compression_cache_test1 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   std::string data;
+   for (auto i = 0; i < 1000; ++i)
+      data += "<p>Paragraph " + std::to_string(i % 10) + "</p>\n";
+
+   auto const path = [&](int i)
+      { return std::string {dir} + "/" + std::to_string(i) + ".html"; };
+
+   auto const version = [&](int i) {
+      auto const t = std::filesystem::last_write_time(path(i));
+      auto const s = std::chrono::file_clock::to_sys(t);
+      auto const mtime = std::chrono::duration_cast<std::chrono::seconds>(s.time_since_epoch());
+      return compression_cache::version {mtime.count(), std::size(data)};
+   };
+
+   auto ok = true;
+   for (auto i = 0; i < 4; ++i)
+      ok = ok && write_file(path(i).c_str(), data);
+
+   compression_cache cache {4 * std::size(data), 1};
+
+   auto const wait = [&](int i, content_coding c) {
+      for (auto n = 0; n < 100; ++n) {
+	 if (auto v = cache.find(path(i), version(i), c))
+	    return v;
+
+	 std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+
+      return compression_cache::variant {};
+   };
+
+   auto const gz = wait(0, content_coding::gzip);
+   auto const zst = wait(0, content_coding::zstd);
+
+   std::string out(std::size(data), '\0');
+   z_stream zs {};
+   inflateInit2(&zs, 15 + 16);
+   if (gz) {
+      zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(gz->data()));
+      zs.avail_in = std::size(*gz);
+      zs.next_out = reinterpret_cast<Bytef*>(out.data());
+      zs.avail_out = std::size(out);
+      ok = ok && inflate(&zs, Z_FINISH) == Z_STREAM_END && out == data;
+   }
+   inflateEnd(&zs);
+
+   ok = ok && gz && zst && std::size(*gz) < std::size(data) / 10;
+
+   // Larger than a quarter of the cache.
+   auto const large = compression_cache::version {version(0).mtime, 4 * std::size(data)};
+   ok = ok && !cache.find(path(0), large, content_coding::gzip);
+
+   for (auto i = 1; i < 4; ++i)
+      ok = ok && wait(i, content_coding::br);
+
+   ok = ok && cache.size() <= 4 * std::size(data);
+
+   if (!ok)
+      std::cout << "Error: compression_cache_test1" << std::endl;
+   else
+      std::cout << "Success: compression_cache_test1" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+void coding_preference_test1()
+{
+   using c = content_coding;
+
+   auto const codings = [](char const* field) {
+      std::vector<content_coding> ret;
+      for (auto coding : coding_preference {field})
+	 ret.push_back(coding);
+      return ret;
+   };
+
+   using v = std::vector<content_coding>;
+
+   auto const ok =
+      codings("") == v {} &&
+      codings("identity") == v {} &&
+      codings("gzip, deflate, br") == v {c::br, c::gzip} &&
+      codings("gzip;q=1.0, br;q=0.5, zstd") == v {c::zstd, c::gzip, c::br} &&
+      codings("gzip;q=1.0, br;q=0.5, zstd, identity;q=0.1") == v {c::zstd, c::gzip, c::br} &&
+      codings("x-gzip") == v {c::gzip} &&
+      codings("GZIP ; Q=0.3 , *;q=0.2") == v {c::gzip, c::br, c::zstd} &&
+      codings("br;q=0, *") == v {c::zstd, c::gzip} &&
+      codings("gzip;q=0.5, identity") == v {} &&
+      codings("gzip;q=0.5, identity;q=0") == v {c::gzip} &&
+      codings("gzip;q=0.8") == v {c::gzip} &&
+      codings("br;q=0.9, gzip;q=0.8") == v {c::br, c::gzip} &&
+      codings("gzip;q=0.5, *") == v {c::br, c::zstd, c::gzip} &&
+      codings("*;q=0") == v {} &&
+      codings("br;q=2, gzip;q=0.1234, zstd;q=0.001, identity;q=0") == v {c::zstd};
+
+   if (!ok)
+      std::cout << "Error: coding_preference_test1" << std::endl;
+   else
+      std::cout << "Success: coding_preference_test1" << std::endl;
+}
+
+// Checks that the roots get shares of the targets proportional to
+// their weights and that a new root takes its share from the others
+// only, the previous root of a moved target being the second choice.
+// An upload of a gzip_mimes file gets compressed siblings recorded in
+// its metadata, other uploads are left alone. Jobs of content the
+// target doesn't hold write nothing and a new upload removes the
+// siblings of the previous one.
+void upload_pipeline_test1()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: upload_pipeline_test1 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.gzip_mimes = {".html"};
+   cfg.key = make_random_key();
+   cfg.upload_codings = {content_coding::br, content_coding::gzip};
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   std::string const page(10000, 'p');
+
+   auto ok = true;
+   {
+      upload_pipeline pipeline {1};
+      pipeline.add(compression_stage(cfg));
+      cfg.pipeline = &pipeline;
+      ok = post_upload(cfg, "/page.html", page) && post_upload(cfg, "/page.jpg", page);
+   }
+
+   auto const base = std::string {dir} + "/page";
+   auto const meta = read_meta((base + ".html").c_str());
+
+   ok = ok && meta &&
+      meta->encodings == (encoding::br | encoding::gzip) &&
+      std::filesystem::file_size(base + ".html.br") < std::size(page) &&
+      std::filesystem::file_size(base + ".html.gz") < std::size(page) &&
+      !std::filesystem::exists(base + ".html.zst") &&
+      !std::filesystem::exists(base + ".jpg.br");
+
+   std::string const other(20000, 'o');
+   auto const gz_size = std::filesystem::file_size(base + ".html.gz");
+   {
+      upload_pipeline pipeline {1};
+      pipeline.add(compression_stage(cfg));
+      pipeline.post("/page.html", other, blake2b::hash(other));
+   }
+
+   ok = ok && std::filesystem::file_size(base + ".html.gz") == gz_size;
+
+   {
+      // No stage writes the new siblings.
+      upload_pipeline pipeline {1};
+      cfg.pipeline = &pipeline;
+      ok = ok && post_upload(cfg, "/page.html", other);
+      cfg.pipeline = nullptr;
+   }
+
+   auto const replaced = read_meta((base + ".html").c_str());
+   ok = ok && replaced &&
+      replaced->encodings == 0 &&
+      !std::filesystem::exists(base + ".html.br") &&
+      !std::filesystem::exists(base + ".html.gz");
+
+   if (!ok)
+      std::cout << "Error: upload_pipeline_test1" << std::endl;
+   else
+      std::cout << "Success: upload_pipeline_test1" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+// Parses thumbnail rules and makes the thumbnails of a JPEG upload
+// stored next to it, which the next upload removes.
+void thumbnail_test1()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: thumbnail_test1 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   auto const rule = parse_thumbnail_rule("/photos/:100x100,40x30");
+   auto ok = rule &&
+      rule->prefix == "/photos/" &&
+      std::size(rule->sizes) == 2 &&
+      rule->sizes[1].width == 40 && rule->sizes[1].height == 30 &&
+      !parse_thumbnail_rule("photos:10x10") &&
+      !parse_thumbnail_rule("/photos:10x") &&
+      !parse_thumbnail_rule("/photos:0x10") &&
+      !parse_thumbnail_rule("/photos:") &&
+      thumbnail_name("/a/img.jpg", {100, 50}, {}) == "/a/img.100x50.jpg" &&
+      thumbnail_name("/a.b/img", {1, 2}, {}) == "/a.b/img.1x2";
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.thumbnails = {*rule, *parse_thumbnail_rule("/photos/big/:200x200")};
+   cfg.make_file_types();
+
+   ok = ok &&
+      find_thumbnail_rule(cfg.thumbnails, "/photos/big/a.jpg") == &cfg.thumbnails[1] &&
+      find_thumbnail_rule(cfg.thumbnails, "/photos/a.jpg") == &cfg.thumbnails[0] &&
+      !find_thumbnail_rule(cfg.thumbnails, "/other/a.jpg");
+
+   namespace bg = boost::gil;
+   bg::rgb8_image_t img(64, 48);
+   bg::fill_pixels(bg::view(img), bg::rgb8_pixel_t {200, 100, 50});
+   std::ostringstream oss;
+   bg::write_view(oss, bg::const_view(img), bg::jpeg_tag{});
+   auto const jpeg = oss.str();
+
+   // The pipeline processes stored uploads only.
+   auto const photos = std::string {dir} + "/photos/";
+   std::filesystem::create_directory(photos);
+   auto const store = [&](std::string const& name, std::string const& body) {
+      auto const id = blake2b::hash(body);
+      write_file((photos + name).c_str(), body);
+      write_meta((photos + name).c_str(), make_meta(body, id));
+      return id;
+   };
+
+   {
+      upload_pipeline pipeline {1};
+      pipeline.add(thumbnail_stage(cfg));
+      pipeline.post("/photos/a.jpg", jpeg, store("a.jpg", jpeg));
+      pipeline.post("/photos/b.jpg", "not a jpeg", store("b.jpg", "not a jpeg"));
+      pipeline.post("/other/c.jpg", jpeg, blake2b::hash(jpeg));
+   }
+
+   auto const thumb = read_meta((photos + "a.40x30.jpg").c_str());
+
+   ok = ok &&
+      thumb && thumb->format == image_format::jpeg &&
+      thumb->width == 40 && thumb->height == 30 &&
+      std::filesystem::exists(photos + "a.100x100.jpg") &&
+      std::filesystem::exists(photos + "a.100x100.jpg.webp") &&
+      !std::filesystem::exists(photos + "b.40x30.jpg") &&
+      !std::filesystem::exists(std::string {dir} + "/other");
+
+   // A new upload removes the thumbnails of the previous one.
+   cfg.key = make_random_key();
+   cfg.make_responses();
+   ok = ok &&
+      post_upload(cfg, "/photos/a.jpg", "replaced") &&
+      !std::filesystem::exists(photos + "a.40x30.jpg") &&
+      !std::filesystem::exists(photos + "a.100x100.jpg") &&
+      !std::filesystem::exists(photos + "a.100x100.jpg.webp");
+
+   if (!ok)
+      std::cout << "Error: thumbnail_test1" << std::endl;
+   else
+      std::cout << "Success: thumbnail_test1" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+// The sizes of the resize modes, and transforms between JPEG and PNG.
+void image_transform_test1()
+{
+   auto const size_of = [](image_size source, image_size box, resize_mode m) {
+      transform t;
+      t.size = box;
+      t.mode = m;
+      auto const r = output_size(source, t);
+      return std::make_pair(r.width, r.height);
+   };
+
+   using p = std::pair<int, int>;
+   auto ok =
+      size_of({400, 200}, {100, 100}, resize_mode::scale) == p {100, 100} &&
+      size_of({400, 200}, {100, 100}, resize_mode::fit) == p {100, 50} &&
+      size_of({400, 200}, {100, 100}, resize_mode::fill) == p {100, 100} &&
+      size_of({400, 200}, {100, 100}, resize_mode::crop) == p {100, 100} &&
+      size_of({50, 200}, {100, 100}, resize_mode::crop) == p {50, 100} &&
+      size_of({1, 1000}, {100, 100}, resize_mode::fit) == p {1, 100} &&
+      parse_resize_mode("fill") == resize_mode::fill &&
+      !parse_resize_mode("stretch") &&
+      accepts_webp("image/avif,image/webp,*/*") &&
+      accepts_webp("text/html, IMAGE/WEBP ; level=1 ; q=0.5") &&
+      !accepts_webp("image/webp;q=0") &&
+      !accepts_webp("image/*,*/*;q=0.8") &&
+      !accepts_webp("");
+
+   namespace bg = boost::gil;
+   bg::rgb8_image_t img(400, 200);
+   bg::fill_pixels(bg::view(img), bg::rgb8_pixel_t {10, 200, 30});
+   std::ostringstream oss;
+   bg::write_view(oss, bg::const_view(img), bg::jpeg_tag{});
+   auto const jpeg = oss.str();
+
+   // The format and size of the output.
+   auto const run = [](std::string_view in, image_format f, transform const& t) {
+      budget_lease lease;
+      std::pmr::string out;
+      object_meta m;
+      auto const status = transform_image({in.data(), std::size(in)}, f, t, 100000, lease, out);
+      if (status == transform_status::ok)
+	 detect_image(out, m);
+
+      return std::make_tuple(status, m.format, m.width, m.height, std::string {out});
+   };
+
+   transform t;
+   t.size = {100, 100};
+   t.mode = resize_mode::fit;
+   auto const [s1, f1, w1, h1, jpeg_out] = run(jpeg, image_format::jpeg, t);
+
+   t.format = image_format::png;
+   t.mode = resize_mode::fill;
+   auto const [s2, f2, w2, h2, png] = run(jpeg, image_format::jpeg, t);
+
+   t.format = image_format::jpeg;
+   t.mode = resize_mode::crop;
+   auto const [s3, f3, w3, h3, cropped] = run(png, image_format::png, t);
+
+   t.format = image_format::webp;
+   auto const [s7, f7, w7, h7, webp] = run(png, image_format::png, t);
+
+   // Lower quality, smaller output.
+   t.format = image_format::jpeg;
+   t.mode = resize_mode::scale;
+   t.quality = 100;
+   auto const [s4, f4, w4, h4, best] = run(cropped, image_format::jpeg, t);
+   t.quality = 10;
+   auto const [s5, f5, w5, h5, worst] = run(cropped, image_format::jpeg, t);
+
+   // Over the 100000 pixels passed as the limit.
+   bg::rgb8_image_t large(400, 400);
+   oss.str("");
+   bg::write_view(oss, bg::const_view(large), bg::jpeg_tag{});
+   auto const [s6, f6, w6, h6, none] = run(oss.str(), image_format::jpeg, t);
+
+   ok = ok &&
+      s1 == transform_status::ok && f1 == image_format::jpeg && w1 == 100 && h1 == 50 &&
+      s2 == transform_status::ok && f2 == image_format::png && w2 == 100 && h2 == 100 &&
+      s3 == transform_status::ok && f3 == image_format::jpeg && w3 == 100 && h3 == 100 &&
+      s4 == transform_status::ok && s5 == transform_status::ok &&
+      s7 == transform_status::ok && f7 == image_format::webp && w7 == 100 && h7 == 100 &&
+      std::size(worst) < std::size(best) &&
+      s6 == transform_status::too_large;
+
+   if (!ok)
+      std::cout << "Error: image_transform_test1" << std::endl;
+   else
+      std::cout << "Success: image_transform_test1" << std::endl;
+}
+
+void root_set_test1()
+{
+   auto const a = parse_storage_root("/a:1");
+   auto const b = parse_storage_root("/b");
+   auto const c = parse_storage_root("/c:2");
+   auto const d = parse_storage_root("/d:1");
+
+   auto ok = a && b && c && d &&
+      !parse_storage_root("/e:0") &&
+      !parse_storage_root("/e:x") &&
+      !parse_storage_root(":1");
+
+   if (!ok) {
+      std::cout << "Error: root_set_test1" << std::endl;
+      return;
+   }
+
+   root_set const three {{*a, *b, *c}, 0};
+   root_set const four {{*d, *c, *b, *a}, 0};
+
+   constexpr int n = 100000;
+   std::array<int, 3> shares {};
+   int moved = 0;
+   for (auto i = 0; i < n; ++i) {
+      auto const target = "/img/" + std::to_string(i) + ".jpg";
+      auto const before = three.path(three.place(target));
+      auto const after = four.path(four.place(target));
+      ++shares[three.place(target)];
+
+      if (before != after) {
+	 ++moved;
+	 ok = ok && after == "/d" && four.path(four.place(target, 1)) == before;
+      }
+   }
+
+   auto const near = [](int count, double share)
+      { return std::abs(count - share * n) < 0.02 * n; };
+
+   ok = ok &&
+      near(shares[0], 0.25) &&
+      near(shares[1], 0.25) &&
+      near(shares[2], 0.5) &&
+      near(moved, 0.2);
+
+   if (!ok)
+      std::cout << "Error: root_set_test1" << std::endl;
+   else
+      std::cout << "Success: root_set_test1" << std::endl;
+}
+
+std::string from_hex(std::string_view hex)
+{
+   std::string ret;
+   for (std::size_t i = 0; i + 1 < std::size(hex); i += 2)
+      ret += static_cast<char>(std::stoi(std::string {hex.substr(i, 2)}, nullptr, 16));
+   return ret;
+}
+
+// The requests of RFC 7541, C.4, decoded with the same decoder.
+void hpack_test1()
+{
+   char const* blocks[] =
+   { "828684418cf1e3c2e5f23a6ba0ab90f4ff"
+   , "828684be5886a8eb10649cbf"
+   , "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"
+   };
+
+   std::size_t const sizes[] = {57, 110, 164};
+
+   hpack::decoder dec;
+   std::string fields;
+   auto ok = true;
+   for (auto i = 0; i < 3; ++i) {
+      fields.clear();
+      auto f = [&](auto name, auto value) {
+         fields.append(name);
+         fields += ": ";
+         fields.append(value);
+         fields += "\n";
+      };
+
+      ok = ok && dec.decode(from_hex(blocks[i]), f);
+      ok = ok && dec.table_size() == sizes[i];
+   }
+
+   std::string const expected =
+      ":method: GET\n"
+      ":scheme: https\n"
+      ":path: /index.html\n"
+      ":authority: www.example.com\n"
+      "custom-key: custom-value\n";
+
+   std::string out;
+   ok = ok && hpack::huffman_decode(from_hex("f1e3c2e5f23a6ba0ab90f4ff"), out);
+   ok = ok && out == "www.example.com";
+
+   if (!ok || fields != expected)
+      std::cout << "Error: hpack_test1" << std::endl;
+   else
+      std::cout << "Success: hpack_test1" << std::endl;
+}
+
+// A GET of a missing file on stream 1 is answered with a 404.
+void http2_test1()
+{
+   config cfg;
+   cfg.doc_root = "/nonexistent";
+   cfg.host_names = {"localhost"};
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   // :method GET, :scheme http, :path and :authority literals.
+   auto const block =
+      from_hex("8286") + "\x04\x09/nope.txt" + "\x01\x09localhost";
+
+   std::string in {http2::preface};
+   in += from_hex("000000040000000000"); // SETTINGS
+   in += std::string {"\x00\x00", 2} + static_cast<char>(std::size(block));
+   in += from_hex("010500000001"); // HEADERS, END_STREAM | END_HEADERS
+   in += block;
+
+   http2::connection conn {cfg, false};
+   auto const n = conn.on_input(in);
+
+   std::string out;
+   while (conn.has_output()) {
+      auto const b = conn.output();
+      out.append(static_cast<char const*>(b.data()), b.size());
+      conn.on_written();
+   }
+
+   // HEADERS on stream 1 starting with :status 404, index 13.
+   auto const headers = from_hex("0104000000018d");
+   auto const ok =
+      n == std::size(in) &&
+      out.find(headers) != std::string::npos &&
+      out.find("File not found.") != std::string::npos &&
+      conn.active_streams() == 0 &&
+      !conn.closed();
+
+   if (!ok)
+      std::cout << "Error: http2_test1" << std::endl;
+   else
+      std::cout << "Success: http2_test1" << std::endl;
+}
+
+// The peer lowers the initial window size while a response is being
+// sent, the stream window goes negative and no more DATA is sent.
+void http2_test2()
+{
+   char dir[] = "/tmp/smms-test-XXXXXX";
+   if (!mkdtemp(dir)) {
+      std::cout << "Error: http2_test2 (mkdtemp)" << std::endl;
+      return;
+   }
+
+   std::ofstream {std::string {dir} + "/big.txt"} << std::string(100000, 'b');
+
+   config cfg;
+   cfg.doc_root = dir;
+   cfg.host_names = {"localhost"};
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   auto const block =
+      from_hex("8286") + "\x04\x08/big.txt" + "\x01\x09localhost";
+
+   std::string in {http2::preface};
+   in += from_hex("000000040000000000"); // SETTINGS
+   in += std::string {"\x00\x00", 2} + static_cast<char>(std::size(block));
+   in += from_hex("010500000001"); // HEADERS, END_STREAM | END_HEADERS
+   in += block;
+
+   auto const drain = [](http2::connection& conn) {
+      std::string out;
+      while (conn.has_output()) {
+	 auto const b = conn.output();
+	 out.append(static_cast<char const*>(b.data()), b.size());
+	 conn.on_written();
+      }
+      return out;
+   };
+
+   auto ok = false;
+   try {
+      http2::connection conn {cfg, false};
+      conn.on_input(in);
+      auto const before = drain(conn);
+
+      // SETTINGS_INITIAL_WINDOW_SIZE = 0.
+      auto const settings = from_hex("000006040000000000000400000000");
+      auto const n = conn.on_input(settings);
+      auto const after = drain(conn);
+
+      // Only the SETTINGS ACK, no DATA.
+      ok = !std::empty(before) &&
+	 n == std::size(settings) &&
+	 after == from_hex("000000040100000000") &&
+	 conn.active_streams() == 1 &&
+	 !conn.closed();
+   } catch (std::exception const& e) {
+      std::cout << "Error: http2_test2 (" << e.what() << ")" << std::endl;
+      std::filesystem::remove_all(dir);
+      return;
+   }
+
+   if (!ok)
+      std::cout << "Error: http2_test2" << std::endl;
+   else
+      std::cout << "Success: http2_test2" << std::endl;
+
+   std::filesystem::remove_all(dir);
+}
+
+// A small header block that expands past the advertised
+// SETTINGS_MAX_HEADER_LIST_SIZE through the dynamic table resets the
+// stream and keeps the connection.
+void http2_test3()
+{
+   config cfg;
+   cfg.doc_root = "/nonexistent";
+   cfg.host_names = {"localhost"};
+   cfg.make_host_set();
+   cfg.make_file_types();
+   cfg.make_responses();
+
+   // A 4000 bytes field with incremental indexing, then indexed 20
+   // times through index 62.
+   auto block =
+      from_hex("8286") + "\x04\x09/nope.txt" + "\x01\x09localhost";
+   block += from_hex("4001787fa11e") + std::string(4000, 'x');
+   block += std::string(20, '\xbe');
+
+   std::string in {http2::preface};
+   in += from_hex("000000040000000000"); // SETTINGS
+   in += '\x00';
+   in += static_cast<char>(std::size(block) >> 8);
+   in += static_cast<char>(std::size(block));
+   in += from_hex("010500000001"); // HEADERS, END_STREAM | END_HEADERS
+   in += block;
+
+   http2::connection conn {cfg, false};
+   auto const n = conn.on_input(in);
+
+   std::string out;
+   while (conn.has_output()) {
+      auto const b = conn.output();
+      out.append(static_cast<char const*>(b.data()), b.size());
+      conn.on_written();
+   }
+
+   // MAX_HEADER_LIST_SIZE advertised, RST_STREAM ENHANCE_YOUR_CALM.
+   auto const ok =
+      n == std::size(in) &&
+      out.find(from_hex("000600010000")) != std::string::npos &&
+      out.find(from_hex("0000040300000000010000000b")) != std::string::npos &&
+      conn.active_streams() == 0 &&
+      !conn.closed();
+
+   if (!ok)
+      std::cout << "Error: http2_test3" << std::endl;
+   else
+      std::cout << "Success: http2_test3" << std::endl;
+}
+
+void memory_budget_test1()
+{
+   auto& budget = body_budget();
+   budget.set_limit(100);
+
+   auto ok = true;
+   {
+      budget_lease a;
+      budget_lease b;
+      ok = ok && a.resize(60);
+      ok = ok && !b.resize(60);
+      ok = ok && b.resize(40);
+      ok = ok && a.resize(10) && b.resize(90);
+      ok = ok && budget.used() == 100;
+   }
+
+   ok = ok && budget.used() == 0;
+   budget.set_limit(0);
+
+   if (!ok)
+      std::cout << "Error: memory_budget_test1" << std::endl;
+   else
+      std::cout << "Success: memory_budget_test1" << std::endl;
+}
+
+void rate_limiter_test1()
+{
+   using namespace std::chrono_literals;
+
+   rate_limiter::limits l;
+   l.connections = 1;
+   l.burst = 2;
+   l.prefix_factor = 2;
+
+   rate_limiter limiter {l};
+   auto const t0 = rate_limiter::clock_type::now();
+   auto const a = ip::make_address("192.0.2.1");
+   auto const b = ip::make_address("192.0.2.2");
+   auto const c = ip::make_address("::ffff:192.0.2.3");
+   auto const d = ip::make_address("198.51.100.1");
+
+   auto ok =
+      limiter.admit_connection(a, t0) &&
+      limiter.admit_connection(a, t0) &&
+      !limiter.admit_connection(a, t0) &&
+      limiter.admit_connection(b, t0) &&
+      limiter.admit_connection(b, t0) &&
+      !limiter.admit_connection(c, t0) && // The /24 is exhausted.
+      limiter.admit_connection(d, t0) &&
+      limiter.admit_connection(a, t0 + 1s) &&
+      !limiter.admit_connection(a, t0 + 1s);
+
+   l = {};
+   l.bytes = 100;
+   l.burst = 1;
+
+   rate_limiter bytes {l};
+   ok = ok &&
+      bytes.admit_request(a, t0) &&
+      (bytes.charge(a, 250, t0), !bytes.admit_request(a, t0)) &&
+      !bytes.admit_request(a, t0 + 500ms) &&
+      bytes.admit_request(a, t0 + 2s);
+
+   // Between burst and 2 * burst the debt is half paid off, the entry
+   // is kept and not replaced by a full bucket.
+   rate_limiter debt {l};
+   ok = ok &&
+      (debt.charge(a, 250, t0), !debt.admit_request(a, t0)) &&
+      debt.admit_request(a, t0 + 1500ms) &&
+      (debt.charge(a, 80, t0 + 1500ms), !debt.admit_request(a, t0 + 1500ms));
+
+   if (!ok)
+      std::cout << "Error: rate_limiter_test1" << std::endl;
+   else
+      std::cout << "Success: rate_limiter_test1" << std::endl;
+}
+
 void hmac_test1()
 {
    auto const key = make_random_key();
@@ -169,7 +1519,29 @@ int main()
    query_test1();
    query_test2();
    query_test3();
+   field_test1();
+   percent_decode_test1();
+   file_types_test1();
+   host_set_test1();
    parse_dir_test1();
+   cpu_list_test1();
+   allocation_test1();
+   hpack_test1();
+   http2_test1();
+   http2_test2();
+   http2_test3();
+   memory_budget_test1();
+   rate_limiter_test1();
+   volume_store_test1();
+   dedup_test1();
+   dedup_test2();
+   metadata_test1();
+   compression_cache_test1();
+   coding_preference_test1();
+   upload_pipeline_test1();
+   thumbnail_test1();
+   image_transform_test1();
+   root_set_test1();
    hmac_test1();
    hmac_test2();
 }
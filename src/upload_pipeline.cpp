@@ -0,0 +1,83 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "upload_pipeline.hpp"
+
+#include <algorithm>
+
+#include "logger.hpp"
+#include "memory.hpp"
+
+namespace smms
+{
+
+upload_pipeline::upload_pipeline(std::size_t threads)
+: pool_ {threads}
+{ }
+
+upload_pipeline::~upload_pipeline()
+{
+   pool_.join();
+}
+
+void upload_pipeline::add(stage s)
+{
+   stages_.push_back(std::move(s));
+}
+
+void upload_pipeline::run(upload const& u)
+{
+   for (auto const& s : stages_) {
+      if (!s.accepts(u.target))
+	 continue;
+
+      try {
+	 s.process(u);
+      } catch (std::exception const& e) {
+	 log::write(log::level::err, "upload_pipeline: {0}: {1}", u.target, e.what());
+      }
+   }
+}
+
+void
+upload_pipeline::post(
+   string_view target,
+   string_view body,
+   blake2b::digest_type const& id)
+{
+   auto const accepted = std::any_of(
+      std::cbegin(stages_),
+      std::cend(stages_),
+      [&](auto const& s) { return s.accepts(target); });
+
+   if (!accepted)
+      return;
+
+   budget_lease lease;
+   if (!lease.resize(std::size(body))) {
+      log::write(log::level::info, "upload_pipeline: No memory for {0}.", target);
+      return;
+   }
+
+   upload u {std::string {target}, std::string {body}, id};
+   net::post(pool_, [this, u = std::move(u), lease = std::move(lease)]() {
+      run(u);
+   });
+}
+
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "net.hpp"
+#include "types.hpp"
+#include "crypto.hpp"
+
+namespace smms
+{
+
+/* Work done on uploads after they are stored, e.g. writing compressed
+ * siblings, on threads of its own so that the response doesn't wait
+ * for it. The stages that accept the target of an upload run in the
+ * order they were added, on a copy of the body taken from the body
+ * budget. Uploads are dropped when the budget is exhausted, the
+ * pipeline is an optimization and the upload is served without it.
+ * The target may be overwritten while its upload is processed, stages
+ * compare the id with what it holds, see store_derived.
+ */
+class upload_pipeline {
+public:
+   struct upload {
+      std::string target;
+      std::string body;
+
+      // The hash of the body.
+      blake2b::digest_type id;
+   };
+
+   struct stage {
+      // Whether the stage processes uploads to the target.
+      std::function<bool(string_view)> accepts;
+      std::function<void(upload const&)> process;
+   };
+
+private:
+   std::vector<stage> stages_;
+   net::thread_pool pool_;
+
+   void run(upload const& u);
+
+public:
+   explicit upload_pipeline(std::size_t threads);
+
+   // Waits for the uploads being processed.
+   ~upload_pipeline();
+
+   upload_pipeline(upload_pipeline const&) = delete;
+   upload_pipeline& operator=(upload_pipeline const&) = delete;
+
+   // Stages are added before the first post.
+   void add(stage s);
+
+   auto empty() const noexcept { return std::empty(stages_); }
+
+   // Queues the upload if a stage accepts its target.
+   void post(string_view target, string_view body, blake2b::digest_type const& id);
+};
+
+}
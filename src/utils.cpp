@@ -18,10 +18,18 @@
 
 #include "utils.hpp"
 
+#include <atomic>
+#include <string>
 #include <algorithm>
+#include <charconv>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -50,37 +58,185 @@ void create_dir(const char *dir)
    mkdir(tmp, 0777);
 }
 
-std::vector<std::string>
-parse_query(std::string const& in)
+unique_fd& unique_fd::operator=(unique_fd&& other) noexcept
 {
-   static char seps[2] = {'=', '&'};
+   if (this != &other) {
+      if (fd_ != -1)
+	 close(fd_);
+      fd_ = other.release();
+   }
+
+   return *this;
+}
+
+unique_fd::~unique_fd()
+{
+   if (fd_ != -1)
+      close(fd_);
+}
 
-   std::vector<std::string> ret;
+unique_fd open_file(char const* path, std::size_t& size)
+{
+   unique_fd fd {open(path, O_RDONLY | O_CLOEXEC)};
+   if (!fd)
+      return fd;
 
-   auto const size = std::ssize(in);
-   auto a = 0;
-   auto b = 1;
-   auto last = 0;
-   for (auto i = 0; i < size; ++i) {
-      if (in[i] == seps[b])
-	 return {};
+   struct stat st;
+   if (fstat(fd.get(), &st) == -1 || !S_ISREG(st.st_mode))
+      return unique_fd {};
 
-      if (in[i] == seps[a]) {
-	 std::swap(a, b);
-	 ret.push_back(in.substr(last, i - last));
-	 last = i + 1;
-      }
+   size = st.st_size;
+   return fd;
+}
+
+bool
+read_file(
+   int fd,
+   std::size_t size,
+   std::pmr::string& out,
+   std::size_t offset)
+{
+   out.resize(size);
+   std::size_t n = 0;
+   while (n < size) {
+      auto const r = pread(fd, out.data() + n, size - n, offset + n);
+      if (r == -1 && errno == EINTR)
+	 continue;
+
+      if (r <= 0)
+	 break;
+
+      n += r;
    }
 
-   if (last < std::ssize(in))
-      ret.push_back(in.substr(last));
+   out.resize(n);
+   return n == size;
+}
 
-   if ((std::size(ret) & 1) != 0)
-      return {};
+bool read_file(char const* path, std::pmr::string& out)
+{
+   std::size_t size = 0;
+   auto const fd = open_file(path, size);
+   if (!fd)
+      return false;
 
+   // Also false when the file shrinks while it is read.
+   return read_file(fd.get(), size, out);
+}
+
+namespace {
+
+// A name next to the path that no other writer uses.
+std::string temporary_name(char const* path)
+{
+   static std::atomic<std::uint64_t> counter {0};
+
+   std::string ret {path};
+   ret += ".tmp.";
+   ret += std::to_string(getpid());
+   ret += ".";
+   ret += std::to_string(counter++);
    return ret;
 }
 
+}
+
+bool write_file(char const* path, string_view data)
+{
+   // The file is written aside and renamed over the path, readers
+   // never see it partially written and other links to the file it
+   // replaces keep their content.
+   auto const tmp = temporary_name(path);
+   auto const fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+   if (fd == -1)
+      return false;
+
+   std::size_t n = 0;
+   while (n < std::size(data)) {
+      auto const r = write(fd, data.data() + n, std::size(data) - n);
+      if (r == -1 && errno == EINTR)
+	 continue;
+
+      if (r == -1) {
+	 close(fd);
+	 unlink(tmp.c_str());
+	 return false;
+      }
+
+      n += r;
+   }
+
+   if (close(fd) != 0 || rename(tmp.c_str(), path) != 0) {
+      unlink(tmp.c_str());
+      return false;
+   }
+
+   return true;
+}
+
+bool link_file(char const* from, char const* to)
+{
+   auto const tmp = temporary_name(to);
+   if (link(from, tmp.c_str()) == -1)
+      return false;
+
+   auto const ok = rename(tmp.c_str(), to) == 0;
+
+   // Renaming does nothing if both are links to the same file.
+   unlink(tmp.c_str());
+   return ok;
+}
+
+bool file_exists(char const* path) noexcept
+{
+   return access(path, F_OK) == 0;
+}
+
+query_view::query_view(string_view query) noexcept
+{
+   // Keys and values must alternate, i.e. every pair contains exactly
+   // one '='. A trailing '&' is accepted but the last value must not
+   // be empty.
+   auto in_key = true;
+   for (auto c : query) {
+      if (c == '=') {
+	 if (!in_key)
+	    return;
+	 in_key = false;
+      } else if (c == '&') {
+	 if (in_key)
+	    return;
+	 in_key = true;
+      }
+   }
+
+   if (in_key && !std::empty(query) && query.back() != '&')
+      return;
+
+   if (!in_key && query.back() == '=')
+      return;
+
+   query_ = query;
+}
+
+void query_view::iterator::next() noexcept
+{
+   if (std::empty(rest_)) {
+      field_ = {};
+      return;
+   }
+
+   auto const amp = rest_.find('&');
+   auto const pair = rest_.substr(0, amp);
+   auto const eq = pair.find('=');
+   field_ = {pair.substr(0, eq), pair.substr(eq + 1)};
+
+   if (amp == string_view::npos)
+      rest_ = {};
+   else
+      rest_ = rest_.substr(amp + 1);
+}
+
 string_view make_extension(string_view path)
 {
   auto const pos = path.rfind(".");
@@ -109,41 +265,211 @@ split_from_query(string_view path)
   return {first, second};
 }
 
-std::string parse_dir(std::string const& target)
+string_view parse_dir(string_view target)
 {
    auto const pos = target.rfind('/');
-   if (pos == std::string::npos)
+   if (pos == string_view::npos)
       return {};
 
    return target.substr(0, pos);
 }
 
-std::string
+string_view
 get_field_value(
-   std::vector<std::string> const& queries,
-   std::string const& field)
+   query_view const& queries,
+   string_view field)
 {
    auto match =
-      std::find(
+      std::find_if(
 	 std::cbegin(queries),
 	 std::cend(queries),
-	 field);
+	 [&](auto const& e) { return e.key == field; });
 
-   auto const end = std::cend(queries);
-   if (match != end && match != std::prev(end))
-      return *++match;
+   if (match != std::cend(queries))
+      return match->value;
 
    return {};
 }
 
-int stoi_nothrow(std::string const& s, error_code& ec)
+namespace {
+
+int from_hex(char c) noexcept
+{
+   if (c >= '0' && c <= '9') return c - '0';
+   if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+   return -1;
+}
+
+}
+
+string_view percent_decode(string_view in, std::string& buffer)
 {
-   try {
-      return std::stoi(s);
-   } catch (...) {
+   auto const escaped = [](auto c) { return c == '%' || c == '+'; };
+   if (std::none_of(std::cbegin(in), std::cend(in), escaped))
+      return in;
+
+   buffer.clear();
+   auto const size = std::size(in);
+   for (std::size_t i = 0; i < size; ++i) {
+      if (in[i] == '+') {
+	 buffer.push_back(' ');
+      } else if (in[i] == '%') {
+	 if (i + 2 >= size)
+	    return {};
+
+	 auto const hi = from_hex(in[i + 1]);
+	 auto const lo = from_hex(in[i + 2]);
+	 if (hi == -1 || lo == -1)
+	    return {};
+
+	 buffer.push_back(static_cast<char>(16 * hi + lo));
+	 i += 2;
+      } else {
+	 buffer.push_back(in[i]);
+      }
+   }
+
+   return buffer;
+}
+
+namespace {
+
+char to_lower(char c) noexcept
+{
+   return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+}
+
+std::size_t host_set::hash::operator()(std::string_view s) const noexcept
+{
+   std::size_t h = 14695981039346656037u;
+   for (auto c : s) {
+      h ^= static_cast<unsigned char>(to_lower(c));
+      h *= 1099511628211u;
+   }
+   return h;
+}
+
+bool
+host_set::equal::operator()(
+   std::string_view a,
+   std::string_view b) const noexcept
+{
+   auto f = [](auto x, auto y) { return to_lower(x) == to_lower(y); };
+   return std::equal(std::cbegin(a), std::cend(a),
+                     std::cbegin(b), std::cend(b), f);
+}
+
+host_set::host_set(std::vector<std::string> const& names)
+{
+   for (auto const& name : names) {
+      if (name.starts_with("*."))
+	 wildcards_.insert(name.substr(1));
+      else
+	 names_.insert(name);
+   }
+}
+
+bool host_set::match(string_view host) const noexcept
+{
+   std::string_view const h {host.data(), std::size(host)};
+
+   if (names_.find(h) != std::end(names_))
+      return true;
+
+   if (std::empty(wildcards_))
+      return false;
+
+   // Tries the suffixes starting at each dot, except for a leading
+   // one, i.e. "a.b.c" is looked up as ".b.c" and ".c".
+   for (std::size_t i = 1; i < std::size(h); ++i) {
+      if (h[i] == '.' && wildcards_.find(h.substr(i)) != std::end(wildcards_))
+	 return true;
+   }
+
+   return false;
+}
+
+int stoi_nothrow(string_view s, error_code& ec)
+{
+   int ret = 0;
+   auto const end = s.data() + std::size(s);
+   auto const r = std::from_chars(s.data(), end, ret);
+   if (r.ec != std::errc{} || r.ptr != end) {
       ec = error_code::invalid;
       return {};
    }
+
+   return ret;
+}
+
+int parse_qvalue(string_view s) noexcept
+{
+   if (std::empty(s) || std::size(s) > 5 || (s[0] != '0' && s[0] != '1'))
+      return -1;
+
+   auto ret = (s[0] - '0') * 1000;
+   if (std::size(s) == 1)
+      return ret;
+
+   if (s[1] != '.')
+      return -1;
+
+   auto scale = 100;
+   for (auto c : s.substr(2)) {
+      if (c < '0' || c > '9')
+	 return -1;
+
+      ret += (c - '0') * scale;
+      scale /= 10;
+   }
+
+   return ret > 1000 ? -1 : ret;
+}
+
+string_view trim_whitespace(string_view s) noexcept
+{
+   while (!std::empty(s) && (s.front() == ' ' || s.front() == '\t'))
+      s.remove_prefix(1);
+
+   while (!std::empty(s) && (s.back() == ' ' || s.back() == '\t'))
+      s.remove_suffix(1);
+
+   return s;
+}
+
+std::vector<int> parse_cpu_list(string_view s)
+{
+   std::vector<int> ret;
+   while (!std::empty(s)) {
+      auto const comma = s.find(',');
+      auto const item = s.substr(0, comma);
+      s = comma == string_view::npos ? string_view {} : s.substr(comma + 1);
+
+      auto const dash = item.find('-');
+      auto ec = error_code::ok;
+      auto const first = stoi_nothrow(item.substr(0, dash), ec);
+      auto const last =
+         dash == string_view::npos ? first : stoi_nothrow(item.substr(dash + 1), ec);
+
+      if (ec != error_code::ok || first < 0 || last < first || last >= CPU_SETSIZE)
+         return {};
+
+      for (auto cpu = first; cpu <= last; ++cpu)
+         ret.push_back(cpu);
+   }
+
+   return ret;
+}
+
+bool pin_thread(int cpu) noexcept
+{
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
 }
 
 } // smms
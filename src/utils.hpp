@@ -18,8 +18,12 @@
 
 #pragma once
 
-#include <vector>
 #include <string>
+#include <vector>
+#include <iterator>
+#include <string_view>
+#include <memory_resource>
+#include <unordered_set>
 
 #include "types.hpp"
 
@@ -28,8 +32,105 @@ namespace smms
 
 void create_dir(const char *dir);
 
-std::vector<std::string>
-parse_query(std::string const& in);
+// Owns a file descriptor and closes it on destruction.
+class unique_fd {
+private:
+   int fd_ = -1;
+
+public:
+   unique_fd() = default;
+   explicit unique_fd(int fd) noexcept : fd_ {fd} { }
+   unique_fd(unique_fd&& other) noexcept : fd_ {other.release()} { }
+   unique_fd& operator=(unique_fd&& other) noexcept;
+   ~unique_fd();
+
+   int get() const noexcept { return fd_; }
+   int release() noexcept { auto const fd = fd_; fd_ = -1; return fd; }
+   explicit operator bool() const noexcept { return fd_ != -1; }
+};
+
+// Opens a regular file for reading and stores its size. The
+// descriptor is empty if the file can't be opened or is not a
+// regular file.
+unique_fd open_file(char const* path, std::size_t& size);
+
+// Reads size bytes of the file from offset on into out. Returns false
+// on a read error or if the file is shorter than offset + size.
+bool
+read_file(
+   int fd,
+   std::size_t size,
+   std::pmr::string& out,
+   std::size_t offset = 0);
+
+// Reads the whole file into out. Returns false if it can't be opened
+// or fewer bytes than its size were read.
+bool read_file(char const* path, std::pmr::string& out);
+
+// Creates or replaces the file with one that contains data. Returns
+// false on failure.
+bool write_file(char const* path, string_view data);
+
+// Makes to a hard link to from, replacing what was there. Returns
+// false on failure.
+bool link_file(char const* from, char const* to);
+
+bool file_exists(char const* path) noexcept;
+
+/* A non-owning view over a query string in the form
+ *
+ *    f1=v1&f2=v2&...
+ *
+ * Iterating over it yields key/value pairs that point into the
+ * original string, no allocations are performed. Malformed queries
+ * result in an empty view.
+ */
+class query_view {
+public:
+   struct field {
+      string_view key;
+      string_view value;
+   };
+
+   class iterator {
+   private:
+      string_view rest_;
+      field field_;
+
+      void next() noexcept;
+
+   public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = field;
+      using difference_type = std::ptrdiff_t;
+      using pointer = field const*;
+      using reference = field const&;
+
+      iterator() = default;
+      explicit iterator(string_view query) noexcept
+      : rest_ {query}
+      { next(); }
+
+      reference operator*() const noexcept { return field_; }
+      pointer operator->() const noexcept { return &field_; }
+      iterator& operator++() noexcept { next(); return *this; }
+      iterator operator++(int) noexcept
+         { auto tmp = *this; next(); return tmp; }
+
+      friend bool operator==(iterator const& a, iterator const& b) noexcept
+         { return a.field_.key.data() == b.field_.key.data(); }
+   };
+
+   query_view() = default;
+   explicit query_view(string_view query) noexcept;
+
+   auto begin() const noexcept { return iterator {query_}; }
+   auto end() const noexcept { return iterator {}; }
+   auto empty() const noexcept { return std::empty(query_); }
+
+private:
+   string_view query_;
+};
 
 string_view make_extension(string_view path);
 
@@ -53,18 +154,73 @@ std::pair<string_view, string_view> split_from_query(string_view path);
  *
  * NOTE: The target is assumed to contain no queries.
  */
-std::string parse_dir(std::string const& target);
+string_view parse_dir(string_view target);
 
-std::string
+// Returns the value of the first occurrence of field in the query or
+// an empty view if there is none. The value is not decoded.
+string_view
 get_field_value(
-   std::vector<std::string> const& queries,
-   std::string const& field);
+   query_view const& queries,
+   string_view field);
+
+// Decodes percent-encoded characters and '+' in in. If in contains
+// nothing to decode it is returned unchanged, otherwise the decoded
+// string is written to buffer and a view to it is returned. Returns
+// an empty view on malformed escape sequences.
+string_view percent_decode(string_view in, std::string& buffer);
+
+/* A set of host names as they appear in the Host header, e.g.
+ * "example.com" or "example.com:8080", compared case insensitively.
+ * Names in the form "*.example.com" match any subdomain of
+ * example.com but not example.com itself. Lookups do not allocate.
+ */
+class host_set {
+private:
+   struct hash {
+      using is_transparent = void;
+      std::size_t operator()(std::string_view s) const noexcept;
+   };
+
+   struct equal {
+      using is_transparent = void;
+      bool operator()(std::string_view a, std::string_view b) const noexcept;
+   };
+
+   using set_type = std::unordered_set<std::string, hash, equal>;
+
+   set_type names_;
+
+   // Wildcards are stored without the leading '*', e.g. ".example.com".
+   set_type wildcards_;
+
+public:
+   host_set() = default;
+   explicit host_set(std::vector<std::string> const& names);
+
+   bool match(string_view host) const noexcept;
+};
 
 enum class error_code
 { ok = 0
 , invalid
 };
 
-int stoi_nothrow(std::string const& s, error_code& ec);
+int stoi_nothrow(string_view s, error_code& ec);
+
+// A q-value of an Accept field in thousandths, -1 if invalid, see RFC
+// 9110, 12.4.2.
+int parse_qvalue(string_view s) noexcept;
+
+// Without the spaces and tabs around it.
+string_view trim_whitespace(string_view s) noexcept;
+
+// Parses a list of CPUs in the format of cpuset(7), e.g. "0-3,8".
+// Returns an empty list on malformed input.
+std::vector<int> parse_cpu_list(string_view s);
+
+// Pins the calling thread to the CPU. Memory the thread touches first
+// is then allocated on the NUMA node of the CPU. Returns false on
+// failure.
+bool pin_thread(int cpu) noexcept;
 
 } // smms
@@ -0,0 +1,472 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "volume_store.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fmt/format.h>
+#include <sodium.h>
+
+#include "logger.hpp"
+
+namespace smms
+{
+
+namespace {
+
+constexpr char index_magic[8] = {'s', 'm', 'm', 's', 'i', 'd', 'x', '2'};
+constexpr std::uint32_t object_magic = 0x736d6d73;
+constexpr std::uint64_t initial_capacity = 1 << 16;
+
+using key_type = std::array<unsigned char, 16>;
+
+// Precedes every object in its volume.
+struct object_header {
+   std::uint32_t magic;
+   std::uint32_t target_size;
+   std::uint64_t size;
+};
+
+[[noreturn]] void fail(char const* what)
+{
+   throw std::runtime_error
+      {fmt::format("volume_store: {0}: {1}", what, std::strerror(errno))};
+}
+
+key_type make_key(string_view target) noexcept
+{
+   key_type key;
+   crypto_generichash(
+      key.data(),
+      std::size(key),
+      reinterpret_cast<unsigned char const*>(target.data()),
+      std::size(target),
+      nullptr,
+      0);
+
+   // Zero marks the empty slots.
+   if (key == key_type {})
+      key[0] = 1;
+
+   return key;
+}
+
+// Of the slot that counts the targets sharing the object at the
+// location. Keys of targets hash strings that start with a '/'.
+key_type location_key(std::uint32_t volume, std::uint64_t offset) noexcept
+{
+   unsigned char in[1 + sizeof volume + sizeof offset] = {'@'};
+   std::memcpy(in + 1, &volume, sizeof volume);
+   std::memcpy(in + 1 + sizeof volume, &offset, sizeof offset);
+
+   key_type key;
+   crypto_generichash(key.data(), std::size(key), in, sizeof in, nullptr, 0);
+   if (key == key_type {})
+      key[0] = 1;
+
+   return key;
+}
+
+std::uint64_t bucket(key_type const& key) noexcept
+{
+   std::uint64_t ret;
+   std::memcpy(&ret, key.data(), sizeof ret);
+   return ret;
+}
+
+bool pwrite_all(int fd, iovec* iov, int n, std::uint64_t offset) noexcept
+{
+   while (n != 0) {
+      auto r = ::pwritev(fd, iov, n, offset);
+      if (r == -1 && errno == EINTR)
+	 continue;
+
+      if (r <= 0)
+	 return false;
+
+      offset += r;
+      for (; n != 0 && static_cast<std::size_t>(r) >= iov->iov_len; ++iov, --n)
+	 r -= iov->iov_len;
+
+      if (n != 0) {
+	 iov->iov_base = static_cast<char*>(iov->iov_base) + r;
+	 iov->iov_len -= r;
+      }
+   }
+
+   return true;
+}
+
+}
+
+struct volume_store::header {
+   char magic[8];
+   std::uint64_t capacity;
+   std::uint64_t count;
+
+   // The volume being appended to and its end.
+   std::uint32_t volume;
+
+   // Slots of removed targets, they are counted in count too.
+   std::uint32_t removed;
+   std::uint64_t tail;
+
+   // Bytes of objects no target refers to anymore, see release.
+   std::uint64_t dead;
+};
+
+struct volume_store::slot {
+   key_type key;
+   std::uint32_t volume;
+
+   // Not zero if the target was removed. The key stays so that
+   // probes go on past the slot.
+   std::uint32_t removed;
+
+   // Of the data, after the object header and the target.
+   std::uint64_t offset;
+   std::uint64_t size;
+
+   // Of the targets sharing the object, in the slot of its location.
+   std::uint64_t links;
+};
+
+namespace {
+
+template <class Slot>
+Slot* probe(Slot* slots, std::uint64_t capacity, key_type const& key) noexcept
+{
+   auto const mask = capacity - 1;
+   auto i = bucket(key) & mask;
+   while (slots[i].key != key_type {} && slots[i].key != key)
+      i = (i + 1) & mask;
+
+   return &slots[i];
+}
+
+}
+
+volume_store::volume_store(std::string dir, std::uint64_t volume_size)
+: dir_ {std::move(dir)}
+, volume_size_ {volume_size}
+{
+   create_dir(dir_.c_str());
+
+   auto const path = dir_ + "/index";
+   unique_fd fd {::open(path.c_str(), O_RDWR | O_CLOEXEC)};
+   if (!fd) {
+      if (errno != ENOENT)
+	 fail("open index");
+
+      // The volume first, an index always refers to existing volumes.
+      open_volume(0, volume_size_);
+      create_index(initial_capacity);
+      return;
+   }
+
+   struct stat st;
+   if (::fstat(fd.get(), &st) == -1)
+      fail("stat index");
+
+   map_size_ = st.st_size;
+   map_ = ::mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+   if (map_ == MAP_FAILED) {
+      map_ = nullptr;
+      fail("mmap index");
+   }
+
+   index_fd_ = std::move(fd);
+
+   auto const& h = get_header();
+   auto const valid =
+      map_size_ >= sizeof(header) &&
+      std::memcmp(h.magic, index_magic, sizeof index_magic) == 0 &&
+      map_size_ == sizeof(header) + h.capacity * sizeof(slot);
+
+   if (!valid) {
+      ::munmap(map_, map_size_);
+      map_ = nullptr;
+      throw std::runtime_error {"volume_store: invalid index in " + dir_};
+   }
+
+   for (std::uint32_t i = 0; i <= h.volume; ++i)
+      open_volume(i, 0);
+}
+
+volume_store::~volume_store()
+{
+   if (map_)
+      ::munmap(map_, map_size_);
+}
+
+volume_store::header& volume_store::get_header() const noexcept
+{
+   return *static_cast<header*>(map_);
+}
+
+volume_store::slot* volume_store::slots() const noexcept
+{
+   return reinterpret_cast<slot*>(static_cast<char*>(map_) + sizeof(header));
+}
+
+volume_store::slot const*
+volume_store::lookup(string_view target) const noexcept
+{
+   auto const* s = probe(slots(), get_header().capacity, make_key(target));
+   return s->key == key_type {} || s->removed ? nullptr : s;
+}
+
+std::string volume_store::volume_path(std::uint32_t i) const
+{
+   return fmt::format("{0}/{1:08}.vol", dir_, i);
+}
+
+void volume_store::open_volume(std::uint32_t i, std::uint64_t size)
+{
+   // Volumes are only created with a size, existing ones must be
+   // there.
+   auto const flags = O_RDWR | O_CLOEXEC | (size != 0 ? O_CREAT : 0);
+   unique_fd fd {::open(volume_path(i).c_str(), flags, 0666)};
+   if (!fd)
+      fail("open volume");
+
+   if (size != 0) {
+      auto const r = ::posix_fallocate(fd.get(), 0, size);
+      if (r != 0) {
+	 errno = r;
+	 fail("fallocate volume");
+      }
+   }
+
+   struct stat st;
+   if (::fstat(fd.get(), &st) == -1)
+      fail("stat volume");
+
+   volume_end_ = st.st_size;
+   volumes_.push_back(std::move(fd));
+}
+
+void volume_store::create_index(std::uint64_t capacity)
+{
+   // Filled in a temporary file that replaces the index atomically.
+   auto const tmp = dir_ + "/index.tmp";
+   unique_fd fd {::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)};
+   if (!fd)
+      fail("create index");
+
+   auto const size = sizeof(header) + capacity * sizeof(slot);
+   if (::ftruncate(fd.get(), size) == -1)
+      fail("truncate index");
+
+   auto* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+   if (p == MAP_FAILED)
+      fail("mmap index");
+
+   auto& h = *static_cast<header*>(p);
+   if (map_) {
+      h = get_header();
+
+      auto* const to = reinterpret_cast<slot*>(static_cast<char*>(p) + sizeof(header));
+      auto const* const from = slots();
+      for (std::uint64_t i = 0; i < h.capacity; ++i) {
+	 if (from[i].key != key_type {} && !from[i].removed)
+	    *probe(to, capacity, from[i].key) = from[i];
+      }
+
+      h.count -= h.removed;
+      h.removed = 0;
+   } else {
+      std::memcpy(h.magic, index_magic, sizeof index_magic);
+   }
+
+   h.capacity = capacity;
+
+   if (::rename(tmp.c_str(), (dir_ + "/index").c_str()) == -1) {
+      ::munmap(p, size);
+      fail("rename index");
+   }
+
+   if (map_)
+      ::munmap(map_, map_size_);
+
+   map_ = p;
+   map_size_ = size;
+   index_fd_ = std::move(fd);
+}
+
+void volume_store::insert(slot const& s)
+{
+   if (4 * (get_header().count + 1) > 3 * get_header().capacity)
+      create_index(2 * get_header().capacity);
+
+   auto& h = get_header();
+   auto* p = probe(slots(), h.capacity, s.key);
+   if (p->key == key_type {})
+      ++h.count;
+   else if (p->removed)
+      --h.removed;
+
+   *p = s;
+}
+
+void volume_store::release(slot const& s) noexcept
+{
+   // Objects without a location slot belong to their target alone.
+   auto& h = get_header();
+   auto* l = probe(slots(), h.capacity, location_key(s.volume, s.offset));
+   if (l->key == key_type {} || --l->links == 0)
+      h.dead += s.size;
+}
+
+bool
+volume_store::put(
+   string_view target,
+   string_view data,
+   blake2b::digest_type const* id)
+{
+   object_header oh {object_magic, static_cast<std::uint32_t>(std::size(target)), std::size(data)};
+
+   // Objects start at multiples of 8.
+   auto const n = (sizeof oh + std::size(target) + std::size(data) + 7) & ~std::uint64_t {7};
+   auto const key = make_key(target);
+
+   // Contents are keyed by their hash like targets, the two don't
+   // collide.
+   key_type content_key {};
+   if (id) {
+      std::memcpy(content_key.data(), id->data(), std::size(content_key));
+      if (content_key == key_type {})
+	 content_key[0] = 1;
+   }
+
+   int fd = -1;
+   std::uint32_t volume = 0;
+   std::uint64_t offset = 0;
+
+   try {
+      std::unique_lock lock {mutex_};
+      if (id) {
+	 auto const* s = probe(slots(), get_header().capacity, content_key);
+	 if (s->key == content_key && s->size == std::size(data)) {
+	    auto const link = *s;
+	    if (auto const* old = lookup(target))
+	       release(*old);
+
+	    // Content whose targets were all gone is alive again.
+	    auto& h = get_header();
+	    auto* l = probe(slots(), h.capacity, location_key(link.volume, link.offset));
+	    if (l->links++ == 0)
+	       h.dead -= link.size;
+
+	    insert({key, link.volume, 0, link.offset, link.size, 0});
+	    return true;
+	 }
+      }
+
+      auto& h = get_header();
+      if (h.tail + n > volume_end_) {
+	 open_volume(h.volume + 1, std::max(volume_size_, n));
+	 ++h.volume;
+	 h.tail = 0;
+      }
+
+      // The space is reserved, the object is written without the lock.
+      volume = h.volume;
+      offset = h.tail;
+      fd = volumes_[volume].get();
+      h.tail += n;
+   } catch (std::exception const& e) {
+      log::write(log::level::err, "{0}", e.what());
+      return false;
+   }
+
+   iovec iov[] =
+   { {&oh, sizeof oh}
+   , {const_cast<char*>(target.data()), std::size(target)}
+   , {const_cast<char*>(data.data()), std::size(data)}};
+
+   if (!pwrite_all(fd, iov, std::empty(data) ? 2 : 3, offset))
+      return false;
+
+   try {
+      std::unique_lock lock {mutex_};
+      if (auto const* old = lookup(target))
+	 release(*old);
+
+      auto const data_offset = offset + sizeof oh + std::size(target);
+      insert({key, volume, 0, data_offset, std::size(data), 0});
+      if (id) {
+	 insert({content_key, volume, 0, data_offset, std::size(data), 0});
+	 insert({location_key(volume, data_offset), volume, 0, data_offset, std::size(data), 1});
+      }
+   } catch (std::exception const& e) {
+      log::write(log::level::err, "{0}", e.what());
+      return false;
+   }
+
+   return true;
+}
+
+std::optional<volume_store::object> volume_store::find(string_view target) const
+{
+   std::shared_lock lock {mutex_};
+   auto const* s = lookup(target);
+   if (!s)
+      return {};
+
+   return object {volumes_[s->volume].get(), s->offset, s->size};
+}
+
+bool volume_store::remove(string_view target)
+{
+   std::unique_lock lock {mutex_};
+   auto* s = probe(slots(), get_header().capacity, make_key(target));
+   if (s->key == key_type {} || s->removed)
+      return false;
+
+   s->removed = 1;
+   ++get_header().removed;
+   release(*s);
+   return true;
+}
+
+std::size_t volume_store::size() const
+{
+   std::shared_lock lock {mutex_};
+   auto const& h = get_header();
+   return h.count - h.removed;
+}
+
+std::uint64_t volume_store::dead_bytes() const
+{
+   std::shared_lock lock {mutex_};
+   return get_header().dead;
+}
+
+}
@@ -0,0 +1,130 @@
+/* Copyright (c) 2018-2021 Marcelo Zimbres Silva (mzimbres at gmail dot com)
+ *
+ * This file is part of smms.
+ *
+ * smms is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * smms is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smms.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+
+#include "types.hpp"
+#include "utils.hpp"
+#include "crypto.hpp"
+
+namespace smms
+{
+
+/* Stores objects, i.e. the uploaded files, appended to large
+ * preallocated volume files instead of one file each. Small files
+ * then cost no inode, directory entry or metadata I/O of their own
+ * and reads do no path walk.
+ *
+ * The index maps a 128 bit BLAKE2b hash of the target to the volume,
+ * offset and size of the object. It is an open addressing table in a
+ * file that is mapped into memory, so lookups only read the mapping
+ * and the object is then read or sent from the volume with a single
+ * pread or sendfile. Inserts write to the mapping, the kernel writes
+ * it back. The table is rebuilt in a file of twice the capacity when
+ * it gets three quarters full.
+ *
+ * Each object is preceded in its volume by a small header and its
+ * target, so that volumes describe themselves. The space of objects
+ * that are overwritten or removed is not reclaimed, it is counted so
+ * that a compaction can tell when it pays off.
+ *
+ * Objects put with the hash of their content are deduplicated, the
+ * index then also maps the content to its location and the targets
+ * of the same content share it. A slot of the location counts them,
+ * the object is dead once none is left.
+ */
+class volume_store {
+public:
+   struct object {
+      // Borrowed, it lives as long as the store.
+      int fd;
+      std::uint64_t offset;
+      std::uint64_t size;
+   };
+
+private:
+   struct header;
+   struct slot;
+
+   std::string dir_;
+   std::uint64_t volume_size_;
+
+   mutable std::shared_mutex mutex_;
+   unique_fd index_fd_;
+   void* map_ = nullptr;
+   std::size_t map_size_ = 0;
+   std::vector<unique_fd> volumes_;
+
+   // Size of the volume being appended to.
+   std::uint64_t volume_end_ = 0;
+
+   header& get_header() const noexcept;
+   slot* slots() const noexcept;
+   slot const* lookup(string_view target) const noexcept;
+   void insert(slot const& s);
+
+   // Drops the reference of the slot of a target to its object.
+   void release(slot const& s) noexcept;
+   std::string volume_path(std::uint32_t i) const;
+   void open_volume(std::uint32_t i, std::uint64_t size);
+
+   // Replaces the index by one of the capacity with the same content.
+   void create_index(std::uint64_t capacity);
+
+public:
+   // Opens the store in the directory or creates it. Volumes are
+   // preallocated with volume_size bytes, larger objects get a volume
+   // of their own size. Throws std::runtime_error on failure.
+   volume_store(std::string dir, std::uint64_t volume_size);
+   ~volume_store();
+
+   volume_store(volume_store const&) = delete;
+   volume_store& operator=(volume_store const&) = delete;
+
+   // Stores data under target, replacing what it held before. The
+   // data is only written if no content with the same id is stored.
+   // Returns false on a write error.
+   bool
+   put(
+      string_view target,
+      string_view data,
+      blake2b::digest_type const* id = nullptr);
+
+   // Where the object of target is stored, if anywhere.
+   std::optional<object> find(string_view target) const;
+
+   // Removes target, the space of its object is not reclaimed. Returns
+   // false if it was not stored.
+   bool remove(string_view target);
+
+   // Number of targets, contents and locations of shared contents
+   // stored.
+   std::size_t size() const;
+
+   // Bytes of the objects that no target refers to anymore.
+   std::uint64_t dead_bytes() const;
+};
+
+}